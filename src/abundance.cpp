@@ -0,0 +1,199 @@
+#include "abundance.h"
+#include "util.h"
+#include <math.h>
+#include <algorithm>
+
+// stop when no genome with >= 1 estimated read changes more than this fraction
+static const double EM_TOLERANCE = 1e-4;
+static const int EM_MAX_ITERATIONS = 1000;
+// the genomes with fewer estimated reads are reported as 0
+static const double EM_MIN_READS = 1e-6;
+
+void EquivalenceClasses::add(const vector<uint32>& genomes, uint64 count) {
+    mCounts[genomes] += count;
+}
+
+void EquivalenceClasses::merge(EquivalenceClasses& other) {
+    if(mCounts.empty()) {
+        mCounts.swap(other.mCounts);
+        return;
+    }
+    unordered_map<vector<uint32>, uint64, GenomeSetHash>::iterator iter;
+    for(iter = other.mCounts.begin(); iter != other.mCounts.end(); iter++)
+        mCounts[iter->first] += iter->second;
+    other.mCounts.clear();
+}
+
+// the flattened multi-genome classes, the genomes of class c are genomes[offsets[c]] ... genomes[offsets[c+1]-1]
+class EMClasses {
+public:
+    vector<uint32> offsets;
+    vector<uint32> genomes;
+    vector<double> counts;
+    // the reads compatible with only one genome
+    vector<double> fixed;
+    // one buffer per thread to split the reads of the classes
+    vector<vector<double>> partial;
+};
+
+// one EM step from reads to next, returns the max relative change of the genomes with >= 1 read
+static double emStep(EMClasses& em, vector<double>& reads, vector<double>& next, int threads) {
+    int classNum = em.counts.size();
+    int genomeNum = reads.size();
+    // E step, every thread splits a range of the classes
+    run_in_threads(threads, [&](int t) {
+        vector<double>& mine = em.partial[t];
+        fill(mine.begin(), mine.end(), 0.0);
+        int from = (int)((uint64)classNum * t / threads);
+        int to = (int)((uint64)classNum * (t+1) / threads);
+        for(int c=from; c<to; c++) {
+            double total = 0.0;
+            for(uint32 i=em.offsets[c]; i<em.offsets[c+1]; i++)
+                total += reads[em.genomes[i]];
+            if(total <= 0.0)
+                continue;
+            double scale = em.counts[c] / total;
+            for(uint32 i=em.offsets[c]; i<em.offsets[c+1]; i++)
+                mine[em.genomes[i]] += reads[em.genomes[i]] * scale;
+        }
+    });
+
+    // M step, every thread sums a range of the genomes
+    vector<double> changes(threads, 0.0);
+    run_in_threads(threads, [&](int t) {
+        int from = (int)((uint64)genomeNum * t / threads);
+        int to = (int)((uint64)genomeNum * (t+1) / threads);
+        double change = 0.0;
+        for(int g=from; g<to; g++) {
+            double sum = em.fixed[g];
+            for(int p=0; p<threads; p++)
+                sum += em.partial[p][g];
+            if(sum >= 1.0)
+                change = max(change, fabs(sum - reads[g]) / sum);
+            next[g] = sum;
+        }
+        changes[t] = change;
+    });
+    return *max_element(changes.begin(), changes.end());
+}
+
+vector<double> AbundanceEstimator::estimate(EquivalenceClasses& classes, int genomeNum, int threads, int& iterations) {
+    vector<double> reads(genomeNum, 0.0);
+    iterations = 0;
+
+    // the reads compatible with only one genome never move, so only the others are iterated
+    // sorted by the genomes, so that the close classes touch the same cache lines
+    vector<pair<const vector<uint32>*, uint64>> shared;
+    unordered_map<vector<uint32>, uint64, GenomeSetHash>::iterator iter;
+    for(iter = classes.mCounts.begin(); iter != classes.mCounts.end(); iter++) {
+        if(iter->first.size() == 1)
+            reads[iter->first[0] - 1] += iter->second;
+        else
+            shared.push_back(make_pair(&iter->first, iter->second));
+    }
+    sort(shared.begin(), shared.end(), [](const pair<const vector<uint32>*, uint64>& a, const pair<const vector<uint32>*, uint64>& b) {
+        return *a.first < *b.first;
+    });
+
+    EMClasses em;
+    em.offsets.push_back(0);
+    for(int c=0; c<shared.size(); c++) {
+        const vector<uint32>& members = *shared[c].first;
+        for(int i=0; i<members.size(); i++)
+            em.genomes.push_back(members[i] - 1);
+        em.offsets.push_back(em.genomes.size());
+        em.counts.push_back(shared[c].second);
+    }
+    em.fixed = reads;
+    int classNum = em.counts.size();
+    if(classNum == 0)
+        return reads;
+
+    // start from an even split of the shared reads
+    for(int c=0; c<classNum; c++) {
+        double share = em.counts[c] / (em.offsets[c+1] - em.offsets[c]);
+        for(uint32 i=em.offsets[c]; i<em.offsets[c+1]; i++)
+            reads[em.genomes[i]] += share;
+    }
+
+    threads = max(1, min(threads, classNum));
+    em.partial = vector<vector<double>>(threads, vector<double>(genomeNum, 0.0));
+
+    // accelerated by SQUAREM (Varadhan and Roland, 2008): two EM steps give the direction of a longer step,
+    // which is then stabilized by another EM step
+    vector<double> step1(genomeNum), step2(genomeNum), extrapolated(genomeNum);
+    while(iterations < EM_MAX_ITERATIONS) {
+        iterations++;
+        if(emStep(em, reads, step1, threads) < EM_TOLERANCE) {
+            reads.swap(step1);
+            break;
+        }
+        if(emStep(em, step1, step2, threads) < EM_TOLERANCE) {
+            reads.swap(step2);
+            break;
+        }
+
+        double rr = 0.0;
+        double vv = 0.0;
+        for(int g=0; g<genomeNum; g++) {
+            double r = step1[g] - reads[g];
+            double v = step2[g] - 2 * step1[g] + reads[g];
+            rr += r * r;
+            vv += v * v;
+        }
+        double alpha = vv > 0.0 ? -sqrt(rr / vv) : -1.0;
+        alpha = min(alpha, -1.0);
+        for(int g=0; g<genomeNum; g++) {
+            double r = step1[g] - reads[g];
+            double v = step2[g] - 2 * step1[g] + reads[g];
+            extrapolated[g] = max(0.0, reads[g] - 2 * alpha * r + alpha * alpha * v);
+        }
+
+        double change = emStep(em, extrapolated, reads, threads);
+        if(change < EM_TOLERANCE)
+            break;
+    }
+
+    for(int g=0; g<genomeNum; g++) {
+        if(reads[g] < EM_MIN_READS)
+            reads[g] = 0.0;
+    }
+    return reads;
+}
+
+bool AbundanceEstimator::test() {
+    // 30 reads of genome 1 only, 10 of genome 2 only, 40 shared by both, and 5 shared by genome 2 and 3
+    EquivalenceClasses classes;
+    vector<uint32> g1(1, 1);
+    vector<uint32> g2(1, 2);
+    vector<uint32> g12;
+    g12.push_back(1);
+    g12.push_back(2);
+    vector<uint32> g23;
+    g23.push_back(2);
+    g23.push_back(3);
+    classes.add(g1, 30);
+    classes.add(g2, 10);
+    classes.add(g12, 20);
+
+    EquivalenceClasses other;
+    other.add(g12, 20);
+    other.add(g23, 5);
+    classes.merge(other);
+    if(!other.empty() || classes.size() != 4)
+        return false;
+
+    for(int threads=1; threads<=3; threads++) {
+        int iterations = 0;
+        vector<double> reads = estimate(classes, 4, threads, iterations);
+        // genome 3 has no reads of its own, so the 5 shared ones go to genome 2,
+        // then r1 = 30 + 40 * r1 / (r1 + r2) with r1 + r2 = 85, r1 = 56.67
+        if(fabs(reads[0] - 56.667) > 0.05 || fabs(reads[1] - 28.333) > 0.05)
+            return false;
+        if(reads[2] > 0.1 || reads[3] != 0.0)
+            return false;
+        if(iterations <= 1 || iterations >= EM_MAX_ITERATIONS)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef ABUNDANCE_H
+#define ABUNDANCE_H
+
+// includes
+#include <vector>
+#include <unordered_map>
+#include "common.h"
+
+using namespace std;
+
+class GenomeSetHash
+{
+public:
+    inline size_t operator()(const vector<uint32>& genomes) const {
+        uint64 h = genomes.size();
+        for(int i=0; i<genomes.size(); i++)
+            h = (h ^ genomes[i]) * 0x9E3779B97F4A7C15UL;
+        return h ^ (h >> 32);
+    }
+};
+
+// Salmon-style equivalence classes: the reads compatible with the same set of genomes are counted together
+class EquivalenceClasses
+{
+public:
+    // genomes are the sorted genome IDs
+    void add(const vector<uint32>& genomes, uint64 count = 1);
+    // moves all the classes of other to this one
+    void merge(EquivalenceClasses& other);
+    size_t size() {return mCounts.size();}
+    bool empty() {return mCounts.empty();}
+
+public:
+    unordered_map<vector<uint32>, uint64, GenomeSetHash> mCounts;
+};
+
+// expectation-maximization of the reads of every genome over the equivalence classes,
+// a read compatible with several genomes is split by their current abundance
+class AbundanceEstimator
+{
+public:
+    // returns the estimated reads of every genome, indexed by genome ID - 1
+    static vector<double> estimate(EquivalenceClasses& classes, int genomeNum, int threads, int& iterations);
+    static bool test();
+};
+
+#endif
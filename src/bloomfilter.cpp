@@ -0,0 +1,72 @@
+#include "bloomfilter.h"
+#include "util.h"
+#include <math.h>
+#include <stdlib.h>
+#include <memory.h>
+
+BloomFilter::BloomFilter() {
+    mBlocks = NULL;
+    mBlockNum = 0;
+    mHashNum = 0;
+    mFPRate = 0.0;
+    mAttached = false;
+}
+
+BloomFilter::~BloomFilter() {
+    if(mBlocks && !mAttached)
+        free(mBlocks);
+    mBlocks = NULL;
+}
+
+void BloomFilter::init(uint64 keyNum, double fpRate) {
+    if(mBlocks && !mAttached)
+        free(mBlocks);
+    mAttached = false;
+    mFPRate = fpRate;
+    // the optimal bits per key and hashes of a classic bloom filter
+    double bitsPerKey = -log(fpRate) / (log(2.0) * log(2.0));
+    mHashNum = max(1, min(16, (int)round(bitsPerKey * log(2.0))));
+    // the keys are not evenly spread over the blocks, which costs about 1/4 more bits for the same rate
+    double bits = max((uint64)1, keyNum) * bitsPerKey * 1.25;
+    mBlockNum = max((uint64)1, (uint64)ceil(bits / BF_BLOCK_BITS));
+    uint64 bytes = mBlockNum * BF_BLOCK_BITS / 8;
+    if(posix_memalign((void**)&mBlocks, 64, bytes) != 0)
+        error_exit("failed to allocate the bloom filter of " + to_string(bytes) + " bytes");
+    memset(mBlocks, 0, bytes);
+}
+
+void BloomFilter::attach(const uint64* blocks, uint64 blockNum, int hashNum, double fpRate) {
+    if(mBlocks && !mAttached)
+        free(mBlocks);
+    mAttached = true;
+    mBlocks = (uint64*)blocks;
+    mBlockNum = blockNum;
+    mHashNum = hashNum;
+    mFPRate = fpRate;
+}
+
+bool BloomFilter::test() {
+    BloomFilter bf;
+    const uint64 keyNum = 100000;
+    bf.init(keyNum, 0.01);
+    uint64 key = 0;
+    for(uint64 i=0; i<keyNum; i++) {
+        key = key * 6364136223846793005UL + 1442695040888963407UL;
+        bf.add(key * 0x9E3779B97F4A7C15UL);
+    }
+    key = 0;
+    for(uint64 i=0; i<keyNum; i++) {
+        key = key * 6364136223846793005UL + 1442695040888963407UL;
+        if(!bf.mayContain(key * 0x9E3779B97F4A7C15UL))
+            return false;
+    }
+    // the other keys of the same sequence are not added
+    uint64 falsePositives = 0;
+    for(uint64 i=0; i<keyNum * 10; i++) {
+        key = key * 6364136223846793005UL + 1442695040888963407UL;
+        if(bf.mayContain(key * 0x9E3779B97F4A7C15UL))
+            falsePositives++;
+    }
+    double rate = (double)falsePositives / (keyNum * 10);
+    return rate < 0.015 && bf.getBytes() < keyNum * 2;
+}
@@ -0,0 +1,71 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+// includes
+#include "common.h"
+
+using namespace std;
+
+// all the bits of a key are in one 64-byte block, so a probe touches one cache line
+#define BF_BLOCK_BITS 512
+#define BF_BLOCK_WORDS (BF_BLOCK_BITS / 64)
+
+// a bit-packed, cache-line-blocked bloom filter of 64-bit hashes, sized by the number of keys and a false-positive rate
+class BloomFilter
+{
+public:
+    BloomFilter();
+    ~BloomFilter();
+
+    void init(uint64 keyNum, double fpRate);
+    // uses the blocks of a filter in a mapped index file, which must live as long as this and is never added to
+    void attach(const uint64* blocks, uint64 blockNum, int hashNum, double fpRate);
+    // thread-safe, the bits are set atomically
+    inline void add(uint64 hash) {
+        uint64* block = mBlocks + blockOf(hash) * BF_BLOCK_WORDS;
+        uint64 h = remix(hash);
+        for(int i=0; i<mHashNum; i++) {
+            h *= 0xFF51AFD7ED558CCDUL;
+            uint32 bit = h >> 55;
+            __atomic_fetch_or(&block[bit >> 6], 1UL << (bit & 63), __ATOMIC_RELAXED);
+        }
+    }
+    inline bool mayContain(uint64 hash) {
+        const uint64* block = mBlocks + blockOf(hash) * BF_BLOCK_WORDS;
+        uint64 h = remix(hash);
+        for(int i=0; i<mHashNum; i++) {
+            h *= 0xFF51AFD7ED558CCDUL;
+            uint32 bit = h >> 55;
+            if((block[bit >> 6] & (1UL << (bit & 63))) == 0)
+                return false;
+        }
+        return true;
+    }
+
+    uint64 getBytes() {return mBlockNum * BF_BLOCK_BITS / 8;}
+    const uint64* getBlocks() {return mBlocks;}
+    uint64 getBlockNum() {return mBlockNum;}
+    int getHashNum() {return mHashNum;}
+    double getTargetFPRate() {return mFPRate;}
+
+    static bool test();
+
+private:
+    // the high bits of the hash pick the block, the remixed hash picks the bits
+    inline uint64 blockOf(uint64 hash) {
+        return (uint64)(((uint128)hash * mBlockNum) >> 64);
+    }
+    static inline uint64 remix(uint64 hash) {
+        return (hash ^ (hash >> 29)) | 1;
+    }
+
+private:
+    uint64* mBlocks;
+    uint64 mBlockNum;
+    // the blocks are in a mapped file, not allocated
+    bool mAttached;
+    int mHashNum;
+    double mFPRate;
+};
+
+#endif
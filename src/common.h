@@ -8,6 +8,8 @@
 typedef long int64;
 typedef unsigned long uint64;
 
+typedef unsigned __int128 uint128;
+
 typedef int int32;
 typedef unsigned int uint32;
 
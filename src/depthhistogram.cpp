@@ -0,0 +1,52 @@
+#include "depthhistogram.h"
+#include <vector>
+#include <algorithm>
+
+uint32 DepthHistogram::lowerBound(int bin) {
+    if(bin < DH_EXACT_DEPTHS)
+        return bin;
+    int octave = 6 + (bin - DH_EXACT_DEPTHS) / DH_OCTAVE_BINS;
+    uint32 sub = (bin - DH_EXACT_DEPTHS) % DH_OCTAVE_BINS;
+    return (DH_OCTAVE_BINS + sub) << (octave - 4);
+}
+
+uint32 DepthHistogram::descendingAt(const uint32* bins, uint64 rank) {
+    uint64 seen = 0;
+    for(int b=DH_BINS-1; b>=0; b--) {
+        seen += bins[b];
+        if(seen > rank)
+            return lowerBound(b);
+    }
+    return 0;
+}
+
+bool DepthHistogram::test() {
+    for(int b=0; b<DH_BINS; b++) {
+        if(bin(lowerBound(b)) != b)
+            return false;
+        if(b > 0 && bin(lowerBound(b) - 1) != b - 1)
+            return false;
+    }
+    if(bin(0xFFFFFFFFU) != DH_BINS - 1)
+        return false;
+
+    // the same as sorting the depths, exact below DH_EXACT_DEPTHS and within 1/16 above it
+    vector<uint32> depths;
+    uint32 bins[DH_BINS] = {0};
+    uint64 seed = 7;
+    for(int i=0; i<10000; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        uint32 depth = (seed >> 33) % (i % 2 ? 60 : 100000) + 1;
+        depths.push_back(depth);
+        bins[bin(depth)]++;
+    }
+    sort(depths.begin(), depths.end(), [](uint32 a, uint32 b) {return a > b;});
+    uint64 ranks[] = {0, 100, 5000, 7000, 9999};
+    for(int i=0; i<5; i++) {
+        uint32 expected = depths[ranks[i]];
+        uint32 got = descendingAt(bins, ranks[i]);
+        if(got > expected || (expected < DH_EXACT_DEPTHS && got != expected) || got < expected - expected / 16)
+            return false;
+    }
+    return descendingAt(bins, 10000) == 0;
+}
@@ -0,0 +1,35 @@
+#ifndef DEPTH_HISTOGRAM_H
+#define DEPTH_HISTOGRAM_H
+
+// includes
+#include "common.h"
+
+using namespace std;
+
+// the depths below this are counted exactly
+#define DH_EXACT_DEPTHS 64
+// the larger depths are counted in this many bins per power of 2, so within 1/16 of the depth
+#define DH_OCTAVE_BINS 16
+#define DH_BINS (DH_EXACT_DEPTHS + (32 - 6) * DH_OCTAVE_BINS)
+
+// a bounded histogram of k-mer depths, to take the median of any number of depths in DH_BINS counters
+// the bins are kept by the caller, so that the histograms of many genomes can share one array
+class DepthHistogram
+{
+public:
+    static inline int bin(uint32 depth) {
+        if(depth < DH_EXACT_DEPTHS)
+            return depth;
+        int octave = 31 - __builtin_clz(depth);
+        int sub = (depth >> (octave - 4)) & (DH_OCTAVE_BINS - 1);
+        return DH_EXACT_DEPTHS + (octave - 6) * DH_OCTAVE_BINS + sub;
+    }
+    // the smallest depth of the bin
+    static uint32 lowerBound(int bin);
+    // the rank-th (0-based) largest of the depths counted in bins, or 0 if there are not so many
+    static uint32 descendingAt(const uint32* bins, uint64 rank);
+
+    static bool test();
+};
+
+#endif
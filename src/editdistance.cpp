@@ -23,6 +23,7 @@
 #include <iostream>
 #include <bitset>
 #include <time.h>
+#include <algorithm>
 
 #include "editdistance.h"
 
@@ -130,6 +131,227 @@ unsigned int edit_distance(string a, string b) {
     return edit_distance(a.c_str(), a.length(), b.c_str(), b.length());
 }
 
+// the band is kept on the stack up to this k
+#define BOUNDED_ED_MAX_K 64
+
+// the number of leading bytes that are the same in a and b, comparing 8 bytes at a time
+static inline int common_prefix(const char *a, const char *b, int len) {
+    int i = 0;
+    while(i + 8 <= len) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if(x != y)
+            return i + (__builtin_ctzll(x ^ y) >> 3);
+        i += 8;
+    }
+    while(i < len && a[i] == b[i])
+        i++;
+    return i;
+}
+
+unsigned int bounded_edit_distance(const char *a, const unsigned int asize, const char *b, const unsigned int bsize, const unsigned int k) {
+    unsigned int sizeDiff = asize > bsize ? asize - bsize : bsize - asize;
+    if(sizeDiff > k)
+        return k + 1;
+    if(k > BOUNDED_ED_MAX_K)
+        return min(edit_distance(a, asize, b, bsize), k + 1);
+
+    // Landau-Vishkin: after e edits, furthest[d] is the furthest row i of a reached on the diagonal j - i = d,
+    // the diagonals -k-1 ~ k+1 are kept at d + k + 1, and the ones not reached yet are -1
+    const int na = asize;
+    const int nb = bsize;
+    const int target = nb - na;
+    const int offset = k + 1;
+    int rows[2][2 * BOUNDED_ED_MAX_K + 3];
+    int* prev = rows[0];
+    int* cur = rows[1];
+    for(int d=0; d<2*(int)k+3; d++) {
+        prev[d] = -1;
+        cur[d] = -1;
+    }
+    prev[offset] = common_prefix(a, b, min(na, nb));
+    if(target == 0 && prev[offset] == na)
+        return 0;
+
+    for(int e=1; e<=(int)k; e++) {
+        for(int d=-e; d<=e; d++) {
+            // a substitution keeps the diagonal, a deletion from a comes from d+1, an insertion of b comes from d-1
+            int i = prev[offset + d] >= 0 ? prev[offset + d] + 1 : -1;
+            if(prev[offset + d + 1] >= 0)
+                i = max(i, prev[offset + d + 1] + 1);
+            if(prev[offset + d - 1] >= 0)
+                i = max(i, prev[offset + d - 1]);
+            // the first cells of the diagonals are reached from the borders of the matrix
+            if(d < 0 && i < -d && -d <= e)
+                i = -d;
+            if(d > 0 && i < 0)
+                i = 0;
+            i = min(i, min(na, nb - d));
+            if(i < 0 || i + d < 0) {
+                cur[offset + d] = -1;
+                continue;
+            }
+            i += common_prefix(a + i, b + i + d, min(na - i, nb - i - d));
+            cur[offset + d] = i;
+            if(d == target && i == na)
+                return e;
+        }
+        int* tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+    return k + 1;
+}
+
+unsigned int bounded_infix_edit_distance(const char *a, const unsigned int asize, const char *b, const unsigned int bsize,
+    const unsigned int k, const unsigned int startSpan, unsigned int& bStart, unsigned int& bEnd) {
+    const unsigned int over = k + 1;
+    if(k > BOUNDED_ED_MAX_K || startSpan > 2 * BOUNDED_ED_MAX_K)
+        return over;
+
+    // the same diagonals as bounded_edit_distance(), but every diagonal 0 ~ startSpan starts at row 0 with no edit,
+    // and origin[d] keeps the column where the path reaching furthest[d] starts
+    const int na = asize;
+    const int nb = bsize;
+    const int span = startSpan;
+    const int offset = k + 1;
+    int furthest[2][4 * BOUNDED_ED_MAX_K + 3];
+    int origin[2][4 * BOUNDED_ED_MAX_K + 3];
+    int* prev = furthest[0];
+    int* cur = furthest[1];
+    int* prevOrigin = origin[0];
+    int* curOrigin = origin[1];
+    for(int d=0; d<span+2*(int)k+3; d++) {
+        prev[d] = -1;
+        cur[d] = -1;
+    }
+    for(int d=0; d<=span && d<=nb; d++) {
+        prev[offset + d] = common_prefix(a, b + d, min(na, nb - d));
+        prevOrigin[offset + d] = d;
+        if(prev[offset + d] == na) {
+            bStart = d;
+            bEnd = na + d;
+            return 0;
+        }
+    }
+
+    for(int e=1; e<=(int)k; e++) {
+        for(int d=-e; d<=span+e; d++) {
+            int i = -1;
+            int from = 0;
+            // a substitution keeps the diagonal, a deletion from a comes from d+1, an insertion of b comes from d-1
+            if(prev[offset + d] >= 0 && prev[offset + d] + 1 > i) {
+                i = prev[offset + d] + 1;
+                from = prevOrigin[offset + d];
+            }
+            if(prev[offset + d + 1] >= 0 && prev[offset + d + 1] + 1 > i) {
+                i = prev[offset + d + 1] + 1;
+                from = prevOrigin[offset + d + 1];
+            }
+            if(prev[offset + d - 1] >= 0 && prev[offset + d - 1] > i) {
+                i = prev[offset + d - 1];
+                from = prevOrigin[offset + d - 1];
+            }
+            i = min(i, min(na, nb - d));
+            if(i < 0 || i + d < 0) {
+                cur[offset + d] = -1;
+                continue;
+            }
+            i += common_prefix(a + i, b + i + d, min(na - i, nb - i - d));
+            cur[offset + d] = i;
+            curOrigin[offset + d] = from;
+            if(i == na) {
+                bStart = from;
+                bEnd = na + d;
+                return e;
+            }
+        }
+        swap(prev, cur);
+        swap(prevOrigin, curOrigin);
+    }
+    return over;
+}
+
+// the band of row i is the columns j = i - k ... i + k, stored at d = j - i + k.
+// every cell keeps all its optimal predecessors, so the traceback can keep a gap open instead of splitting it,
+// and it prefers a pair of bases, so the gaps in a repeat are shifted to its left
+unsigned int bounded_alignment(const char *a, const unsigned int asize, const char *b, const unsigned int bsize,
+    const unsigned int k, vector<unsigned char>& trace, string& ops) {
+    enum {FROM_DIAG = 1, FROM_UP = 2, FROM_LEFT = 4};
+    const unsigned int over = k + 1;
+    ops.clear();
+    if((asize > bsize ? asize - bsize : bsize - asize) > k)
+        return over;
+    const int width = 2 * k + 1;
+    const int kk = k;
+    if(trace.size() < (size_t)(asize + 1) * width)
+        trace.resize((size_t)(asize + 1) * width);
+    unsigned int rows[2][2 * 64 + 1];
+    vector<unsigned int> rowStore;
+    unsigned int* prev = rows[0];
+    unsigned int* cur = rows[1];
+    if(k > 64) {
+        rowStore.resize(2 * width);
+        prev = rowStore.data();
+        cur = prev + width;
+    }
+
+    for(int d=0; d<width; d++) {
+        int j = d - kk;
+        prev[d] = (j < 0 || j > (int)bsize) ? over : j;
+        trace[d] = FROM_LEFT;
+    }
+    for(int i=1; i<=(int)asize; i++) {
+        unsigned char* t = trace.data() + (size_t)i * width;
+        unsigned int rowMin = over;
+        for(int d=0; d<width; d++) {
+            int j = i + d - kk;
+            if(j < 0 || j > (int)bsize) {
+                cur[d] = over;
+                continue;
+            }
+            // the diagonal and the up neighbours are in the previous row, at d and d + 1
+            unsigned int up = d + 1 < width ? prev[d + 1] + 1 : over + 1;
+            unsigned int diag = j > 0 ? prev[d] + (a[i-1] == b[j-1] ? 0 : 1) : over + 1;
+            unsigned int left = j > 0 && d > 0 ? cur[d - 1] + 1 : over + 1;
+            unsigned int best = min(min(up, diag), left);
+            t[d] = (diag == best ? FROM_DIAG : 0) | (up == best ? FROM_UP : 0) | (left == best ? FROM_LEFT : 0);
+            cur[d] = min(best, over);
+            rowMin = min(rowMin, cur[d]);
+        }
+        if(rowMin > k)
+            return over;
+        swap(prev, cur);
+    }
+
+    int d = (int)bsize - (int)asize + kk;
+    unsigned int ed = prev[d];
+    if(ed > k)
+        return over;
+    int i = asize;
+    int j = bsize;
+    unsigned char last = FROM_DIAG;
+    while(i > 0 || j > 0) {
+        unsigned char from = trace[(size_t)i * width + (j - i + kk)];
+        if((from & last) == 0)
+            last = (from & FROM_DIAG) ? FROM_DIAG : ((from & FROM_UP) ? FROM_UP : FROM_LEFT);
+        if(last == FROM_DIAG) {
+            ops.push_back('M');
+            i--;
+            j--;
+        } else if(last == FROM_UP) {
+            ops.push_back('I');
+            i--;
+        } else {
+            ops.push_back('D');
+            j--;
+        }
+    }
+    reverse(ops.begin(), ops.end());
+    return ed;
+}
+
 unsigned int hamming_distance(const char *a, const unsigned int asize, const char *b, const unsigned int bsize) {
     int dis = 0;
     for(int i=0; i<min(asize, bsize); i++) {
@@ -169,5 +391,158 @@ bool editdistance_test(){
             return false;
         }
     }
+
+    // random 150 bp pairs with 0 ~ 19 edits, and every 20th pair is unrelated like the off-target seeds,
+    // bounded_edit_distance() must agree with edit_distance() up to k
+    const int pairNum = 10000;
+    const unsigned int k = 8;
+    const char bases[4] = {'A', 'T', 'C', 'G'};
+    vector<string> reads;
+    vector<string> refs;
+    srand(2020);
+    for(int p=0; p<pairNum; p++) {
+        string read(150, 'A');
+        for(int i=0; i<read.length(); i++)
+            read[i] = bases[rand() % 4];
+        string ref = read;
+        if(p % 20 == 19) {
+            for(int i=0; i<ref.length(); i++)
+                ref[i] = bases[rand() % 4];
+        }
+        int edits = p % 20;
+        for(int e=0; e<edits; e++) {
+            int pos = rand() % (ref.length() - 1);
+            if(e % 3 == 0)
+                ref[pos] = bases[rand() % 4];
+            else if(e % 3 == 1)
+                ref.erase(pos, 1);
+            else
+                ref.insert(pos, 1, bases[rand() % 4]);
+        }
+        reads.push_back(read);
+        refs.push_back(ref);
+    }
+    // short and empty sequences at the borders of the matrix
+    for(int p=0; p<10000; p++) {
+        string x(rand() % 13, 'A');
+        string y(rand() % 13, 'A');
+        for(int i=0; i<x.length(); i++)
+            x[i] = bases[rand() % 2];
+        for(int i=0; i<y.length(); i++)
+            y[i] = bases[rand() % 2];
+        unsigned int kk = p % 6;
+        unsigned int expected = min(edit_distance(x, y), kk + 1);
+        unsigned int bounded = bounded_edit_distance(x.c_str(), x.length(), y.c_str(), y.length(), kk);
+        if(bounded != expected) {
+            printf("Fail: (bounded_edit_distance), expect %u, but got %u: \n%s\n%s\n", expected, bounded, x.c_str(), y.c_str());
+            return false;
+        }
+    }
+
+    // a read in a window of a genome, against the DP with a free start in b[0, span] and a free end
+    for(int p=0; p<3000; p++) {
+        string x(rand() % 40, 'A');
+        string y(rand() % 60, 'A');
+        for(int i=0; i<x.length(); i++)
+            x[i] = bases[rand() % 4];
+        for(int i=0; i<y.length(); i++)
+            y[i] = bases[rand() % 4];
+        if(p % 2 && y.length() > 4 && x.length() > 0)
+            y.replace(rand() % 5, x.length(), x);
+        unsigned int kk = p % 9;
+        unsigned int span = rand() % 10;
+        vector<unsigned int> row(y.length() + 1);
+        for(int j=0; j<=y.length(); j++)
+            row[j] = j > span ? j - span : 0;
+        for(int i=1; i<=x.length(); i++) {
+            unsigned int diag = row[0];
+            row[0] = i;
+            for(int j=1; j<=y.length(); j++) {
+                unsigned int up = row[j];
+                row[j] = min(min(up, row[j-1]) + 1, diag + (x[i-1] == y[j-1] ? 0 : 1));
+                diag = up;
+            }
+        }
+        unsigned int expected = *min_element(row.begin(), row.end());
+        expected = min(expected, kk + 1);
+        unsigned int bStart = 0;
+        unsigned int bEnd = 0;
+        unsigned int infix = bounded_infix_edit_distance(x.c_str(), x.length(), y.c_str(), y.length(), kk, span, bStart, bEnd);
+        if(infix != expected) {
+            printf("Fail: (bounded_infix_edit_distance), expect %u, but got %u: \n%s\n%s\n", expected, infix, x.c_str(), y.c_str());
+            return false;
+        }
+        if(infix <= kk && (bStart > span || bEnd > y.length() || bStart > bEnd
+            || edit_distance(x.c_str(), x.length(), y.c_str() + bStart, bEnd - bStart) != infix)) {
+            printf("Fail: (bounded_infix_edit_distance), wrong substring [%u, %u): \n%s\n%s\n", bStart, bEnd, x.c_str(), y.c_str());
+            return false;
+        }
+    }
+
+    // the alignment has the same edits as the edit distance, and replays a to b
+    vector<unsigned char> trace;
+    string ops;
+    for(int p=0; p<pairNum; p++) {
+        const string& x = reads[p];
+        const string& y = refs[p];
+        unsigned int expected = min(edit_distance(x, y), k + 1);
+        unsigned int aligned = bounded_alignment(x.c_str(), x.length(), y.c_str(), y.length(), k, trace, ops);
+        if(aligned != expected) {
+            printf("Fail: (bounded_alignment), expect %u, but got %u: \n%s\n%s\n", expected, aligned, x.c_str(), y.c_str());
+            return false;
+        }
+        if(aligned > k)
+            continue;
+        unsigned int i = 0;
+        unsigned int j = 0;
+        unsigned int edits = 0;
+        for(int o=0; o<ops.length(); o++) {
+            if(ops[o] == 'M') {
+                if(x[i] != y[j])
+                    edits++;
+                i++;
+                j++;
+            } else if(ops[o] == 'I') {
+                edits++;
+                i++;
+            } else {
+                edits++;
+                j++;
+            }
+        }
+        if(i != x.length() || j != y.length() || edits != aligned) {
+            printf("Fail: (bounded_alignment), wrong alignment %s: \n%s\n%s\n", ops.c_str(), x.c_str(), y.c_str());
+            return false;
+        }
+    }
+
+    // [0] for the similar pairs, [1] for the unrelated ones
+    vector<unsigned int> full(pairNum);
+    double fullTime[2] = {0, 0};
+    double boundedTime[2] = {0, 0};
+    int pairs[2] = {0, 0};
+    for(int p=0; p<pairNum; p++) {
+        int unrelated = p % 20 == 19 ? 1 : 0;
+        clock_t t1 = clock();
+        for(int r=0; r<10; r++)
+            full[p] = edit_distance(reads[p].c_str(), reads[p].length(), refs[p].c_str(), refs[p].length());
+        clock_t t2 = clock();
+        unsigned int bounded = 0;
+        for(int r=0; r<10; r++)
+            bounded = bounded_edit_distance(reads[p].c_str(), reads[p].length(), refs[p].c_str(), refs[p].length(), k);
+        clock_t t3 = clock();
+        if(bounded != min(full[p], k + 1)) {
+            printf("Fail: (bounded_edit_distance), expect %u, but got %u: \n%s\n%s\n", min(full[p], k + 1), bounded, reads[p].c_str(), refs[p].c_str());
+            return false;
+        }
+        fullTime[unrelated] += t2 - t1;
+        boundedTime[unrelated] += t3 - t2;
+        pairs[unrelated] += 10;
+    }
+    const char* names[2] = {"similar", "unrelated"};
+    for(int u=0; u<2; u++) {
+        printf("%s 150 bp pairs: edit_distance %.0f ns per call, bounded_edit_distance (k=%u) %.0f ns per call\n", names[u],
+            fullTime[u] * 1e9 / CLOCKS_PER_SEC / pairs[u], k, boundedTime[u] * 1e9 / CLOCKS_PER_SEC / pairs[u]);
+    }
     return true;
 }
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 // struct PatternMap {
 //     uint64_t p_[256][4];
@@ -18,6 +19,21 @@ unsigned int edit_distance(const char *a, const unsigned int asize, const char *
 
 unsigned int edit_distance(string a, string b);
 
+// the edit distance if it's <= k, or k + 1 if it's larger, in O(k * k) extensions along the 2k+1 diagonals
+// around the main one, so the cost follows the number of edits rather than the length
+unsigned int bounded_edit_distance(const char *a, const unsigned int asize, const char *b, const unsigned int bsize, const unsigned int k);
+
+// the smallest edit distance of a to a substring of b starting in b[0, startSpan], if it's <= k, or k + 1 if it's larger.
+// the substring is set to b[bStart, bEnd), startSpan is up to 128
+unsigned int bounded_infix_edit_distance(const char *a, const unsigned int asize, const char *b, const unsigned int bsize,
+    const unsigned int k, const unsigned int startSpan, unsigned int& bStart, unsigned int& bEnd);
+
+// the global alignment of a to b with the least edits, if the edit distance is <= k, or k + 1 if it's larger.
+// the alignment is set to ops: 'M' for a pair of bases (equal or not), 'I' for a base only in a, 'D' for a base only in b,
+// trace is the (asize + 1) * (2k + 1) bytes of the DP band, kept by the caller to be reused
+unsigned int bounded_alignment(const char *a, const unsigned int asize, const char *b, const unsigned int bsize,
+    const unsigned int k, vector<unsigned char>& trace, string& ops);
+
 unsigned int hamming_distance(const char *a, const unsigned int asize, const char *b, const unsigned int bsize);
 
 bool editdistance_test();
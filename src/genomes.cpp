@@ -2,21 +2,46 @@
 #include "util.h"
 #include "kmer.h"
 #include "editdistance.h"
+#include "zlib/zlib.h"
 #include <sstream>
-#include <memory.h>
-
-// we use 512M memory
-const int BLOOM_FILTER_LENGTH = (1<<29);
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <functional>
+
+SpacedSeed::SpacedSeed(string pattern) {
+    mPattern = pattern;
+    mSpan = pattern.length();
+    mWeight = 0;
+    mMask = 0;
+    for(int i=0; i<mSpan; i++) {
+        mMask = (mMask << 2);
+        if(pattern[i] == '1') {
+            mMask += 0x03;
+            mWeight++;
+        }
+    }
+}
 
 Genomes::Genomes(string faFile, Options* opt)
 {
-    mFastaReader = new FastaReader(faFile);
     mOptions = opt;
-    mBloomFilterArray = NULL;
-    mFastaReader->readAll();
+    mWorkersMerged = false;
+    mFastaReader = NULL;
+    mGenomeBases = NULL;
+    mMappedData = NULL;
+    mMappedSize = 0;
+    if(isIndexFile(faFile)) {
+        mapIndex(faFile);
+        mLoadingTimer.lap("map");
+    } else if(mOptions->sharedIndexDir.empty() || !attachSharedIndex(faFile)) {
+        buildIndex(faFile);
+    }
     init();
-    mMissedCount = 0;
-    mHitCount = 0;
 }
 
 Genomes::~Genomes()
@@ -25,60 +50,570 @@ Genomes::~Genomes()
         delete mFastaReader;
         mFastaReader = NULL;
     }
-    if(mBloomFilterArray) {
-        delete mBloomFilterArray;
-        mBloomFilterArray = NULL;
+    // the tables and the bloom filter point to the mapped index
+    if(mMappedData) {
+        munmap(mMappedData, mMappedSize);
+        mMappedData = NULL;
     }
+}
 
-    //cerr << "mMissedCount: " << mMissedCount << endl;
-    //cerr << "mHitCount: " << mHitCount << endl;
+bool Genomes::isIndexFile(string filename) {
+    return ends_with(filename, GENOMES_INDEX_EXT);
 }
 
 void Genomes::init() {
-    initLowComplexityKeys();
-    map<string, string> genomes = mFastaReader->contigs();
+    mGenomeNum = mNames.size();
+    mTotalEditDistance.resize(mGenomeNum, 0);
+    mReads.resize(mGenomeNum, 0);
+    mBases.resize(mGenomeNum, 0);
+
+    if(mOptions->statsBinSize == 0) {
+        initBinSize();
+    }
+
+    mBinStarts.push_back(0);
+    for(int i=0; i<mGenomeNum; i++) {
+        // a genome shorter than a bin still has one
+        int binNum = max((uint64)1, ((uint64)genomeLen(i) + 1)/mOptions->statsBinSize);
+        mCoverage.push_back(vector<double>(binNum, 0));
+        mEditDistance.push_back(vector<double>(binNum, 0));
+        mBinStarts.push_back(mBinStarts[i] + binNum);
+    }
+    initBlockGenomes();
+
+    mWorkers = vector<GenomeWorker>(max(1, mOptions->thread));
+    for(int t=0; t<mWorkers.size(); t++) {
+        GenomeWorker& worker = mWorkers[t];
+        worker.mResults.resize(mGenomeNum);
+        worker.mAnchors.resize(mGenomeNum);
+        worker.mDepth.resize(mBinStarts[mGenomeNum], 0);
+        worker.mEditDistance.resize(mBinStarts[mGenomeNum], 0);
+        if(!mOptions->depthBedGraphFile.empty())
+            worker.mDepthDiff.resize(mGenomeStarts[mGenomeNum] + mGenomeNum, 0);
+        if(mOptions->needPileup())
+            worker.mPileup.resize(mGenomeNum);
+        worker.mReads.resize(mGenomeNum, 0);
+        worker.mBases.resize(mGenomeNum, 0);
+        worker.mTotalEditDistance.resize(mGenomeNum, 0);
+        worker.mBloomRejectedCount = 0;
+        worker.mMissedCount = 0;
+    }
+
+    if(mOptions->verbose)
+        loginfo("Genomes loaded with " + to_string(mOptions->thread) + " thread(s): " + mLoadingTimer.summary());
+}
+
+void Genomes::buildIndex(string faFile) {
+    mFastaReader = new FastaReader(faFile);
+    mFastaReader->readAll();
+    mLoadingTimer.lap("read");
+    loadFasta();
+    mGenomeNum = mNames.size();
+
+    initSpacedSeeds();
+    mLoadingTimer.lap("spaced_seeds");
+
+    if(KmerKey<uint64>::fits(mOptions->kmerKeyLen))
+        initKmerTables<uint64>();
+    else
+        initKmerTables<uint128>();
+}
+
+void Genomes::loadFasta() {
+    mKmerTableShards = mOptions->thread;
+    if(KmerKey<uint64>::fits(mOptions->kmerKeyLen))
+        initLowComplexityKeys<uint64>();
+    else
+        initLowComplexityKeys<uint128>();
+    mLoadingTimer.lap("low_complexity_keys");
+    map<string, string>& genomes = mFastaReader->contigs();
     map<string, string>::iterator iter;
-    mGenomeNum = 0;
+    // the packed positions are 32 bits
+    uint64 totalLen = 0;
     for(iter = genomes.begin(); iter != genomes.end() ; iter++) {
-        if(mGenomeNum >= 255) {
-            cerr << "fastv only supports up to 255 genomes, other genomes will be skipped." << endl;
-            break;
-        }
-        if(iter->second.size() >= 0xFFFFFF) {
-            cerr << "fastv only supports genome size up to 16M, skip " << iter->first << " (" << iter->second.size() << " bp)" << endl;
+        if(totalLen + iter->second.size() >= 0xFFFFFFFFUL)
+            continue;
+        totalLen += iter->second.size();
+    }
+    mGenomeData.reserve(totalLen);
+    mGenomeStarts.push_back(0);
+    for(iter = genomes.begin(); iter != genomes.end() ; iter++) {
+        if(mGenomeData.size() + iter->second.size() >= 0xFFFFFFFFUL) {
+            cerr << "fastv only supports genomes up to 4G bases in total, skip " << iter->first << " (" << iter->second.size() << " bp)" << endl;
             continue;
         }
         mNames.push_back(iter->first);
-        mTotalEditDistance.push_back(0);
-        mReads.push_back(0);
-        mBases.push_back(0);
-        mSequences.push_back(iter->second);
+        mGenomeData += iter->second;
+        mGenomeStarts.push_back(mGenomeData.size());
+    }
+    mGenomeBases = mGenomeData.data();
+
+    // the bases are all in mGenomeData now
+    delete mFastaReader;
+    mFastaReader = NULL;
+}
 
-        mGenomeNum++;
+void Genomes::initBlockGenomes() {
+    uint32 blockNum = (mGenomeStarts[mGenomeNum] >> GENOME_BLOCK_BITS) + 1;
+    uint32 id = 0;
+    for(uint32 b=0; b<blockNum; b++) {
+        uint64 blockStart = (uint64)b << GENOME_BLOCK_BITS;
+        while(id + 1 < mGenomeNum && mGenomeStarts[id + 1] <= blockStart)
+            id++;
+        mBlockGenomes.push_back(id);
     }
+    mBlockGenomes.push_back(max(mGenomeNum - 1, 0));
+}
 
-    if(mOptions->statsBinSize == 0) {
-        initBinSize();
+static string joinSpacedSeeds(const vector<string>& patterns) {
+    string joined;
+    for(int i=0; i<patterns.size(); i++)
+        joined += (i == 0 ? "" : ",") + patterns[i];
+    return joined;
+}
+
+// the bytes of the k-mer tables of the shards, then of the spaced seeds
+template<typename KeyType>
+uint64 Genomes::kmerTableBytes(vector<uint64>& tableBytes) {
+    uint64 total = 0;
+    tableBytes.clear();
+    for(int t=0; t<mKmerTableShards; t++)
+        tableBytes.push_back(kmerTables<KeyType>()[t].serializedBytes());
+    for(int s=0; s<mSpacedSeeds.size(); s++)
+        tableBytes.push_back(mSpacedSeeds[s].mKmerIndex.serializedBytes());
+    for(int i=0; i<tableBytes.size(); i++)
+        total += tableBytes[i];
+    return total;
+}
+
+template<typename KeyType>
+char* Genomes::serializeKmerTables(char* p) {
+    for(int t=0; t<mKmerTableShards; t++)
+        p = kmerTables<KeyType>()[t].serialize(p);
+    for(int s=0; s<mSpacedSeeds.size(); s++)
+        p = mSpacedSeeds[s].mKmerIndex.serialize(p);
+    return p;
+}
+
+template<typename KeyType>
+bool Genomes::attachKmerTables(const char* data, const uint64* tableBytes) {
+    kmerTables<KeyType>().resize(mKmerTableShards);
+    for(int t=0; t<mKmerTableShards; t++) {
+        if(!kmerTables<KeyType>()[t].attach(data, *tableBytes))
+            return false;
+        data += *(tableBytes++);
+    }
+    for(int s=0; s<mSpacedSeeds.size(); s++) {
+        if(!mSpacedSeeds[s].mKmerIndex.attach(data, *tableBytes))
+            return false;
+        data += *(tableBytes++);
     }
+    return true;
+}
 
-    for(iter = genomes.begin(); iter != genomes.end() ; iter++) {
-        int binNum = (iter->second.length() + 1)/mOptions->statsBinSize;
-        mCoverage.push_back(vector<float>(binNum, 0));
-        mEditDistance.push_back(vector<float>(binNum, 0));
+uint64 Genomes::indexBytes() {
+    string names;
+    for(int i=0; i<mGenomeNum; i++)
+        names += mNames[i] + '\0';
+    vector<uint64> tableBytes;
+    uint64 tables = KmerKey<uint64>::fits(mOptions->kmerKeyLen) ? kmerTableBytes<uint64>(tableBytes) : kmerTableBytes<uint128>(tableBytes);
+    return index_section_bytes(sizeof(GenomesIndexHeader)) + index_section_bytes(names.size())
+        + index_section_bytes(joinSpacedSeeds(mOptions->spacedSeedPatterns).size() + 1)
+        + index_section_bytes(sizeof(uint32) * (mGenomeNum + 1)) + index_section_bytes(mGenomeStarts[mGenomeNum])
+        + index_section_bytes(sizeof(uint64) * tableBytes.size()) + tables + index_section_bytes(mBloomFilter.getBytes());
+}
+
+void Genomes::serializeIndex(char* data) {
+    string names;
+    for(int i=0; i<mGenomeNum; i++)
+        names += mNames[i] + '\0';
+    string seeds = joinSpacedSeeds(mOptions->spacedSeedPatterns);
+    bool narrow = KmerKey<uint64>::fits(mOptions->kmerKeyLen);
+    vector<uint64> tableBytes;
+    if(narrow)
+        kmerTableBytes<uint64>(tableBytes);
+    else
+        kmerTableBytes<uint128>(tableBytes);
+
+    GenomesIndexHeader header;
+    memset(&header, 0, sizeof(GenomesIndexHeader));
+    memcpy(header.mMagic, GENOMES_INDEX_MAGIC, sizeof(header.mMagic));
+    header.mVersion = GENOMES_INDEX_VERSION;
+    header.mKeyLen = mOptions->kmerKeyLen;
+    header.mPolyATailLen = GENOME_POLYA_TAIL_LEN;
+    header.mLowComplexityDiffs = GENOME_LOW_COMPLEXITY_DIFFS;
+    header.mGenomeNum = mGenomeNum;
+    header.mShardNum = mKmerTableShards;
+    header.mSpacedSeedNum = mSpacedSeeds.size();
+    header.mBloomHashNum = mBloomFilter.getHashNum();
+    header.mTotalBases = mGenomeStarts[mGenomeNum];
+    header.mNamesBytes = names.size();
+    header.mSpacedSeedBytes = seeds.size() + 1;
+    header.mBloomBlockNum = mBloomFilter.getBlockNum();
+    header.mBloomFPRate = mBloomFilter.getTargetFPRate();
+
+    char* sections = data + index_section_bytes(sizeof(GenomesIndexHeader));
+    char* p = sections;
+    p = copy_index_section(p, names.c_str(), names.size());
+    p = copy_index_section(p, seeds.c_str(), seeds.size() + 1);
+    p = copy_index_section(p, (const char*)mGenomeStarts.data(), sizeof(uint32) * (mGenomeNum + 1));
+    header.mMetaChecksum = index_checksum(sections, p - sections);
+    p = copy_index_section(p, mGenomeBases, mGenomeStarts[mGenomeNum]);
+    char* tableBytesSection = p;
+    p = copy_index_section(p, (const char*)tableBytes.data(), sizeof(uint64) * tableBytes.size());
+    header.mMetaChecksum = index_checksum(tableBytesSection, p - tableBytesSection, header.mMetaChecksum);
+    p = narrow ? serializeKmerTables<uint64>(p) : serializeKmerTables<uint128>(p);
+    p = copy_index_section(p, (const char*)mBloomFilter.getBlocks(), mBloomFilter.getBytes());
+
+    header.mDataChecksum = index_checksum(sections, p - sections);
+    header.mHeaderChecksum = index_checksum((const char*)&header, offsetof(GenomesIndexHeader, mHeaderChecksum));
+    copy_index_section(data, (const char*)&header, sizeof(GenomesIndexHeader));
+}
+
+// the file is sized by ftruncate() and written through mmap(), like the k-mer collection index
+void Genomes::writeIndex(string filename) {
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        error_exit("Failed to write the genomes index: " + filename);
+    bool ok = writeIndexFile(fd);
+    close(fd);
+    if(!ok)
+        error_exit("Failed to write the genomes index: " + filename);
+}
+
+bool Genomes::writeIndexFile(int fd) {
+    uint64 bytes = indexBytes();
+    bool ok = ftruncate(fd, bytes) == 0;
+    void* data = ok ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if(data == MAP_FAILED)
+        return false;
+    serializeIndex((char*)data);
+    ok = msync(data, bytes, MS_SYNC) == 0;
+    munmap(data, bytes);
+    return ok;
+}
+
+// the index is mapped read-only, so that concurrent jobs share the bases and the tables in the page cache,
+// only the coverage tallies are allocated per process
+void Genomes::mapIndex(string filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        error_exit("Failed to open the genomes index: " + filename);
+    string error;
+    bool ok = mapIndexFile(fd, filename, error);
+    close(fd);
+    if(!ok)
+        error_exit(error);
+}
+
+// nothing is left mapped if it fails
+bool Genomes::mapIndexFile(int fd, string filename, string& error) {
+    error = "Not a valid fastv genomes index, please rebuild it with `fastv index -g`: " + filename;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < index_section_bytes(sizeof(GenomesIndexHeader)))
+        return false;
+    void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(mapped == MAP_FAILED) {
+        error = "Failed to map the genomes index: " + filename;
+        return false;
+    }
+    mMappedData = (char*)mapped;
+    mMappedSize = st.st_size;
+    const char* data = mMappedData;
+
+    const GenomesIndexHeader* header = (const GenomesIndexHeader*)data;
+    bool valid = memcmp(header->mMagic, GENOMES_INDEX_MAGIC, sizeof(header->mMagic)) == 0;
+    if(valid && header->mVersion != GENOMES_INDEX_VERSION) {
+        error = "The genomes index version " + to_string(header->mVersion) + " is not supported by this fastv (version " + to_string(GENOMES_INDEX_VERSION) + "), please rebuild it with `fastv index -g`: " + filename;
+        valid = false;
+    }
+    valid = valid && header->mHeaderChecksum == index_checksum((const char*)header, offsetof(GenomesIndexHeader, mHeaderChecksum));
+    if(valid && header->mKeyLen != mOptions->kmerKeyLen) {
+        error = "The genomes index is built with k=" + to_string(header->mKeyLen) + ", but k=" + to_string(mOptions->kmerKeyLen) + " is used, please rebuild it with `fastv index -g --key_len " + to_string(mOptions->kmerKeyLen) + "`: " + filename;
+        valid = false;
+    }
+    if(valid && (header->mPolyATailLen != GENOME_POLYA_TAIL_LEN || header->mLowComplexityDiffs != GENOME_LOW_COMPLEXITY_DIFFS)) {
+        error = "The genomes index is built with another rule of low complexity k-mers, please rebuild it with `fastv index -g`: " + filename;
+        valid = false;
+    }
+    valid = valid && header->mGenomeNum > 0 && header->mShardNum > 0 && header->mTotalBases < 0xFFFFFFFFUL && header->mSpacedSeedBytes > 0;
+    if(!valid) {
+        unmapIndex();
+        return false;
+    }
+
+    uint64 nameOffset = index_section_bytes(sizeof(GenomesIndexHeader));
+    uint64 seedOffset = nameOffset + index_section_bytes(header->mNamesBytes);
+    uint64 startOffset = seedOffset + index_section_bytes(header->mSpacedSeedBytes);
+    uint64 baseOffset = startOffset + index_section_bytes(sizeof(uint32) * (header->mGenomeNum + 1));
+    uint64 tableBytesOffset = baseOffset + index_section_bytes(header->mTotalBases);
+    uint64 tableNum = header->mShardNum + header->mSpacedSeedNum;
+    uint64 tableOffset = tableBytesOffset + index_section_bytes(sizeof(uint64) * tableNum);
+    if(tableOffset > st.st_size) {
+        unmapIndex();
+        return false;
+    }
+    // the bases and the tables are only read by the alignment, page by page, unless they are verified
+    uint32 metaChecksum = index_checksum(data + nameOffset, baseOffset - nameOffset);
+    if(header->mMetaChecksum != index_checksum(data + tableBytesOffset, tableOffset - tableBytesOffset, metaChecksum)) {
+        error = "Checksum mismatch, the genomes index is corrupted: " + filename;
+        unmapIndex();
+        return false;
+    }
+    const uint64* tableBytes = (const uint64*)(data + tableBytesOffset);
+    uint64 bloomOffset = tableOffset;
+    for(uint64 t=0; t<tableNum; t++)
+        bloomOffset += tableBytes[t];
+    uint64 end = bloomOffset + header->mBloomBlockNum * BF_BLOCK_BITS / 8;
+    valid = end <= st.st_size && data[nameOffset + header->mNamesBytes - 1] == '\0' && data[seedOffset + header->mSpacedSeedBytes - 1] == '\0';
+    if(valid && mOptions->verifyIndex && header->mDataChecksum != index_checksum(data + nameOffset, end - nameOffset)) {
+        error = "Checksum mismatch, the genomes index is corrupted: " + filename;
+        valid = false;
+    }
+
+    // the spaced seeds are part of the tables
+    string seeds = valid ? string(data + seedOffset) : "";
+    if(valid && seeds != joinSpacedSeeds(mOptions->spacedSeedPatterns)) {
+        error = "The genomes index is built with spaced seeds (" + (seeds.empty() ? string("none") : seeds) + "), but (" + joinSpacedSeeds(mOptions->spacedSeedPatterns) + ") are given, please rebuild it with `fastv index -g --spaced_seeds`: " + filename;
+        valid = false;
+    }
+    valid = valid && mOptions->spacedSeedPatterns.size() == header->mSpacedSeedNum;
+    if(!valid) {
+        unmapIndex();
+        return false;
+    }
+    for(int s=0; s<mOptions->spacedSeedPatterns.size(); s++)
+        mSpacedSeeds.push_back(SpacedSeed(mOptions->spacedSeedPatterns[s]));
+
+    const char* name = data + nameOffset;
+    for(uint32 i=0; i<header->mGenomeNum; i++) {
+        valid = name < data + nameOffset + header->mNamesBytes;
+        if(!valid)
+            break;
+        mNames.push_back(string(name));
+        name += strlen(name) + 1;
+    }
+    const uint32* starts = (const uint32*)(data + startOffset);
+    mGenomeStarts.assign(starts, starts + header->mGenomeNum + 1);
+    for(uint32 i=0; i<header->mGenomeNum; i++)
+        valid = valid && mGenomeStarts[i] <= mGenomeStarts[i + 1];
+    valid = valid && mGenomeStarts[0] == 0 && mGenomeStarts[header->mGenomeNum] == header->mTotalBases;
+    mGenomeBases = data + baseOffset;
+
+    mKmerTableShards = header->mShardNum;
+    if(valid) {
+        valid = KmerKey<uint64>::fits(mOptions->kmerKeyLen) ? attachKmerTables<uint64>(data + tableOffset, tableBytes)
+            : attachKmerTables<uint128>(data + tableOffset, tableBytes);
+    }
+    if(!valid) {
+        unmapIndex();
+        return false;
+    }
+    mBloomFilter.attach((const uint64*)(data + bloomOffset), header->mBloomBlockNum, header->mBloomHashNum, header->mBloomFPRate);
+
+    if(mOptions->verbose)
+        loginfo("Mapped genomes index: " + filename + ", " + to_string(header->mGenomeNum) + " genomes, " + to_string(header->mTotalBases) + " bases");
+    return true;
+}
+
+void Genomes::unmapIndex() {
+    if(!mMappedData)
+        return;
+    clearTables();
+    munmap(mMappedData, mMappedSize);
+    mMappedData = NULL;
+    mMappedSize = 0;
+}
+
+void Genomes::clearTables() {
+    mNames.clear();
+    mSpacedSeeds.clear();
+    mGenomeStarts.clear();
+    mGenomeBases = NULL;
+    string().swap(mGenomeData);
+    vector<KmerIndex<uint64>>().swap(mKmerTables);
+    vector<KmerIndex<uint128>>().swap(mWideKmerTables);
+    mLowComplexityKeys.clear();
+    mWideLowComplexityKeys.clear();
+    mGenomeNum = 0;
+}
+
+// the shared index is keyed by the genomes file and the options changing the tables
+string Genomes::sharedIndexPath(string faFile) {
+    char* resolved = realpath(faFile.c_str(), NULL);
+    string fullpath = resolved ? string(resolved) : faFile;
+    free(resolved);
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    ::stat(faFile.c_str(), &st);
+    stringstream ss;
+    ss << fullpath << ":" << st.st_size << ":" << st.st_mtime << ":" << mOptions->kmerKeyLen << ":" << joinSpacedSeeds(mOptions->spacedSeedPatterns) << ":" << GENOMES_INDEX_VERSION;
+    stringstream name;
+    name << "fastv_genomes_" << hex << hash<string>()(ss.str()) << GENOMES_INDEX_EXT;
+    return joinpath(mOptions->sharedIndexDir, name.str());
+}
+
+// the same protocol as the shared k-mer collection index: the first process builds the index
+// in the shared directory while holding an exclusive lock, the others wait for the lock and map it read-only
+bool Genomes::attachSharedIndex(string faFile) {
+    string path = sharedIndexPath(faFile);
+    string error;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd >= 0) {
+        flock(fd, LOCK_EX);
+        buildIndex(faFile);
+        bool ok = writeIndexFile(fd);
+        flock(fd, LOCK_UN);
+        mLoadingTimer.lap("write");
+        if(!ok) {
+            close(fd);
+            unlink(path.c_str());
+            // the private copy is built already
+            cerr << "WARNING: failed to write the shared genomes index " << path << ", use a private copy" << endl;
+            return true;
+        }
+        // switch to the shared copy to release the private one
+        clearTables();
+        ok = mapIndexFile(fd, path, error);
+        close(fd);
+        if(!ok)
+            error_exit(error);
+        mLoadingTimer.lap("map");
+        if(mOptions->verbose)
+            loginfo("Built shared genomes index: " + path);
+        return true;
+    }
+
+    fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        cerr << "WARNING: cannot open the shared genomes index " << path << ", use a private copy" << endl;
+        return false;
+    }
+    // wait for the process building it, it may not have taken the lock yet if the file is still empty
+    struct stat st;
+    for(int retry=0; retry<50; retry++) {
+        flock(fd, LOCK_SH);
+        if(fstat(fd, &st) == 0 && st.st_size > 0)
+            break;
+        flock(fd, LOCK_UN);
+        usleep(100000);
+    }
+    bool ok = mapIndexFile(fd, path, error);
+    flock(fd, LOCK_UN);
+    close(fd);
+    mLoadingTimer.lap("map");
+    if(!ok) {
+        cerr << "WARNING: " << error << endl;
+        cerr << "WARNING: please remove " << path << ", use a private copy now" << endl;
+        return false;
+    }
+    return true;
+}
+
+void Genomes::initSpacedSeeds() {
+    for(int i=0; i<mOptions->spacedSeedPatterns.size(); i++) {
+        mSpacedSeeds.push_back(SpacedSeed(mOptions->spacedSeedPatterns[i]));
+    }
+    if(mSpacedSeeds.empty())
+        return;
+
+    // the seed tables are built in parallel
+    int threads = min(mOptions->thread, (int)mSpacedSeeds.size());
+    run_in_threads(threads, [&](int t) {
+        for(int s=t; s<mSpacedSeeds.size(); s+=threads)
+            buildSpacedSeedTable(s);
+    });
+}
+
+void Genomes::buildSpacedSeedTable(int s) {
+    SpacedSeed& seed = mSpacedSeeds[s];
+    vector<pair<uint64, uint32>> entries;
+    for(uint32 i=0; i<mNames.size(); i++) {
+        const char* seq = genomeSeq(i);
+        uint64 seqLen = genomeLen(i);
+        uint64 key = 0;
+        // how many continuous valid bases have been rolled into the key
+        int validBases = 0;
+        for(uint32 p = 0; p < seqLen; p++) {
+            key = (key << 2);
+            switch(seq[p]) {
+                case 'A':
+                    key += 0;
+                    break;
+                case 'T':
+                    key += 1;
+                    break;
+                case 'C':
+                    key += 2;
+                    break;
+                case 'G':
+                    key += 3;
+                    break;
+                case 'N':
+                default:
+                    validBases = 0;
+                    continue;
+            }
+            validBases++;
+            if(validBases < seed.mSpan)
+                continue;
+            uint32 pos = p + 1 - seed.mSpan;
+            // skip the polyA tail
+            if(pos + seed.mSpan + GENOME_POLYA_TAIL_LEN >= seqLen)
+                continue;
+            uint64 spacedKey = key & seed.mMask;
+            if(isLowComplexitySpacedKey(spacedKey, seed))
+                continue;
+            entries.push_back(make_pair(spacedKey, packIdPos(i, pos)));
+        }
     }
+    seed.mKmerIndex.build(entries);
+}
+
+bool Genomes::isLowComplexitySpacedKey(uint64 key, SpacedSeed& seed) {
+    // same rule as the contiguous keys: only GENOME_LOW_COMPLEXITY_DIFFS compared bases differ from the others
+    int counts[4] = {0, 0, 0, 0};
+    for(int i=0; i<seed.mSpan; i++) {
+        if(seed.mPattern[seed.mSpan - 1 - i] == '1')
+            counts[(key >> (2*i)) & 0x03]++;
+    }
+    int maxCount = max(max(counts[0], counts[1]), max(counts[2], counts[3]));
+    return maxCount >= seed.mWeight - GENOME_LOW_COMPLEXITY_DIFFS;
+}
+
+bool Genomes::findSpacedKey(int seed, uint64 key, const uint32*& begin, const uint32*& end, GenomeWorker& worker) {
+    if(!mBloomFilter.mayContain(spacedBloomKey(seed, key))) {
+        worker.mBloomRejectedCount++;
+        return false;
+    }
+
+    bool hit = mSpacedSeeds[seed].mKmerIndex.find(key, begin, end);
+    if(!hit)
+        worker.mMissedCount++;
+    return hit;
+}
 
-    buildKmerTable();
-    initBloomFilter();
+double Genomes::getBloomFilterFPRate() {
+    long rejected = 0;
+    long missed = 0;
+    for(int t=0; t<mWorkers.size(); t++) {
+        rejected += mWorkers[t].mBloomRejectedCount;
+        missed += mWorkers[t].mMissedCount;
+    }
+    if(rejected + missed == 0)
+        return 0.0;
+    return (double)missed / (rejected + missed);
 }
 
 void Genomes::initBinSize() {
-    int maxSize = 0;
+    uint64 maxSize = 0;
     for(int i=0; i<mGenomeNum; i++) {
-        if(mSequences[i].length() > maxSize)
-            maxSize = mSequences[i].length();
+        if(genomeLen(i) > maxSize)
+            maxSize = genomeLen(i);
     }
 
-    int binSize = maxSize / 1600;
+    uint64 binSize = maxSize / 1600;
 
     if(binSize < 1)
         mOptions->statsBinSize = 1;
@@ -96,71 +631,111 @@ void Genomes::initBinSize() {
         mOptions->statsBinSize = 100000;
 }
 
-void Genomes::initBloomFilter() {
-    mBloomFilterArray = new char[BLOOM_FILTER_LENGTH];
-    memset(mBloomFilterArray, 0, BLOOM_FILTER_LENGTH * sizeof(char));
+template<typename KeyType>
+void Genomes::initKmerTables() {
+    int threads = mKmerTableShards;
+    // every thread collects the k-mers starting in its range of the concatenated genomes, scattered to the shards,
+    // then every thread gathers the k-mers of its own shard in the order of the ranges, and builds its table
+    vector<vector<vector<pair<KeyType, uint32>>>> scattered(threads, vector<vector<pair<KeyType, uint32>>>(threads));
+    uint64 totalBases = mGenomeStarts[mGenomeNum];
+    run_in_threads(threads, [&](int t) {
+        collectKmers<KeyType>(totalBases * t / threads, totalBases * (t + 1) / threads, scattered[t]);
+    });
+    mLoadingTimer.lap("kmer_scatter");
+
+    kmerTables<KeyType>().resize(threads);
+    run_in_threads(threads, [&](int shard) {
+        uint64 entryNum = 0;
+        for(int t=0; t<threads; t++)
+            entryNum += scattered[t][shard].size();
+        vector<pair<KeyType, uint32>> entries;
+        entries.swap(scattered[0][shard]);
+        entries.reserve(entryNum);
+        for(int t=1; t<threads; t++) {
+            entries.insert(entries.end(), scattered[t][shard].begin(), scattered[t][shard].end());
+            vector<pair<KeyType, uint32>>().swap(scattered[t][shard]);
+        }
+        kmerTables<KeyType>()[shard].build(entries);
+    });
+    mLoadingTimer.lap("kmer_table");
 
-    //update bloom filter array
-    const unsigned long long int bloomFilterFactors[3] = {1713137323, 371371377, 7341234131};
+    initBloomFilter<KeyType>();
+    mLoadingTimer.lap("bloom_filter");
+}
 
-    unordered_map<uint64, list<uint32>>::iterator iter;
-    for(iter = mKmerTable.begin(); iter != mKmerTable.end(); iter++) {
-        uint64 key = iter->first;
-        for(int b=0; b<3; b++) {
-            mBloomFilterArray[(bloomFilterFactors[b] * key) & (BLOOM_FILTER_LENGTH-1) ] = 1;
+template<typename KeyType>
+void Genomes::initBloomFilter() {
+    int threads = mKmerTableShards;
+    uint64 keyNum = 0;
+    for(int t=0; t<threads; t++)
+        keyNum += kmerTables<KeyType>()[t].size();
+    for(int s=0; s<mSpacedSeeds.size(); s++)
+        keyNum += mSpacedSeeds[s].mKmerIndex.size();
+    mBloomFilter.init(keyNum, BLOOM_FILTER_FP_RATE);
+
+    // every thread adds the keys of its own shard, the bits are set atomically since the shards share them
+    run_in_threads(threads, [&](int t) {
+        KmerIndex<KeyType>& table = kmerTables<KeyType>()[t];
+        const KeyType* keys = table.keys();
+        for(uint64 i=0; i<table.size(); i++)
+            mBloomFilter.add(bloomKey<KeyType>(keys[i]));
+
+        for(int s=t; s<mSpacedSeeds.size(); s+=threads) {
+            KmerIndex<uint64>& spacedTable = mSpacedSeeds[s].mKmerIndex;
+            const uint64* spacedKeys = spacedTable.keys();
+            for(uint64 i=0; i<spacedTable.size(); i++)
+                mBloomFilter.add(spacedBloomKey(s, spacedKeys[i]));
         }
-    }
+    });
 }
 
+template<typename KeyType>
 void Genomes::initLowComplexityKeys() {
     int keylen = mOptions->kmerKeyLen;
     const char bases[4] = {'A', 'T', 'C', 'G'};
 
-    // we consider a key with only two positions of different base as low complexity kmer
-    for(int i=0; i<4; i++) {
-        for(int j=0; j<4; j++) {
-            for(int k=0; k<4; k++) {
-                char origin = bases[i];
-                char diff1 = bases[j];
-                char diff2 = bases[k];
-                for(int p=0; p<keylen; p++) {
-                    for(int q=0; q<keylen; q++) {
-                        string seq(keylen, origin);
-                        seq[p] = diff1;
-                        seq[q] = diff2;
-                        bool valid;
-                        uint64 key = Kmer::seq2uint64(seq, 0, keylen, valid);
-                        mLowComplexityKeys.insert(key);
-                    }
+    // we consider a key with only two (GENOME_LOW_COMPLEXITY_DIFFS) positions of different base as low complexity kmer
+    // the 64 combinations of the bases are split to the threads, and merged at last
+    int threads = mOptions->thread;
+    vector<set<KeyType>> keys(threads);
+    run_in_threads(threads, [&](int t) {
+        for(int c=t; c<64; c+=threads) {
+            char origin = bases[c / 16];
+            char diff1 = bases[(c / 4) % 4];
+            char diff2 = bases[c % 4];
+            for(int p=0; p<keylen; p++) {
+                for(int q=0; q<keylen; q++) {
+                    string seq(keylen, origin);
+                    seq[p] = diff1;
+                    seq[q] = diff2;
+                    bool valid;
+                    KeyType key = KmerKey<KeyType>::encode(seq.c_str(), 0, keylen, valid);
+                    keys[t].insert(key);
                 }
             }
         }
-    }
+    });
+    for(int t=0; t<threads; t++)
+        lowComplexityKeys<KeyType>().insert(keys[t].begin(), keys[t].end());
 }
 
-void Genomes::buildKmerTable() {
+// the k-mers starting in [begin, end) of the concatenated genomes, the k-mers with N and the ones in the polyA tail
+// of a genome are skipped
+template<typename KeyType>
+void Genomes::collectKmers(uint64 begin, uint64 end, vector<vector<pair<KeyType, uint32>>>& shards) {
     int keylen = mOptions->kmerKeyLen;
-    int blankBits = 64 - 2*keylen;
-    const int polyATailLen = 28;
-    bool valid = true;
-    for(uint32 i=0; i<mNames.size(); i++) {
-        string& seq = mSequences[i];
-        if(seq.length() < keylen)
-            continue;
-        // first calculate the first keylen-1 kmer
-        // skip the polyA tail
-        uint32 start = 0;
-        uint64 key = Kmer::seq2uint64(seq, start, keylen-1, valid);
-        while(valid == false) {
-            start++;
-            key = Kmer::seq2uint64(seq, start, keylen-1, valid);
-            // reach the tail
-            if(start >= seq.length() - keylen - polyATailLen)
-                return;
-        }
-        for(uint32 pos = start; pos < seq.length() - keylen - polyATailLen; pos++) {
+    set<KeyType>& lowComplexity = lowComplexityKeys<KeyType>();
+    uint32 id = upper_bound(mGenomeStarts.begin(), mGenomeStarts.begin() + mGenomeNum + 1, begin) - mGenomeStarts.begin() - 1;
+    for(; id < mGenomeNum && mGenomeStarts[id] < end; id++) {
+        const char* seq = genomeSeq(id);
+        int64 lastStart = (int64)genomeLen(id) - keylen - GENOME_POLYA_TAIL_LEN;
+        int64 from = max(begin, (uint64)mGenomeStarts[id]) - mGenomeStarts[id];
+        int64 to = min(min(end, (uint64)mGenomeStarts[id + 1]) - mGenomeStarts[id], (uint64)max((int64)0, lastStart));
+        KeyType key = 0;
+        int validBases = 0;
+        for(int64 p = from; p < to + keylen - 1; p++) {
             key = (key << 2);
-            switch(seq[pos + keylen-1]) {
+            switch(seq[p]) {
                 case 'A':
                     key += 0;
                     break;
@@ -173,80 +748,60 @@ void Genomes::buildKmerTable() {
                 case 'G':
                     key += 3;
                     break;
-                case 'N':
                 default:
-                    // we have to skip the segments covering this N
-                    pos++;
-                    bool outterBreak = false;
-                    key = Kmer::seq2uint64(seq, pos, keylen-1, valid);
-                    while(valid == false) {
-                        pos++;
-                        key = Kmer::seq2uint64(seq, pos, keylen-1, valid);
-                        // reach the tail
-                        if(pos >= seq.length() - keylen - polyATailLen) {
-                            outterBreak = true;
-                            break;
-                        }
-                    }
-                    if(outterBreak)
-                        break;
-
-                    continue;
+                    validBases = -1;
+                    break;
             }
-            key = (key << blankBits) >> blankBits;
-            addKmer(key, i, pos);
+            validBases++;
+            if(validBases < keylen)
+                continue;
+            key = KmerKey<KeyType>::trim(key, keylen);
+            // dont add low complexity keys
+            if(lowComplexity.find(key) != lowComplexity.end())
+                continue;
+            uint32 pos = p - keylen + 1;
+            shards[kmerShard<KeyType>(key)].push_back(make_pair(key, packIdPos(id, pos)));
         }
     }
 }
 
-void Genomes::addKmer(uint64 key, uint32 id, uint32 pos) {
-    // dont add low complexity keys
-    if(mLowComplexityKeys.find(key) != mLowComplexityKeys.end())
-        return;
-
-    uint32 data = packIdPos(id, pos);
-    if(mKmerTable.count(key) == 0)
-        mKmerTable[key] = list<uint32>();
-    mKmerTable[key].push_back(data);
+template<typename KeyType>
+bool Genomes::hasKey(KeyType key, int thread) {
+    const uint32* begin;
+    const uint32* end;
+    return findKey<KeyType>(key, begin, end, mWorkers[thread]);
 }
 
-bool Genomes::hasKey(uint64 key) {
-    // check bloom filter
-    const unsigned long long int bloomFilterFactors[3] = {1713137323, 371371377, 7341234131};
-    for(int b=0; b<3; b++) {
-        if(mBloomFilterArray[(bloomFilterFactors[b] * key) & (BLOOM_FILTER_LENGTH-1)] == 0 )
-            return false;
-    }
+template bool Genomes::hasKey<uint64>(uint64 key, int thread);
+template bool Genomes::hasKey<uint128>(uint128 key, int thread);
 
-    bool hit = mKmerTable.find(key) != mKmerTable.end();
-    if(hit)
-        mHitCount++;
+bool Genomes::align(const char* seq, uint32 len, int thread) {
+    GenomeWorker& worker = mWorkers[thread];
+    if(KmerKey<uint64>::fits(mOptions->kmerKeyLen))
+        return alignKeys<uint64>(seq, len, worker);
     else
-        mMissedCount++;
-
-    return hit;
+        return alignKeys<uint128>(seq, len, worker);
 }
 
-bool Genomes::align(string& seq) {
-    vector<vector<MapResult>> results(mGenomeNum);
-
+template<typename KeyType>
+bool Genomes::alignKeys(const char* seq, uint32 len, GenomeWorker& worker) {
     int keylen = mOptions->kmerKeyLen;
-    int blankBits = 64 - 2*keylen;
 
-    int totalMapped = 0;
+    if(len < keylen)
+        return false;
 
     bool valid = true;
 
     uint32 start = 0;
-    uint64 key = Kmer::seq2uint64(seq, start, keylen-1, valid);
+    KeyType key = KmerKey<KeyType>::encode(seq, start, keylen-1, valid);
     while(valid == false) {
         start++;
-        key = Kmer::seq2uint64(seq, start, keylen-1, valid);
+        key = KmerKey<KeyType>::encode(seq, start, keylen-1, valid);
         // reach the tail
-        if(start >= seq.length() - keylen)
+        if(start >= len - keylen)
             return false;
     }
-    for(uint32 pos = start; pos < seq.length() - keylen; pos++) {
+    for(uint32 pos = start; pos < len - keylen; pos++) {
         key = (key << 2);
         switch(seq[pos + keylen-1]) {
             case 'A':
@@ -264,16 +819,16 @@ bool Genomes::align(string& seq) {
             case 'N':
             default:
                 // we have to skip the segments covering this N
-                if(pos >= seq.length() - keylen)
+                if(pos >= len - keylen)
                     continue;
                 pos++;
-                key = Kmer::seq2uint64(seq, pos, keylen-1, valid);
+                key = KmerKey<KeyType>::encode(seq, pos, keylen-1, valid);
                 bool outterBreak = false;
                 while(valid == false) {
                     pos++;
-                    key = Kmer::seq2uint64(seq, pos, keylen-1, valid);
+                    key = KmerKey<KeyType>::encode(seq, pos, keylen-1, valid);
                     // reach the tail
-                    if(pos >= seq.length() - keylen){
+                    if(pos >= len - keylen){
                         outterBreak = true;
                         break;
                     }
@@ -283,111 +838,248 @@ bool Genomes::align(string& seq) {
 
                 continue;
         }
-        key = (key << blankBits) >> blankBits;
+        key = KmerKey<KeyType>::trim(key, keylen);
 
         // if the first 10 kmers dont match, then sample it by 10 for speed consideration
         if(pos>10 && pos % 10 !=0)
             continue;
 
-        if(hasKey(key)) {
-            list<uint32>& gpList = mKmerTable[key];
-            list<uint32>::iterator gpIter;
-            for(gpIter = gpList.begin(); gpIter != gpList.end(); gpIter++) {
-                // unit32 = 8 bits genome id + 24 bits positions
-                uint32 gp = *gpIter;
-                uint32 genomeID = 0;
-                uint32 genomePos = 0;
-                unpackIdPos(gp, genomeID,  genomePos);
-                if(results[genomeID].size() == 0) {
-                    MapResult r = mapToGenome(seq, pos, mSequences[genomeID], genomePos);
-
-                    if(r.mapped) {
-                        totalMapped++;
-                        results[genomeID].push_back(r);
-                        while(true) {
-                            list<uint32>::iterator gpIterNext = gpIter;
-                            gpIterNext++;
-                            if(gpIter == gpList.end())
-                                break;
-                            uint32 gpNext = *gpIterNext;
-                            uint32 genomeIDNext = 0;
-                            uint32 genomePosNext = 0;
-                            unpackIdPos(gpNext, genomeIDNext,  genomePosNext);
-
-                            if(genomeIDNext != genomeID) 
-                                break;
-
-                            MapResult rNext = mapToGenome(seq, pos, mSequences[genomeID], genomePosNext);
-                            if(rNext.mapped) {
-                                results[genomeID].push_back(rNext);
-                            }
-                            gpIter = gpIterNext;
-                        }
-                    }
-                }
-            }
-
-            // no need to process again
-            if(totalMapped >= mGenomeNum/2) {
-                //cerr << "break at pos: " << pos << endl;
-                //break;
+        const uint32* gpBegin;
+        const uint32* gpEnd;
+        if(findKey<KeyType>(key, gpBegin, gpEnd, worker)) {
+            addSeedHits(pos, gpBegin, gpEnd, worker);
+        } else {
+            // the k-mer has mismatches, try the spaced seeds
+            for(int s=0; s<mSpacedSeeds.size(); s++) {
+                SpacedSeed& seed = mSpacedSeeds[s];
+                if(pos + seed.mSpan > len)
+                    continue;
+                bool spacedValid = true;
+                uint64 spacedKey = KmerKey<uint64>::encode(seq, pos, seed.mSpan, spacedValid) & seed.mMask;
+                if(spacedValid && findSpacedKey(s, spacedKey, gpBegin, gpEnd, worker))
+                    addSeedHits(pos, gpBegin, gpEnd, worker);
             }
         }
 
     }
 
     bool mapped = false;
-    for(int i=0; i<mGenomeNum; i++) {
-        if(results[i].size() > 0) {
-            mapped  = true;
-            float frac = 1.0f/results[i].size();
-
-            uint32 minED=0x3FFFFF;
-            for(int p=0; p<results[i].size(); p++) {
-                cover(i, results[i][p].start, results[i][p].len, results[i][p].ed, frac);
-                if(minED > results[i][p].ed)
-                    minED = results[i][p].ed;
+    for(int t=0; t<worker.mTouched.size(); t++) {
+        uint32 i = worker.mTouched[t];
+        chainAndExtend(seq, len, i, worker);
+        worker.mAnchors[i].clear();
+        vector<MapResult>& results = worker.mResults[i];
+        if(results.empty())
+            continue;
+        mapped = true;
+
+        uint32 minED=0x3FFFFF;
+        int best = 0;
+        for(int p=0; p<results.size(); p++) {
+            cover(worker, i, results[p].start, results[p].len, results[p].ed, results.size());
+            if(minED > results[p].ed) {
+                minED = results[p].ed;
+                best = p;
             }
-
-            mReads[i]++;
-            mBases[i] += results[i][0].len;
-            mTotalEditDistance[i] += minED;
         }
+        // the exact depth counts a read once, at its best place
+        if(!worker.mDepthDiff.empty()) {
+            uint32* diff = worker.mDepthDiff.data() + mGenomeStarts[i] + i;
+            diff[results[best].start]++;
+            diff[results[best].start + results[best].len]--;
+        }
+        if(!worker.mPileup.empty())
+            pileup(seq, len, i, results[best], worker);
+
+        worker.mReads[i]++;
+        worker.mBases[i] += results[0].len;
+        worker.mTotalEditDistance[i] += minED;
+        results.clear();
     }
+    worker.mTouched.clear();
 
     return mapped;
 }
 
-MapResult Genomes::mapToGenome(string& seq, uint32 seqPos, string& genome, uint32 genomePos) {
-    MapResult ret;
-
-    if(genomePos < seqPos)
-        return ret;
+void Genomes::addSeedHits(uint32 pos, const uint32* gpBegin, const uint32* gpEnd, GenomeWorker& worker) {
+    for(const uint32* gpIter = gpBegin; gpIter != gpEnd; gpIter++) {
+        uint32 genomeID = 0;
+        uint32 genomePos = 0;
+        unpackIdPos(*gpIter, genomeID,  genomePos);
+        vector<SeedAnchor>& anchors = worker.mAnchors[genomeID];
+        if(anchors.empty())
+            worker.mTouched.push_back(genomeID);
+        // a seed on the diagonal of the last one adds nothing to the chain, only the diagonals are extended
+        else if(anchors.back().genomePos - anchors.back().readPos == genomePos - pos)
+            continue;
+        SeedAnchor anchor;
+        anchor.readPos = pos;
+        anchor.genomePos = genomePos;
+        anchors.push_back(anchor);
+    }
+}
 
-    uint32 gp = genomePos - seqPos;
+void Genomes::chainAndExtend(const char* seq, uint32 len, uint32 id, GenomeWorker& worker) {
+    vector<SeedAnchor>& anchors = worker.mAnchors[id];
+    vector<MapResult>& results = worker.mResults[id];
+    vector<int>& scores = worker.mChainScores;
+    vector<int>& prevs = worker.mChainPrevs;
+    vector<int>& order = worker.mChainOrder;
+    int n = anchors.size();
+    int maxShift = mOptions->edThreshold;
+
+    // usually all the seeds are on one diagonal, which is one chain
+    int64 firstDiag = (int64)anchors[0].genomePos - anchors[0].readPos;
+    bool oneDiagonal = true;
+    for(int i=1; i<n && oneDiagonal; i++)
+        oneDiagonal = (int64)anchors[i].genomePos - anchors[i].readPos == firstDiag;
+    if(oneDiagonal) {
+        MapResult r = extendChain(seq, len, genomeSeq(id), genomeLen(id), anchors[0], anchors[n-1]);
+        if(r.mapped)
+            results.push_back(r);
+        return;
+    }
 
-    if(genome.length() - genomePos < seq.length())
-        return ret;
+    scores.resize(n);
+    prevs.resize(n);
+    order.resize(n);
+
+    // the anchors are in the order of the read, a chain takes the anchors increasing in both the read and the genome,
+    // with their diagonals shifted by no more than the allowed indels, and scores the number of anchors
+    const int maxPredecessors = 64;
+    for(int i=0; i<n; i++) {
+        scores[i] = 1;
+        prevs[i] = -1;
+        order[i] = i;
+        // the genome positions can be >= 2^31
+        int64 diag = (int64)anchors[i].genomePos - anchors[i].readPos;
+        int64 bestShift = 0;
+        for(int j=i-1; j>=0 && j>=i-maxPredecessors; j--) {
+            if(anchors[j].readPos >= anchors[i].readPos || anchors[j].genomePos >= anchors[i].genomePos)
+                continue;
+            int64 shift = diag - ((int64)anchors[j].genomePos - anchors[j].readPos);
+            if(shift < 0)
+                shift = -shift;
+            if(shift > maxShift)
+                continue;
+            if(scores[j] + 1 > scores[i] || (scores[j] + 1 == scores[i] && shift < bestShift)) {
+                scores[i] = scores[j] + 1;
+                prevs[i] = j;
+                bestShift = shift;
+            }
+        }
+    }
 
-    uint32 hd = hamming_distance(seq.c_str(), seq.length(), genome.c_str() + gp, seq.length());
+    // take the chains from the best, a chain ends at the first anchor taken by a better one
+    sort(order.begin(), order.end(), [&scores](int a, int b) {
+        if(scores[a] != scores[b])
+            return scores[a] > scores[b];
+        return a < b;
+    });
+    for(int o=0; o<n; o++) {
+        int last = order[o];
+        if(scores[last] < 0)
+            continue;
+        int first = last;
+        for(int i=last; i>=0 && scores[i]>=0; i=prevs[i]) {
+            first = i;
+            // taken
+            scores[i] = -1;
+        }
+        MapResult r = extendChain(seq, len, genomeSeq(id), genomeLen(id), anchors[first], anchors[last]);
+        if(!r.mapped)
+            continue;
+        // the chains split by a larger indel or by the predecessor limit can extend to the same place
+        bool duplicated = false;
+        for(int p=0; p<results.size(); p++) {
+            if(r.start < results[p].start + results[p].len && results[p].start < r.start + r.len) {
+                if(r.ed < results[p].ed)
+                    results[p] = r;
+                duplicated = true;
+                break;
+            }
+        }
+        if(!duplicated)
+            results.push_back(r);
+    }
+}
 
-    uint32 ed = 0;
+MapResult Genomes::extendChain(const char* seq, uint32 seqLen, const char* genome, uint32 genomeLen, const SeedAnchor& first, const SeedAnchor& last) {
+    MapResult ret;
+    int64 glen = genomeLen;
+    int64 k = mOptions->edThreshold;
+    int64 gStart = (int64)first.genomePos - first.readPos;
+    int64 gEnd = (int64)last.genomePos - last.readPos + seqLen;
+
+    // using hamming distance to accelerate computing edit distance, most reads have no indel
+    if(gStart >= 0 && gStart + seqLen <= glen) {
+        uint32 hd = hamming_distance(seq, seqLen, genome + gStart, seqLen);
+        if(hd <= 2) {
+            ret.ed = hd;
+            ret.start = gStart;
+            ret.len = seqLen;
+            ret.mapped = hd <= k && hd < seqLen/4;
+            return ret;
+        }
+    }
 
-    // using hamming distance to accelerate computing edit distance
-    if(hd<=2)
-        ed = hd;
-    else
-        ed = edit_distance(seq.c_str(), seq.length(), genome.c_str() + gp, seq.length());
+    // the indels before the first seed can shift the start of the read by no more than its position,
+    // and there are no more than k indels in all,
+    // an edit distance > edThreshold is not computed exactly since it's never a match
+    int64 shift = min(k, (int64)first.readPos);
+    int64 windowStart = max((int64)0, gStart - shift);
+    int64 windowEnd = min(glen, max(gEnd, gStart + seqLen) + k);
+    if(windowEnd <= windowStart)
+        return ret;
+    int64 startSpan = max((int64)0, gStart + shift - windowStart);
+    uint32 bStart = 0;
+    uint32 bEnd = 0;
+    uint32 ed = bounded_infix_edit_distance(seq, seqLen, genome + windowStart, windowEnd - windowStart, k, startSpan, bStart, bEnd);
 
     ret.ed = ed;
-    ret.start = gp;
-    ret.len = seq.length();
-    ret.mapped = ed <= mOptions->edThreshold && ed < seq.length()/4; // TODO: export to options
+    ret.start = windowStart + bStart;
+    ret.len = bEnd - bStart;
+    ret.mapped = ed <= k && ed < seqLen/4 && ret.len > 0; // TODO: export to options
 
     return ret;
 }
 
+void Genomes::pileup(const char* seq, uint32 len, int id, const MapResult& r, GenomeWorker& worker) {
+    const char* genome = genomeSeq(id) + r.start;
+    if(worker.mPileup[id].empty())
+        worker.mPileup[id].resize((uint64)genomeLen(id) * PILEUP_CHANNELS, 0);
+    uint16* counters = worker.mPileup[id].data();
+    uint64 index = (uint64)r.start * PILEUP_CHANNELS;
+
+    // most reads have no indel, and are counted base by base
+    if(r.len == len && hamming_distance(seq, len, genome, len) == r.ed) {
+        for(uint32 p=0; p<len; p++)
+            countPileup(worker, counters, id, index + p * PILEUP_CHANNELS + pileupChannel(seq[p]));
+        return;
+    }
+
+    if(bounded_alignment(seq, len, genome, r.len, mOptions->edThreshold, worker.mTrace, worker.mOps) > mOptions->edThreshold)
+        return;
+    // the inserted bases are not in the genome, so they are not counted
+    uint32 i = 0;
+    uint32 j = 0;
+    const string& ops = worker.mOps;
+    for(int o=0; o<ops.length(); o++) {
+        if(ops[o] == 'M') {
+            countPileup(worker, counters, id, index + j * PILEUP_CHANNELS + pileupChannel(seq[i]));
+            i++;
+            j++;
+        } else if(ops[o] == 'I') {
+            i++;
+        } else {
+            countPileup(worker, counters, id, index + j * PILEUP_CHANNELS + PILEUP_DEL);
+            j++;
+        }
+    }
+}
+
 void Genomes::report() {
+    mergeWorkers();
     cerr << endl << "Coverage of genomes:" << endl;
     for(int i=0; i<mGenomeNum; i++) {
         cerr << mReads[i] << " reads/" << mBases[i] << " bases/" << mTotalEditDistance[i] << " mismatches: " << mNames[i] << endl;
@@ -417,6 +1109,7 @@ double Genomes::getCoverageRate(int id) {
 }
 
 void Genomes::reportJSON(ofstream& ofs) {
+    mergeWorkers();
     ofs << "\t" << "\"genome_mapping_result\": {" << endl;
     ofs << "\t\t" << "\"genome_number\": " << mGenomeNum << "," << endl;
     ofs << "\t\t" << "\"bin_size\": " << mOptions->statsBinSize << "," << endl;
@@ -432,7 +1125,7 @@ void Genomes::reportJSON(ofstream& ofs) {
             ofs << ", " << endl;
         ofs << "\t\t\t{" << endl;
         ofs << "\t\t\t\t\"name\":\"" <<  name << "\"," << endl;
-        ofs << "\t\t\t\t\"size\":" <<  mSequences[i].length() << "," << endl;
+        ofs << "\t\t\t\t\"size\":" <<  genomeLen(i) << "," << endl;
         ofs << "\t\t\t\t\"reads\":" <<  reads << "," << endl;
         ofs << "\t\t\t\t\"bases\":" <<  bases << "," << endl;
         ofs << "\t\t\t\t\"coverage_rate\":" <<  coverageRate << "," << endl;
@@ -449,6 +1142,7 @@ void Genomes::reportJSON(ofstream& ofs) {
 }
 
 void Genomes::reportHtml(ofstream& ofs) {
+    mergeWorkers();
     ofs << "<div id='genome_coverage' style='display:none;color:white;padding:5px;background-color: rgba(0,0,0,0.6);border:1px dotted #666666;font-size:12px;line-height:15px;'> </div>" << endl;
     ofs << "<script src='http://opengene.org/fastv/coverage.js'></script>" << endl;
     ofs << "<script language='javascript'>" << endl;
@@ -457,7 +1151,7 @@ void Genomes::reportHtml(ofstream& ofs) {
     for(int i=0; i<mGenomeNum; i++) {
         if(i != 0) 
             ofs << ", ";
-        ofs << mSequences[i].length();
+        ofs << genomeLen(i);
     }
     ofs << "];" << endl;
 
@@ -515,10 +1209,10 @@ string Genomes::getCoverageY(int id) {
 
         if(x < mCoverage[id].size() - 1)
             ss  << mCoverage[id][x] / (double)mOptions->statsBinSize ;
-        else if(mSequences[id].length() - x * mOptions->statsBinSize == 0)
+        else if(genomeLen(id) - x * mOptions->statsBinSize == 0)
             ss << "0.0";
         else
-            ss  << mCoverage[id][x] / (mSequences[id].length() - x * mOptions->statsBinSize) ;
+            ss  << mCoverage[id][x] / (genomeLen(id) - x * mOptions->statsBinSize) ;
     }
     return ss.str();
 }
@@ -537,50 +1231,316 @@ string Genomes::getEditDistanceY(int id) {
     return ss.str();
 }
 
-void Genomes::cover(int id, uint32 pos, uint32 len, uint32 ed, float frac) {
+void Genomes::cover(GenomeWorker& worker, int id, uint32 pos, uint32 len, uint32 ed, uint32 mapNum) {
     if(id >= mCoverage.size()) {
         error_exit("WRONG id");
     }
 
-    int leftBin = pos / mOptions->statsBinSize;
-    int rightBin = (pos+len) / mOptions->statsBinSize;
+    uint64* depth = worker.mDepth.data() + mBinStarts[id];
+    uint64* editDistance = worker.mEditDistance.data() + mBinStarts[id];
+    uint64 binNum = mBinStarts[id + 1] - mBinStarts[id];
+    uint64 binSize = mOptions->statsBinSize;
+
+    // the tail of the genome after the last full bin is counted in the last bin, as getCoverageY() expects
+    uint64 end = (uint64)pos + len;
+    for(uint64 bin = min((uint64)pos / binSize, binNum - 1); bin<binNum; bin++) {
+        uint64 left = max((uint64)pos, bin * binSize);
+        if(left >= end)
+            break;
+        uint64 right = bin == binNum - 1 ? end : min(end, (bin+1) * binSize);
+        depth[bin] += (right - left) * GENOME_DEPTH_SCALE / mapNum;
+        editDistance[bin] += ed * (right - left) * GENOME_DEPTH_SCALE / ((uint64)len * mapNum);
+    }
+}
+
+// the difference arrays of the workers are summed in place of the first worker, then prefix-summed genome by genome,
+// and each run of the same depth is written as one line, the uncovered bases are omitted
+void Genomes::writeBedGraph(string filename) {
+    if(mWorkers.empty() || mWorkers[0].mDepthDiff.empty())
+        return;
+    ofstream ofs(filename.c_str());
+    if(!ofs.is_open())
+        error_exit("Failed to write the depth bedGraph: " + filename);
+
+    vector<uint32>& diff = mWorkers[0].mDepthDiff;
+    for(int t=1; t<mWorkers.size(); t++) {
+        const uint32* other = mWorkers[t].mDepthDiff.data();
+        for(uint64 p=0; p<diff.size(); p++)
+            diff[p] += other[p];
+    }
 
-    if(leftBin == rightBin) {
-        if(leftBin < mCoverage[id].size()) {
-            mCoverage[id][leftBin] += len * frac;
-            mEditDistance[id][leftBin] += ed * frac;
+    ofs << "track type=bedGraph name=\"fastv depth\" description=\"exact per-base depth of the genomes\"" << endl;
+    for(int i=0; i<mGenomeNum; i++) {
+        string chrom = mNames[i].substr(0, mNames[i].find_first_of(" \t"));
+        const uint32* genomeDiff = diff.data() + mGenomeStarts[i] + i;
+        uint32 glen = genomeLen(i);
+        uint32 depth = 0;
+        uint32 runStart = 0;
+        for(uint32 p=0; p<=glen; p++) {
+            // the unsigned sum wraps back when a read ends
+            uint32 next = p < glen ? depth + genomeDiff[p] : 0;
+            if(next != depth) {
+                if(depth > 0)
+                    ofs << chrom << "\t" << runStart << "\t" << p << "\t" << depth << "\n";
+                depth = next;
+                runStart = p;
+            }
         }
-    } else {
-        for(int bin = leftBin; bin<rightBin; bin++) {
-            int left, right;
-            if(bin == leftBin)
-                left = pos;
-            else
-                left = bin * mOptions->statsBinSize;
+    }
+    ofs.close();
+    if(mOptions->verbose)
+        loginfo("Wrote the per-base depth of the genomes to " + filename);
+}
 
-            if(bin == right)
-                right = pos + len;
-            else
-                right = (bin+1) * mOptions->statsBinSize;
+// the consensus base is the most counted of A, C, G, T and the deletion, the genome base wins a tie,
+// a deleted base is dropped from the consensus, and a base with depth (not counting N) < consensusDepth is N
+void Genomes::writeConsensus(string consensusFile, string variantFile) {
+    if(mWorkers.empty() || mWorkers[0].mPileup.empty())
+        return;
+    mergeWorkers();
+
+    ofstream consensus;
+    ofstream variants;
+    if(!consensusFile.empty()) {
+        consensus.open(consensusFile.c_str());
+        if(!consensus.is_open())
+            error_exit("Failed to write the consensus sequences: " + consensusFile);
+    }
+    if(!variantFile.empty()) {
+        variants.open(variantFile.c_str());
+        if(!variants.is_open())
+            error_exit("Failed to write the variants: " + variantFile);
+        variants << "#genome\tposition\tref\talt\tdepth\talt_depth\talt_freq\n";
+    }
 
-            float proportion = (right - left)/(float)len;
+    const char channelBases[PILEUP_CHANNELS + 1] = "ACGTN-";
+    int written = 0;
+    for(int i=0; i<mGenomeNum; i++) {
+        if(getCoverageRate(i) < mOptions->consensusCoverage)
+            continue;
+        string chrom = mNames[i].substr(0, mNames[i].find_first_of(" \t"));
+        // the workers without any read of this genome have no counters
+        vector<int> workers;
+        for(int t=0; t<mWorkers.size(); t++) {
+            if(!mWorkers[t].mPileup[i].empty())
+                workers.push_back(t);
+        }
+        const char* ref = genomeSeq(i);
+        uint32 glen = genomeLen(i);
+        string seq;
+        seq.reserve(glen);
+        for(uint32 p=0; p<glen; p++) {
+            uint64 index = (uint64)p * PILEUP_CHANNELS;
+            uint64 counts[PILEUP_CHANNELS] = {0};
+            for(int w=0; w<workers.size(); w++) {
+                GenomeWorker& worker = mWorkers[workers[w]];
+                const uint16* pileup = worker.mPileup[i].data() + index;
+                for(int c=0; c<PILEUP_CHANNELS; c++)
+                    counts[c] += pileup[c];
+                if(worker.mPileupCarry.empty())
+                    continue;
+                for(int c=0; c<PILEUP_CHANNELS; c++) {
+                    unordered_map<uint64, uint32>::iterator iter = worker.mPileupCarry.find(pileupCarryKey(i, index + c));
+                    if(iter != worker.mPileupCarry.end())
+                        counts[c] += (uint64)iter->second << 16;
+                }
+            }
 
-            if(bin < mCoverage[id].size()) {
-                mCoverage[id][bin] += (right - left) * frac;
-                mEditDistance[id][bin] += ed * proportion * frac;
+            uint64 depth = 0;
+            for(int c=0; c<PILEUP_CHANNELS; c++) {
+                if(c != PILEUP_N)
+                    depth += counts[c];
+            }
+            if(depth < (uint64)mOptions->consensusDepth) {
+                seq.push_back('N');
+                continue;
+            }
+            char refBase = toupper(ref[p]);
+            int called = pileupChannel(refBase);
+            if(called == PILEUP_N)
+                called = 0;
+            for(int c=0; c<PILEUP_CHANNELS; c++) {
+                if(c != PILEUP_N && counts[c] > counts[called])
+                    called = c;
+            }
+            char alt = channelBases[called];
+            if(called != PILEUP_DEL)
+                seq.push_back(alt);
+            if(alt != refBase && variants.is_open()) {
+                variants << chrom << "\t" << p + 1 << "\t" << refBase << "\t" << alt << "\t" << depth << "\t" << counts[called]
+                    << "\t" << (double)counts[called] / depth << "\n";
             }
         }
+        if(consensus.is_open())
+            consensus << ">" << chrom << " consensus\n" << seq << "\n";
+        written++;
     }
+    if(mOptions->verbose)
+        loginfo("Wrote the consensus of " + to_string(written) + " genome(s) with coverage rate >= " + to_string(mOptions->consensusCoverage));
 }
 
-uint32 Genomes::packIdPos(uint32 id, uint32 position) {
-    uint32 data = 0;
-    data |= (id << 24);
-    data |= position;
-    return data;
+void Genomes::mergeWorkers() {
+    if(mWorkersMerged)
+        return;
+    mWorkersMerged = true;
+    for(int i=0; i<mGenomeNum; i++) {
+        for(int b=0; b<mCoverage[i].size(); b++) {
+            uint64 depth = 0;
+            uint64 editDistance = 0;
+            for(int t=0; t<mWorkers.size(); t++) {
+                depth += mWorkers[t].mDepth[mBinStarts[i] + b];
+                editDistance += mWorkers[t].mEditDistance[mBinStarts[i] + b];
+            }
+            mCoverage[i][b] = (double)depth / GENOME_DEPTH_SCALE;
+            mEditDistance[i][b] = (double)editDistance / GENOME_DEPTH_SCALE;
+        }
+        for(int t=0; t<mWorkers.size(); t++) {
+            mReads[i] += mWorkers[t].mReads[i];
+            mBases[i] += mWorkers[t].mBases[i];
+            mTotalEditDistance[i] += mWorkers[t].mTotalEditDistance[i];
+        }
+    }
 }
 
-void Genomes::unpackIdPos(uint32 data, uint32& id, uint32& pos) {
-    id = data >> 24;
-    pos = data & 0xFFFFFF;
-}
\ No newline at end of file
+// a random genome, and reads with deletions and hanging off its ends
+bool Genomes::test() {
+    string genome;
+    uint64 state = 1;
+    for(int i=0; i<1200; i++) {
+        state = state * 6364136223846793005UL + 1442695040888963407UL;
+        genome.push_back("ACGT"[state >> 62]);
+    }
+    char fasta[] = "/tmp/fastv_genomes_test_XXXXXX.fa";
+    int fd = mkstemps(fasta, 3);
+    if(fd < 0)
+        return false;
+    string records = ">g1 test genome\n" + genome + "\n";
+    bool written = write(fd, records.data(), records.size()) == records.size();
+    close(fd);
+
+    Options opt;
+    opt.kmerKeyLen = 25;
+    Genomes* g = written ? new Genomes(fasta, &opt) : NULL;
+    if(g == NULL) {
+        unlink(fasta);
+        return false;
+    }
+
+    bool passed = true;
+    GenomeWorker& worker = g->mWorkers[0];
+    // the seeds after a deletion are on another diagonal, which is chained and aligned with the deletion
+    int deletions[2] = {3, 6};
+    for(int d=0; d<2; d++) {
+        string read = genome.substr(300 + 300 * d, 75) + genome.substr(375 + 300 * d + deletions[d], 75);
+        long editDistance = worker.mTotalEditDistance[0];
+        passed &= g->align(read.c_str(), read.length());
+        passed &= worker.mTotalEditDistance[0] - editDistance == deletions[d];
+    }
+    passed &= worker.mReads[0] == 2;
+
+    // two anchors are chained only if their diagonals are shifted by no more than edThreshold
+    string read = genome.substr(100, 150);
+    for(int shift = opt.edThreshold; shift <= opt.edThreshold + 1; shift++) {
+        SeedAnchor first = {10, 110};
+        SeedAnchor last = {100, (uint32)(200 + shift)};
+        worker.mAnchors[0].push_back(first);
+        worker.mAnchors[0].push_back(last);
+        g->chainAndExtend(read.c_str(), read.length(), 0, worker);
+        passed &= worker.mChainPrevs[1] == (shift == opt.edThreshold ? 0 : -1);
+        worker.mAnchors[0].clear();
+        worker.mResults[0].clear();
+    }
+
+    // the bases out of the genome are insertions
+    const int overhang = 3;
+    read = string(overhang, 'T') + genome.substr(0, 147);
+    SeedAnchor first = {overhang + 10, 10};
+    SeedAnchor last = {overhang + 100, 100};
+    MapResult r = g->extendChain(read.c_str(), read.length(), genome.c_str(), genome.length(), first, last);
+    passed &= r.mapped && r.start == 0 && r.len == 147 && r.ed == overhang;
+    uint32 tailStart = genome.length() - 147;
+    read = genome.substr(tailStart) + string(overhang, 'T');
+    first.readPos = 10;
+    first.genomePos = tailStart + 10;
+    last.readPos = 100;
+    last.genomePos = tailStart + 100;
+    r = g->extendChain(read.c_str(), read.length(), genome.c_str(), genome.length(), first, last);
+    passed &= r.mapped && r.start == tailStart && r.len == 147 && r.ed == overhang;
+    delete g;
+
+    // the consensus and the variants of the reads piled up on the genome
+    char consensusFile[] = "/tmp/fastv_genomes_test_XXXXXX.fa";
+    char variantFile[] = "/tmp/fastv_genomes_test_XXXXXX.tsv";
+    int consensusFd = mkstemps(consensusFile, 3);
+    int variantFd = mkstemps(variantFile, 4);
+    if(consensusFd >= 0)
+        close(consensusFd);
+    if(variantFd >= 0)
+        close(variantFd);
+    opt.consensusFile = consensusFile;
+    opt.variantFile = variantFile;
+    opt.consensusCoverage = 0.0;
+    opt.consensusDepth = 4;
+    g = new Genomes(fasta, &opt);
+    unlink(fasta);
+    GenomeWorker& pileupWorker = g->mWorkers[0];
+    // the read of genome [start, start + len) with the bases at subs substituted and the bases at dels deleted
+    auto pileupRead = [&](uint32 start, uint32 len, vector<uint32> subs, vector<uint32> dels) {
+        string seq;
+        for(uint32 p=start; p<start + len; p++) {
+            if(find(dels.begin(), dels.end(), p) != dels.end())
+                continue;
+            if(find(subs.begin(), subs.end(), p) != subs.end())
+                seq.push_back("ACGT"[(pileupChannel(genome[p]) + 1) % 4]);
+            else
+                seq.push_back(genome[p]);
+        }
+        MapResult r;
+        r.mapped = true;
+        r.start = start;
+        r.len = len;
+        r.ed = subs.size() + dels.size();
+        g->pileup(seq.c_str(), seq.length(), 0, r, pileupWorker);
+    };
+    // a tie at 205 keeps the genome base, and 3 of 5 reads call the substitution at 210
+    for(int i=0; i<2; i++) {
+        pileupRead(200, 20, {}, {});
+        pileupRead(200, 20, {205, 210}, {});
+    }
+    pileupRead(208, 12, {210}, {});
+    // a deletion is not in the consensus
+    for(int i=0; i<4; i++)
+        pileupRead(220, 20, {}, {230});
+    // the depth is below consensusDepth
+    for(int i=0; i<3; i++)
+        pileupRead(240, 10, {}, {});
+    // the counters of 252 wrap, and only the carry makes the substitution win
+    for(int i=0; i<65536; i++)
+        pileupRead(250, 10, {252}, {});
+    for(int i=0; i<3; i++)
+        pileupRead(250, 10, {}, {});
+    g->writeConsensus(consensusFile, variantFile);
+    delete g;
+
+    string expected = string(200, 'N') + genome.substr(200, 40) + string(10, 'N') + genome.substr(250, 10) + string(genome.length() - 260, 'N');
+    expected[210] = "ACGT"[(pileupChannel(genome[210]) + 1) % 4];
+    expected[252] = "ACGT"[(pileupChannel(genome[252]) + 1) % 4];
+    expected.erase(230, 1);
+    stringstream variants;
+    variants << "#genome\tposition\tref\talt\tdepth\talt_depth\talt_freq\n"
+        << "g1\t211\t" << genome[210] << "\t" << expected[210] << "\t5\t3\t0.6\n"
+        << "g1\t231\t" << genome[230] << "\t-\t4\t4\t1\n"
+        << "g1\t253\t" << genome[252] << "\t" << expected[251] << "\t65539\t65536\t0.999954\n";
+    ifstream consensusIn(consensusFile);
+    stringstream consensusOut;
+    consensusOut << consensusIn.rdbuf();
+    ifstream variantIn(variantFile);
+    stringstream variantOut;
+    variantOut << variantIn.rdbuf();
+    unlink(consensusFile);
+    unlink(variantFile);
+    passed &= consensusOut.str() == ">g1 consensus\n" + expected + "\n";
+    passed &= variantOut.str() == variants.str();
+
+    return passed;
+}
@@ -8,15 +8,74 @@
 #include <string>
 #include <fstream>
 #include "common.h"
+#include "util.h"
 #include "fastareader.h"
 #include <vector>
-#include <list>
 #include <set>
 #include <unordered_map>
+#include <algorithm>
 #include "options.h"
+#include "kmerkey.h"
+#include "kmerindex.h"
+#include "bloomfilter.h"
+#include "phasetimer.h"
 
 using namespace std;
 
+// the bloom filter is sized for this false-positive rate
+const double BLOOM_FILTER_FP_RATE = 0.01;
+// the genome of a packed position is searched in the genomes of its 64K block
+const int GENOME_BLOCK_BITS = 16;
+// the unit of the depth and the edit distance of the coverage bins is 1/GENOME_DEPTH_SCALE base,
+// so that a read mapped to n (1 ~ 16) places of a genome adds exactly 1/n of its bases to each
+const uint64 GENOME_DEPTH_SCALE = 720720;
+// the k-mers in the last bases of a genome are not indexed, to skip the polyA tail
+const int GENOME_POLYA_TAIL_LEN = 28;
+// a k-mer with only this many bases different from the others is low complexity, and not indexed
+const int GENOME_LOW_COMPLEXITY_DIFFS = 2;
+// the pileup counts A, C, G, T, N and the deletions at every genome position
+const int PILEUP_CHANNELS = 6;
+const int PILEUP_N = 4;
+const int PILEUP_DEL = 5;
+
+// the binary index written by `fastv index -g`, which can be passed to -g directly
+#define GENOMES_INDEX_MAGIC "FASTVGNI"
+#define GENOMES_INDEX_VERSION 2
+#define GENOMES_INDEX_EXT ".gni"
+// every section of the index starts at a cache line
+#define GENOMES_INDEX_ALIGN INDEX_SECTION_ALIGN
+
+// the index file is this header, then the names, the spaced seed patterns, the genome starts, the bases,
+// the bytes of every k-mer table, the k-mer tables of the shards and of the spaced seeds, and the bloom filter,
+// each section is padded to GENOMES_INDEX_ALIGN bytes
+class GenomesIndexHeader {
+public:
+    char mMagic[8];
+    uint32 mVersion;
+    uint32 mKeyLen;
+    // the rule of the k-mers not indexed, the index is rejected if it's built with another rule
+    uint32 mPolyATailLen;
+    uint32 mLowComplexityDiffs;
+    uint32 mGenomeNum;
+    uint32 mShardNum;
+    uint32 mSpacedSeedNum;
+    uint32 mBloomHashNum;
+    // crc32 of the small sections, the names, the spaced seeds, the genome starts and the bytes of the tables,
+    // checked at every load
+    uint32 mMetaChecksum;
+    uint32 mReserved;
+    uint64 mTotalBases;
+    uint64 mNamesBytes;
+    // the comma separated patterns
+    uint64 mSpacedSeedBytes;
+    uint64 mBloomBlockNum;
+    double mBloomFPRate;
+    // crc32 of all the sections after the header, which reads the whole file, only checked with --verify_index
+    uint32 mDataChecksum;
+    // crc32 of the header fields above
+    uint32 mHeaderChecksum;
+};
+
 class MapResult{
 
 public:
@@ -33,53 +92,308 @@ public:
     uint32 ed; // edit distance
 };
 
+// a seed of a read found in a genome, the seeds of a read on one genome are chained before extending
+class SeedAnchor{
+public:
+    uint32 readPos;
+    uint32 genomePos;
+};
+
+// the state of a worker thread aligning reads to the genomes.
+// the result slots are reused for every read so that aligning allocates nothing,
+// and the coverage is only added to this thread's tallies, which are merged when reporting
+class GenomeWorker{
+public:
+    // one slot per genome, only the touched ones are cleared after a read
+    vector<vector<MapResult>> mResults;
+    // one slot per genome, the seed hits of the current read in the order of the read
+    vector<vector<SeedAnchor>> mAnchors;
+    // the genomes with any seed hit for the current read
+    vector<uint32> mTouched;
+    // the chaining scores and predecessors of the anchors of one genome, and the anchors by score
+    vector<int> mChainScores;
+    vector<int> mChainPrevs;
+    vector<int> mChainOrder;
+
+    // the bins of all the genomes, the bins of genome i start from Genomes::mBinStarts[i]
+    vector<uint64> mDepth;
+    vector<uint64> mEditDistance;
+    // the exact per-base depth as a difference array, empty unless Options::depthBedGraphFile is set,
+    // genome i has genomeLen(i) + 1 slots starting from Genomes::mGenomeStarts[i] + i
+    vector<uint32> mDepthDiff;
+    // the base counters of every position of genome i, PILEUP_CHANNELS per position, empty unless Options::needPileup(),
+    // mPileup[i] is allocated when the first read is aligned to genome i, so only the genomes hit take memory.
+    // a counter wraps at 65536, and its wraps are counted in mPileupCarry by pileupCarryKey(), which is rarely touched
+    vector<vector<uint16>> mPileup;
+    unordered_map<uint64, uint32> mPileupCarry;
+    // the DP band and the alignment of the read to pile up, reused for every read
+    vector<unsigned char> mTrace;
+    string mOps;
+    // one per genome
+    vector<long> mReads;
+    vector<long> mBases;
+    vector<long> mTotalEditDistance;
+    // the probes rejected by the bloom filter, and the ones passing it but not found
+    long mBloomRejectedCount;
+    long mMissedCount;
+};
+
+// a spaced seed only compares the bases marked as 1 in its pattern,
+// so that a k-mer with mismatches at the 0 positions can still be a seed
+class SpacedSeed{
+public:
+    SpacedSeed(string pattern);
+
+public:
+    string mPattern;
+    int mSpan;
+    int mWeight;
+    // 2 bits per base, 0b11 for the bases to compare
+    uint64 mMask;
+    KmerIndex<uint64> mKmerIndex;
+};
+
 class Genomes
 {
 public:
+    // fastaFile can also be an index written by writeIndex()
     Genomes(string fastaFile, Options* opt);
     ~Genomes();
 
-    void cover(int id, uint32 pos, uint32 len, uint32 ed, float frac);
-    bool hasKey(uint64 key);
-    bool align(string& seq);
+    static bool isIndexFile(string filename);
+    void writeIndex(string filename);
+    // the exact per-base depth of all the genomes, merged from the workers
+    void writeBedGraph(string filename);
+    // the consensus of the genomes covered enough, and their differences to the genomes, any file can be empty
+    void writeConsensus(string consensusFile, string variantFile);
+    bool isMapped() {return mMappedData != NULL;}
+
+    // a read aligned to mapNum places of genome id
+    void cover(GenomeWorker& worker, int id, uint32 pos, uint32 len, uint32 ed, uint32 mapNum);
+    // thread is the index of the worker thread, which owns a GenomeWorker
+    template<typename KeyType>
+    bool hasKey(KeyType key, int thread = 0);
+    // sets the packed positions of key to [begin, end), returns false if not found
+    template<typename KeyType>
+    inline bool findKey(KeyType key, const uint32*& begin, const uint32*& end, GenomeWorker& worker);
+    bool align(const char* seq, uint32 len, int thread = 0);
+    bool findSpacedKey(int seed, uint64 key, const uint32*& begin, const uint32*& end, GenomeWorker& worker);
+    // rollingKey holds the last validBases bases, 2 bits per base
+    inline bool hasSpacedSeedHit(uint64 rollingKey, int validBases, int thread = 0);
     void report();
     void reportJSON(ofstream& ofs);
     void reportHtml(ofstream& ofs);
 
-    static uint32 packIdPos(uint32 id, uint32 position);
-    static void unpackIdPos(uint32 data,uint32& id, uint32& pos);
+    vector<pair<string, double>>& getLoadingPhases() {return mLoadingTimer.phases();}
+    BloomFilter& getBloomFilter() {return mBloomFilter;}
+    // the keys passing the bloom filter but not found, of all the keys not found
+    double getBloomFilterFPRate();
+
+    // a genome position is packed as its offset in the concatenation of all the genomes
+    inline uint32 packIdPos(uint32 id, uint32 position);
+    inline void unpackIdPos(uint32 data,uint32& id, uint32& pos);
+
+    static bool test();
 
 private:
     void init();
-    void buildKmerTable();
-    void addKmer(uint64 key, uint32 id, uint32 pos);
+    // reads the FASTA, and builds the tables
+    void buildIndex(string faFile);
+    // the names and the bases of the genomes, and the start of every genome
+    void loadFasta();
+    void mapIndex(string filename);
+    bool mapIndexFile(int fd, string filename, string& error);
+    void unmapIndex();
+    void clearTables();
+    bool writeIndexFile(int fd);
+    string sharedIndexPath(string faFile);
+    // maps the index in --shared_index_dir, builds it there first if it's not found, returns false to use a private copy
+    bool attachSharedIndex(string faFile);
+    uint64 indexBytes();
+    void serializeIndex(char* data);
+    template<typename KeyType>
+    uint64 kmerTableBytes(vector<uint64>& tableBytes);
+    template<typename KeyType>
+    char* serializeKmerTables(char* p);
+    template<typename KeyType>
+    bool attachKmerTables(const char* data, const uint64* tableBytes);
+    inline const char* genomeSeq(int id) {return mGenomeBases + mGenomeStarts[id];}
+    inline uint32 genomeLen(int id) {return mGenomeStarts[id + 1] - mGenomeStarts[id];}
+    template<typename KeyType>
+    void initKmerTables();
+    template<typename KeyType>
+    void collectKmers(uint64 begin, uint64 end, vector<vector<pair<KeyType, uint32>>>& shards);
+    template<typename KeyType>
     void initLowComplexityKeys();
-    MapResult mapToGenome(string& seq, uint32 seqPos, string& genome, uint32 genomePos);
+    template<typename KeyType>
+    bool alignKeys(const char* seq, uint32 len, GenomeWorker& worker);
+    void addSeedHits(uint32 pos, const uint32* gpBegin, const uint32* gpEnd, GenomeWorker& worker);
+    // chains the anchors of the genome, and extends every chain to the whole read
+    void chainAndExtend(const char* seq, uint32 len, uint32 id, GenomeWorker& worker);
+    void initSpacedSeeds();
+    void buildSpacedSeedTable(int seed);
+    bool isLowComplexitySpacedKey(uint64 key, SpacedSeed& seed);
+    inline uint64 spacedBloomKey(int seed, uint64 key);
+    template<typename KeyType>
+    inline uint64 bloomKey(KeyType key);
+    // aligns the read with its first base near the diagonal first, and its last base near the diagonal last
+    MapResult extendChain(const char* seq, uint32 seqLen, const char* genome, uint32 genomeLen, const SeedAnchor& first, const SeedAnchor& last);
+    // counts the bases of the read aligned to genome id at r
+    void pileup(const char* seq, uint32 len, int id, const MapResult& r, GenomeWorker& worker);
+    static inline int pileupChannel(char base) {
+        switch(base) {
+            case 'A': case 'a': return 0;
+            case 'C': case 'c': return 1;
+            case 'G': case 'g': return 2;
+            case 'T': case 't': return 3;
+            default: return PILEUP_N;
+        }
+    }
+    // the index of a counter in a genome is < 4G * PILEUP_CHANNELS < 2^35
+    static inline uint64 pileupCarryKey(int id, uint64 index) {
+        return ((uint64)id << 35) | index;
+    }
+    static inline void countPileup(GenomeWorker& worker, uint16* counters, int id, uint64 index) {
+        if(++counters[index] == 0)
+            worker.mPileupCarry[pileupCarryKey(id, index)]++;
+    }
+    template<typename KeyType>
     void initBloomFilter();
+    template<typename KeyType>
+    inline vector<KmerIndex<KeyType>>& kmerTables();
+    template<typename KeyType>
+    inline KmerIndex<KeyType>& kmerTable(KeyType key);
+    template<typename KeyType>
+    inline int kmerShard(KeyType key);
+    template<typename KeyType>
+    inline set<KeyType>& lowComplexityKeys();
     string getPlotX(int id);
     string getCoverageY(int id);
     string getEditDistanceY(int id);
     void initBinSize();
+    void initBlockGenomes();
+    // adds the tallies of all the worker threads to the reported coverage, only once
+    void mergeWorkers();
     double getCoverageRate(int id);
 
 private:
     int mGenomeNum;
     FastaReader* mFastaReader;
-    vector<string> mSequences;
     vector<string> mNames;
-    vector<vector<float>> mCoverage;
-    vector<vector<float>> mEditDistance;
+    // the bases of all the genomes concatenated, read from the FASTA, or in the mapped index
+    string mGenomeData;
+    const char* mGenomeBases;
+    // the mapped index file
+    char* mMappedData;
+    uint64 mMappedSize;
+    // in bases, merged from the workers
+    vector<vector<double>> mCoverage;
+    vector<vector<double>> mEditDistance;
+    // the first bin of every genome in the bins of the workers, and the total bins at last
+    vector<uint64> mBinStarts;
+    bool mWorkersMerged;
     vector<long> mTotalEditDistance;
     vector<long> mReads;
     vector<long> mBases;
-    // unit32 = 8 bits genome id + 24 bits positions
-    unordered_map<uint64, list<uint32>> mKmerTable; 
+    // the offset of every genome in the concatenation of all the genomes, and the total length at last
+    vector<uint32> mGenomeStarts;
+    // the first genome of every GENOME_BLOCK_BITS block of the concatenation, and the last genome at last
+    vector<uint32> mBlockGenomes;
+    // k <= 32 uses mKmerTables, k > 32 uses mWideKmerTables
+    // the keys are split to one shard per thread, so that the shards can be built in parallel
+    vector<KmerIndex<uint64>> mKmerTables;
+    vector<KmerIndex<uint128>> mWideKmerTables;
+    int mKmerTableShards;
     set<uint64> mLowComplexityKeys;
+    set<uint128> mWideLowComplexityKeys;
+    vector<SpacedSeed> mSpacedSeeds;
+    // one per worker thread
+    vector<GenomeWorker> mWorkers;
     Options* mOptions;
-    long mHitCount;
-    long mMissedCount;
-    char* mBloomFilterArray;
+    BloomFilter mBloomFilter;
+    PhaseTimer mLoadingTimer;
 };
 
+inline bool Genomes::hasSpacedSeedHit(uint64 rollingKey, int validBases, int thread) {
+    const uint32* begin;
+    const uint32* end;
+    for(int s=0; s<mSpacedSeeds.size(); s++) {
+        if(validBases >= mSpacedSeeds[s].mSpan && findSpacedKey(s, rollingKey & mSpacedSeeds[s].mMask, begin, end, mWorkers[thread]))
+            return true;
+    }
+    return false;
+}
+
+inline uint32 Genomes::packIdPos(uint32 id, uint32 position) {
+    return mGenomeStarts[id] + position;
+}
+
+inline void Genomes::unpackIdPos(uint32 data, uint32& id, uint32& pos) {
+    uint32 block = data >> GENOME_BLOCK_BITS;
+    uint32 first = mBlockGenomes[block];
+    uint32 last = mBlockGenomes[block + 1];
+    // usually the block is in one genome
+    if(first == last)
+        id = first;
+    else
+        id = upper_bound(mGenomeStarts.begin() + first + 1, mGenomeStarts.begin() + last + 1, data) - mGenomeStarts.begin() - 1;
+    pos = data - mGenomeStarts[id];
+}
+
+inline uint64 Genomes::spacedBloomKey(int seed, uint64 key) {
+    // mix the seed index in, so that different seeds can share the bloom filter
+    return (key + seed + 1) * 0x9E3779B97F4A7C15UL;
+}
+
+template<typename KeyType>
+inline uint64 Genomes::bloomKey(KeyType key) {
+    return KmerKey<KeyType>::fold(key) * 0x9E3779B97F4A7C15UL;
+}
+
+template<>
+inline vector<KmerIndex<uint64>>& Genomes::kmerTables<uint64>() {
+    return mKmerTables;
+}
+
+template<>
+inline vector<KmerIndex<uint128>>& Genomes::kmerTables<uint128>() {
+    return mWideKmerTables;
+}
+
+template<typename KeyType>
+inline int Genomes::kmerShard(KeyType key) {
+    return (int)(((KmerKey<KeyType>::fold(key) * 0x9E3779B97F4A7C15UL) >> 32) % mKmerTableShards);
+}
+
+// the shard holding this key
+template<typename KeyType>
+inline KmerIndex<KeyType>& Genomes::kmerTable(KeyType key) {
+    return kmerTables<KeyType>()[kmerShard<KeyType>(key)];
+}
+
+template<typename KeyType>
+inline bool Genomes::findKey(KeyType key, const uint32*& begin, const uint32*& end, GenomeWorker& worker) {
+    if(!mBloomFilter.mayContain(bloomKey<KeyType>(key))) {
+        worker.mBloomRejectedCount++;
+        return false;
+    }
+
+    bool hit = kmerTable<KeyType>(key).find(key, begin, end);
+    if(!hit)
+        worker.mMissedCount++;
+
+    return hit;
+}
+
+template<>
+inline set<uint64>& Genomes::lowComplexityKeys<uint64>() {
+    return mLowComplexityKeys;
+}
+
+template<>
+inline set<uint128>& Genomes::lowComplexityKeys<uint128>() {
+    return mWideLowComplexityKeys;
+}
+
 
 #endif
\ No newline at end of file
@@ -272,14 +272,14 @@ void HtmlReporter::printGenomeCoverage(ofstream& ofs, Genomes* g) {
     ofs << "</div>\n"; // section_div
 }
 
-void HtmlReporter::reportKmerCollection(ofstream& ofs, KmerCollection* kc) {
+void HtmlReporter::reportKmerCollection(ofstream& ofs, KmerCollection* kc, string divSuffix) {
     ofs << "<div class='section_div'>\n";
-    ofs << "<div class='section_title' onclick=showOrHide('kcr')><a name='result'>Detection result for k-mer collection file: <I>" << mOptions->kmerCollectionFile << "</I><font color='#88CCFF' > (click to show/hide) </font></a></div>\n";
-    ofs << "<div id='kcr'>\n";
+    ofs << "<div class='section_title' onclick=showOrHide('kcr" << divSuffix << "')><a name='result'>Detection result for k-mer collection file: <I>" << kc->getFilename() << "</I><font color='#88CCFF' > (click to show/hide) </font></a></div>\n";
+    ofs << "<div id='kcr" << divSuffix << "'>\n";
 
-    ofs << "<div id='kcr_result'>\n";
+    ofs << "<div id='kcr_result" << divSuffix << "'>\n";
     
-    kc->reportHTML(ofs);
+    kc->reportHTML(ofs, divSuffix);
 
     ofs << "</div>\n"; //kcr_result
     ofs << "</div>\n"; //kcr
@@ -287,9 +287,9 @@ void HtmlReporter::reportKmerCollection(ofstream& ofs, KmerCollection* kc) {
     ofs << "</div>\n"; // section_div
 }
 
-void HtmlReporter::reportKmerHits(ofstream& ofs, Kmer* kmer) {
-    ofs << "<div id='kmer_hits_figure'>\n";
-    ofs << "<div class='figure' id='plot_kmer_hits' style='height:300px;width:98%'></div>\n";
+void HtmlReporter::reportKmerHits(ofstream& ofs, Kmer* kmer, string divSuffix) {
+    ofs << "<div id='kmer_hits_figure" << divSuffix << "'>\n";
+    ofs << "<div class='figure' id='plot_kmer_hits" << divSuffix << "' style='height:300px;width:98%'></div>\n";
     ofs << "</div>\n";
     
     ofs << "\n<script type=\"text/javascript\">" << endl;
@@ -306,7 +306,7 @@ void HtmlReporter::reportKmerHits(ofstream& ofs, Kmer* kmer) {
     json_str += "];\n";
 
     json_str += "var layout={title:'Unique k-mer hits (" + to_string(kmer->getKmerCount()) + " k-mer keys)', xaxis:{tickangle:60, tickfont:{size: 8,color: '#bc6f98'}},yaxis:{title:'Hit'}};\n";
-    json_str += "Plotly.newPlot('plot_kmer_hits', data, layout);\n";
+    json_str += "Plotly.newPlot('plot_kmer_hits" + divSuffix + "', data, layout);\n";
 
     ofs << json_str;
     ofs << "</script>" << endl;
@@ -373,15 +373,15 @@ void HtmlReporter::reportDuplication(ofstream& ofs) {
     delete[] gc;
 }
 
-void HtmlReporter::printDetectionResult(ofstream& ofs, Kmer* kmer) {
+void HtmlReporter::printDetectionResult(ofstream& ofs, Kmer* kmer, string divSuffix) {
     ofs << "<div class='section_div'>\n";
-    ofs << "<div class='section_title' onclick=showOrHide('result')><a name='result'>Detection result for target unique k-mer file: <I>" << mOptions->kmerFile << "</I><font color='#88CCFF' > (click to show/hide) </font></a></div>\n";
-    ofs << "<div id='result'>\n";
+    ofs << "<div class='section_title' onclick=showOrHide('result" << divSuffix << "')><a name='result'>Detection result for target unique k-mer file: <I>" << kmer->getFilename() << "</I><font color='#88CCFF' > (click to show/hide) </font></a></div>\n";
+    ofs << "<div id='result" << divSuffix << "'>\n";
 
-    ofs << "<div id='detection_result'>\n";
+    ofs << "<div id='detection_result" << divSuffix << "'>\n";
     ofs << "<table class='summary_table' style='width:800px'>\n";
     string result;
-    if(kmer->getMeanHit() >= mOptions->positiveThreshold)
+    if(kmer->isPositive())
         result = "<font color='red'><B>POSITIVE<B></font>";
     else
         result = "NEGATIVE";
@@ -392,7 +392,7 @@ void HtmlReporter::printDetectionResult(ofstream& ofs, Kmer* kmer) {
 
     ofs << "</div>\n"; //detection_result
 
-    reportKmerHits(ofs, kmer);
+    reportKmerHits(ofs, kmer, divSuffix);
 
     ofs << "</div>\n"; //result
 
@@ -409,12 +409,15 @@ void HtmlReporter::report(VirusDetector* vd, FilterResult* result, Stats* preSta
     string intro = "Created by <a href='https://github.com/OpenGene/fastv' style='color:#1F77B4'>fastv</a> v" + string(FASTV_VER)+ ", " + " an ultra-fast tool for fast identification of SARS-CoV-2 and other microbes from sequencing data";
     ofs << "<div style='font-size:10px;font-weight:normal;text-align:left;color:#666666;padding:5px;'>" << intro << "</div>" << endl;
 
-    if(vd->getKmer()) 
-        printDetectionResult(ofs, vd->getKmer());
+    // the first section of each kind keeps the original div ids
+    vector<Kmer*>& kmers = vd->getKmers();
+    for(int i=0; i<kmers.size(); i++)
+        printDetectionResult(ofs, kmers[i], i==0 ? "" : "_" + to_string(i));
     if(vd->getGenomes()) 
         printGenomeCoverage(ofs, vd->getGenomes());
-    if(vd->getKmerCollection()) 
-        reportKmerCollection(ofs, vd->getKmerCollection());
+    vector<KmerCollection*>& kcs = vd->getKmerCollections();
+    for(int i=0; i<kcs.size(); i++)
+        reportKmerCollection(ofs, kcs[i], i==0 ? "" : "_" + to_string(i));
 
     printSummary(ofs, result, preStats1, postStats1, preStats2, postStats2);
 
@@ -34,10 +34,10 @@ private:
     void reportDuplication(ofstream& ofs);
     void reportInsertSize(ofstream& ofs, int isizeLimit);
     void printSummary(ofstream& ofs, FilterResult* result, Stats* preStats1, Stats* postStats1, Stats* preStats2, Stats* postStats2);
-    void printDetectionResult(ofstream& ofs, Kmer* kmer);
+    void printDetectionResult(ofstream& ofs, Kmer* kmer, string divSuffix = "");
     void printGenomeCoverage(ofstream& ofs, Genomes* g);
-    void reportKmerHits(ofstream& ofs, Kmer* kmer);
-    void reportKmerCollection(ofstream& ofs, KmerCollection* kc);
+    void reportKmerHits(ofstream& ofs, Kmer* kmer, string divSuffix = "");
+    void reportKmerCollection(ofstream& ofs, KmerCollection* kc, string divSuffix = "");
     
     
 private:
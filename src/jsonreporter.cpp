@@ -1,4 +1,5 @@
 #include "jsonreporter.h"
+#include "util.h"
 
 JsonReporter::JsonReporter(Options* opt){
     mOptions = opt;
@@ -20,6 +21,14 @@ void JsonReporter::setInsertHist(long* insertHist, int insertSizePeak) {
     mInsertSizePeak = insertSizePeak;
 }
 
+// like {"parse": 0.1, "insert": 0.05}
+static void reportPhases(ofstream& ofs, vector<pair<string, double>>& phases) {
+    ofs << "{";
+    for(int i=0; i<phases.size(); i++)
+        ofs << (i == 0 ? "" : ", ") << "\"" << phases[i].first << "\": " << phases[i].second;
+    ofs << "}";
+}
+
 extern string command;
 void JsonReporter::report(VirusDetector* vd, FilterResult* result, Stats* preStats1, Stats* postStats1, Stats* preStats2, Stats* postStats2) {
     ofstream ofs;
@@ -66,40 +75,96 @@ void JsonReporter::report(VirusDetector* vd, FilterResult* result, Stats* preSta
     if(postStats2)
         post_total_gc += postStats2->getGCNumber();
 
-    // KMER detection
-    Kmer* kmer = vd->getKmer();
-    if(kmer) {
-        string detectionResult;
-        if(kmer->getMeanHit() >= mOptions->positiveThreshold)
-            detectionResult = "POSITIVE";
-        else
-            detectionResult = "NEGATIVE";
-
-        ofs << "\t" << "\"kmer_detection_result\": {" << endl;
-        ofs << "\t\t" << "\"result\": \"" << detectionResult << "\"," << endl;
-        ofs << "\t\t" << "\"mean_coverage\": " << kmer->getMeanHit() << "," << endl;
-        ofs << "\t\t" << "\"positive_thread\": " << mOptions->positiveThreshold << "," << endl;
-
-        // unique kmer hits
-        ofs << "\t\t" << "\"kmer_hits\": {" << endl;
-            kmer->reportJSON(ofs);
-        ofs << "\t\t" << "}" << endl;
-
-
-        ofs << "\t" << "}," << endl;
+    // KMER detection, a single k-mer file keeps the object format, multiple files are reported as an array
+    vector<Kmer*>& kmers = vd->getKmers();
+    if(kmers.size() > 0) {
+        bool multiple = kmers.size() > 1;
+        ofs << "\t" << "\"kmer_detection_result\": " << (multiple ? "[" : "{") << endl;
+        for(int i=0; i<kmers.size(); i++) {
+            Kmer* kmer = kmers[i];
+            string detectionResult;
+            if(kmer->isPositive())
+                detectionResult = "POSITIVE";
+            else
+                detectionResult = "NEGATIVE";
+
+            if(multiple) {
+                ofs << "\t\t" << "{" << endl;
+                ofs << "\t\t" << "\"kmer_file\": \"" << replace(kmer->getFilename(), "\"", "'") << "\"," << endl;
+            }
+            ofs << "\t\t" << "\"result\": \"" << detectionResult << "\"," << endl;
+            ofs << "\t\t" << "\"mean_coverage\": " << kmer->getMeanHit() << "," << endl;
+            ofs << "\t\t" << "\"positive_thread\": " << mOptions->positiveThreshold << "," << endl;
+
+            // unique kmer hits
+            ofs << "\t\t" << "\"kmer_hits\": {" << endl;
+                kmer->reportJSON(ofs);
+            ofs << "\t\t" << "}" << endl;
+
+            if(multiple)
+                ofs << "\t\t" << "}" << (i == kmers.size()-1 ? "" : ",") << endl;
+        }
+        ofs << "\t" << (multiple ? "]" : "}") << "," << endl;
     }
 
-    // KMER detection
+    // Genome detection
     Genomes* genome = vd->getGenomes();
     if(genome) {
         genome->reportJSON(ofs);
     }
 
-    // KMER detection
-    KmerCollection* kc = vd->getKmerCollection();
-    if(kc) {
-        kc->reportJSON(ofs);
+    // KMER collection detection, also reported as an array if multiple files are given
+    vector<KmerCollection*>& kcs = vd->getKmerCollections();
+    if(kcs.size() == 1) {
+        kcs[0]->reportJSON(ofs);
+    } else if(kcs.size() > 1) {
+        ofs << "\t" << "\"kmer_collection_scan_result\": [" << endl;
+        for(int i=0; i<kcs.size(); i++) {
+            KmerCollection* kc = kcs[i];
+            ofs << "\t\t" << "{" << endl;
+            ofs << "\t\t" << "\"kmer_collection_file\": \"" << replace(kc->getFilename(), "\"", "'") << "\"," << endl;
+            ofs << "\t\t" << "\"result\": \"" << (kc->isPositive() ? "POSITIVE" : "NEGATIVE") << "\"," << endl;
+            if(kc->hasTaxonomy()) {
+                kc->reportTaxonomyJSON(ofs, "\t\t");
+                ofs << "," << endl;
+            }
+            ofs << "\t\t" << "\"genomes\": {" << endl;
+            kc->reportGenomesJSON(ofs);
+            ofs << endl << "\t\t" << "}" << endl;
+            ofs << "\t\t" << "}" << (i == kcs.size()-1 ? "" : ",") << endl;
+        }
+        ofs << "\t" << "]," << endl;
+    }
+
+    // the cost of loading the detection databases
+    ofs << "\t" << "\"database_loading\": {" << endl;
+    ofs << "\t\t" << "\"time_sec\": " << vd->getLoadingTime() << "," << endl;
+    ofs << "\t\t" << "\"rss_mb_before\": " << vd->getRSSBeforeLoading() << "," << endl;
+    ofs << "\t\t" << "\"rss_mb_after\": " << vd->getRSSAfterLoading() << "," << endl;
+    ofs << "\t\t" << "\"peak_rss_mb\": " << peak_rss_mb() << "," << endl;
+    ofs << "\t\t" << "\"kmer_collection_hash_slots\": [";
+    for(int i=0; i<kcs.size(); i++)
+        ofs << (i == 0 ? "" : ",") << kcs[i]->getHashLength();
+    ofs << "]," << endl;
+    // seconds spent in every phase of building or mapping the index
+    ofs << "\t\t" << "\"kmer_collection_loading_phases\": [";
+    for(int i=0; i<kcs.size(); i++) {
+        ofs << (i == 0 ? "" : ",");
+        reportPhases(ofs, kcs[i]->getLoadingPhases());
     }
+    ofs << "]";
+    if(genome) {
+        ofs << "," << endl << "\t\t" << "\"genomes_loading_phases\": ";
+        reportPhases(ofs, genome->getLoadingPhases());
+        BloomFilter& bf = genome->getBloomFilter();
+        ofs << "," << endl << "\t\t" << "\"genomes_bloom_filter\": {";
+        ofs << "\"bytes\": " << bf.getBytes();
+        ofs << ", \"hashes\": " << bf.getHashNum();
+        ofs << ", \"target_fp_rate\": " << bf.getTargetFPRate();
+        ofs << ", \"measured_fp_rate\": " << genome->getBloomFilterFPRate() << "}";
+    }
+    ofs << endl;
+    ofs << "\t" << "}," << endl;
 
     // summary
     ofs << "\t" << "\"summary\": {" << endl;
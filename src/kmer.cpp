@@ -7,6 +7,8 @@ Kmer::Kmer(string filename, Options* opt)
 {
     mFastaReader = NULL;
     mOptions = opt;
+    mFilename = filename;
+    mKeyLen = 0;
     init(filename);
     resultMade = false;
 }
@@ -31,22 +33,34 @@ void Kmer::init(string filename)
     for(iter = kmers.begin(); iter != kmers.end() ; iter++) {
         string seq = iter->second;
 
+        // every KMER file has its own key length, given by its first KMER
         if(!initialized) {
             initialized = true;
-            if(mOptions->kmerKeyLen == 0)
-                mOptions->kmerKeyLen = seq.length();
+            mKeyLen = seq.length();
+            if(!KmerKey<uint128>::fits(mKeyLen))
+                error_exit("KMER length cannot be >" + to_string(KmerKey<uint128>::MAX_LEN) + ": " + seq);
         }
-        if(seq.length() != mOptions->kmerKeyLen) {
-            cerr << "KMER length must be " << mOptions->kmerKeyLen << ", skipped " << seq << endl;
+        if(seq.length() != mKeyLen) {
+            cerr << "KMER length must be " << mKeyLen << ", skipped " << seq << endl;
             continue;
         }
         bool valid = true;
-        uint64 kmer64 = seq2uint64(seq, 0, seq.length(), valid);
-        if(valid) {
-            mKmerHits[kmer64] = 0;
-            mNames[kmer64] = iter->first;
-            mSequences[kmer64] = iter->second;
+        bool added = false;
+        uint32 id = mKmerHits.size();
+        if(KmerKey<uint64>::fits(seq.length())) {
+            uint64 key = KmerKey<uint64>::encode(seq.c_str(), 0, seq.length(), valid);
+            if(valid)
+                added = mKmerIds.insert(make_pair(key, id)).second;
         } else {
+            uint128 key = KmerKey<uint128>::encode(seq.c_str(), 0, seq.length(), valid);
+            if(valid)
+                added = mWideKmerIds.insert(make_pair(key, id)).second;
+        }
+        if(added) {
+            mKmerHits.push_back(0);
+            mNames.push_back(iter->first);
+            mSequences.push_back(iter->second);
+        } else if(!valid) {
             cerr << iter->first << ": " << seq << " skipped" << endl;
         }
     }
@@ -58,11 +72,9 @@ void Kmer::init(string filename)
 
 void Kmer::makeResults() {
     mResults.clear();
-    unordered_map<uint64, uint32>::iterator iter;
-    for(iter = mKmerHits.begin(); iter != mKmerHits.end(); iter++) {
-        uint64 kmer64 = iter->first;
-        string title = mNames[kmer64] + "_" + mSequences[kmer64];
-        mResults[title] =  iter->second;
+    for(uint32 id=0; id<mKmerHits.size(); id++) {
+        string title = mNames[id] + "_" + mSequences[id];
+        mResults[title] =  mKmerHits[id];
     }
     resultMade = true;
 }
@@ -79,7 +91,7 @@ void Kmer::report() {
     double meanHit = getMeanHit();
     cerr << endl;
     cerr << "Mean depth: " << meanHit << endl<<endl;
-    if(meanHit >= mOptions->positiveThreshold)
+    if(isPositive())
         cerr << "Result: POSITIVE";
     else
         cerr << "Result: NEGATIVE";
@@ -91,22 +103,16 @@ double Kmer::getMeanHit() {
         return 0.0;
 
     double total = 0;
-    unordered_map<uint64, uint32>::iterator iter;
-    for(iter = mKmerHits.begin(); iter != mKmerHits.end(); iter++) {
-        total += iter->second;
+    for(uint32 id=0; id<mKmerHits.size(); id++) {
+        total += mKmerHits[id];
     }
     return total / (double) mKmerHits.size();
 }
 
-bool Kmer::add(uint64 kmer64) {
-    unordered_map<uint64, uint32>::iterator iter = mKmerHits.find(kmer64);
-    if(iter != mKmerHits.end()) {
-        iter->second++;
-        return true;
-    }
-    return false;
-}
 
+bool Kmer::isPositive() {
+    return getMeanHit() >= mOptions->positiveThreshold;
+}
 
 string Kmer::getPlotX() {
     if(!resultMade)
@@ -167,28 +173,41 @@ void Kmer::reportJSON(ofstream& ofs) {
 }
 
 uint64 Kmer::seq2uint64(string& seq, uint32 pos, uint32 len, bool& valid) {
-    uint64 key = 0;
-    for(uint32 i=0; i<len; i++) {
-        key = (key << 2);
-        switch(seq[pos +i]) {
-            case 'A':
-                key += 0;
-                break;
-            case 'T':
-                key += 1;
-                break;
-            case 'C':
-                key += 2;
-                break;
-            case 'G':
-                key += 3;
-                break;
-            case 'N':
-            default:
-                valid = false;
-                return 0;
-        }
-    }
-    valid = true;
-    return key;
-}
\ No newline at end of file
+    return seq2uint64(seq.c_str(), pos, len, valid);
+}
+
+uint64 Kmer::seq2uint64(const char* seq, uint32 pos, uint32 len, bool& valid) {
+    return KmerKey<uint64>::encode(seq, pos, len, valid);
+}
+
+bool Kmer::test() {
+    string seq = "ATCGNATCGGATTACAGATTACAGATTACAGATTACAGATTACAGATTACAGATTACAGATTACAGATTACA";
+    bool valid = true;
+
+    // the same bases should get the same key in both widths when k <= 32
+    uint64 key64 = KmerKey<uint64>::encode(seq.c_str(), 5, 32, valid);
+    if(!valid)
+        return false;
+    uint128 key128 = KmerKey<uint128>::encode(seq.c_str(), 5, 32, valid);
+    if(!valid || (uint64)key128 != key64 || (key128 >> 64) != 0)
+        return false;
+
+    // wide keys should keep all 63 bases
+    uint128 wide = KmerKey<uint128>::encode(seq.c_str(), 5, 63, valid);
+    if(!valid || KmerKey<uint128>::decode(wide, 63) != seq.substr(5, 63))
+        return false;
+
+    // rolling one more base and trimming should equal to encoding the shifted window
+    // seq[68] is T, which is encoded as 1
+    uint128 rolled = KmerKey<uint128>::trim((wide << 2) + 1, 63);
+    uint128 shifted = KmerKey<uint128>::encode(seq.c_str(), 6, 63, valid);
+    if(rolled != shifted)
+        return false;
+
+    // N is not encodable
+    KmerKey<uint64>::encode(seq.c_str(), 0, 25, valid);
+    if(valid)
+        return false;
+
+    return true;
+}
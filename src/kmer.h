@@ -8,6 +8,7 @@
 #include <map>
 #include "fastareader.h"
 #include "options.h"
+#include "kmerkey.h"
 #include <fstream>
 
 using namespace std;
@@ -18,28 +19,63 @@ public:
     Kmer(string filename, Options* opt);
     ~Kmer();
     void init(string filename);
-    bool add(uint64 kmer64);
+    template<typename KeyType>
+    inline bool add(KeyType key);
     void report();
     double getMeanHit();
     string getPlotX();
     string getPlotY();
     int getKmerCount();
+    bool isPositive();
+    string getFilename() {return mFilename;}
+    int getKeyLen() {return mKeyLen;}
     void reportJSON(ofstream& ofs);
 
     static uint64 seq2uint64(string& seq, uint32 pos, uint32 len, bool& valid);
+    static uint64 seq2uint64(const char* seq, uint32 pos, uint32 len, bool& valid);
+
+    static bool test();
 
 private:
     void makeResults();
+    template<typename KeyType>
+    inline unordered_map<KeyType, uint32, KmerKeyHash<KeyType>>& kmerIds();
 
 private:
-    unordered_map<uint64, uint32> mKmerHits;
+    // k <= 32 uses mKmerIds, k > 32 uses mWideKmerIds
+    unordered_map<uint64, uint32, KmerKeyHash<uint64>> mKmerIds;
+    unordered_map<uint128, uint32, KmerKeyHash<uint128>> mWideKmerIds;
+    vector<uint32> mKmerHits;
     FastaReader* mFastaReader;
-    unordered_map<uint64, string> mNames;
-    unordered_map<uint64, string> mSequences;
+    vector<string> mNames;
+    vector<string> mSequences;
     map<string, uint32> mResults;
     Options* mOptions;
+    string mFilename;
+    int mKeyLen;
     bool resultMade;
 };
 
+template<>
+inline unordered_map<uint64, uint32, KmerKeyHash<uint64>>& Kmer::kmerIds<uint64>() {
+    return mKmerIds;
+}
+
+template<>
+inline unordered_map<uint128, uint32, KmerKeyHash<uint128>>& Kmer::kmerIds<uint128>() {
+    return mWideKmerIds;
+}
+
+template<typename KeyType>
+inline bool Kmer::add(KeyType key) {
+    unordered_map<KeyType, uint32, KmerKeyHash<KeyType>>& ids = kmerIds<KeyType>();
+    typename unordered_map<KeyType, uint32, KmerKeyHash<KeyType>>::iterator iter = ids.find(key);
+    if(iter != ids.end()) {
+        mKmerHits[iter->second]++;
+        return true;
+    }
+    return false;
+}
+
 
-#endif
\ No newline at end of file
+#endif
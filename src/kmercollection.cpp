@@ -3,15 +3,21 @@
 #include <sstream>
 #include <string.h>
 #include <memory.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <stddef.h>
+#include <functional>
 #include "kmer.h"
 
-const long HASH_LENGTH = (1L<<30);
-
 KmerCollection::KmerCollection(string filename, Options* opt)
 {
     mOptions = opt;
-    mHashKCH = new uint32[HASH_LENGTH];
-    memset(mHashKCH, 0, sizeof(uint32)*HASH_LENGTH);
+    mHashLength = 0;
+    mEntryNum = 0;
+    mHashShift = 64;
     mFilename = filename;
     mNumber = 0;
     mIdBits = 0;
@@ -19,20 +25,51 @@ KmerCollection::KmerCollection(string filename, Options* opt)
     mCountMax = 0;
     mStatDone = false;
     mUniqueHashNum = 0;
-    mKCHits = NULL;
+    mKeyLen = 0;
+    mKCEntries = NULL;
+    mWideKCEntries = NULL;
+    mHitCounts = NULL;
+    mHitCountBytes = 0;
+    mSuccinct = NULL;
+    mMappedData = NULL;
+    mMappedSize = 0;
+    mZipped = false;
+    mZipFile = NULL;
+    mTaxonomy = NULL;
     init();
 }
 
 KmerCollection::~KmerCollection()
 {
-    if(mHashKCH) {
-        delete mHashKCH;
-        mHashKCH = NULL;
+    // the hash table points to the mapped index
+    if(mMappedData) {
+        munmap(mMappedData, mMappedSize);
+        mMappedData = NULL;
+        mKCEntries = NULL;
+        mWideKCEntries = NULL;
+    }
+
+    // allocated by posix_memalign()
+    if(mKCEntries) {
+        free(mKCEntries);
+        mKCEntries = NULL;
+    }
+
+    if(mWideKCEntries) {
+        free(mWideKCEntries);
+        mWideKCEntries = NULL;
     }
 
-    if(mKCHits) {
-        delete mKCHits;
-        mKCHits = NULL;
+    freeHitCounts();
+
+    if(mSuccinct) {
+        delete mSuccinct;
+        mSuccinct = NULL;
+    }
+
+    if(mTaxonomy) {
+        delete mTaxonomy;
+        mTaxonomy = NULL;
     }
 
     if (mZipped){
@@ -48,29 +85,84 @@ KmerCollection::~KmerCollection()
     }
 }
 
-bool KmerCollection::getLine(char* line, int maxLine){
-    bool status = true;
-    if(mZipped)
-        status = gzgets(mZipFile, line, maxLine);
-    else {
-        mFile.getline(line, maxLine);
-        status = !mFile.fail();
+// reads about KC_CHUNK_SIZE bytes of whole lines, the incomplete last line is kept for the next chunk
+bool KmerCollection::readChunk(string& chunk){
+    chunk.swap(mPendingLine);
+    mPendingLine.clear();
+    uint64 start = chunk.size();
+    chunk.resize(start + KC_CHUNK_SIZE);
+    long readed = 0;
+    if(mZipped) {
+        readed = gzread(mZipFile, &chunk[start], KC_CHUNK_SIZE);
+        if(readed < 0)
+            error_exit("Failed to read: " + mFilename);
+    } else {
+        mFile.read(&chunk[start], KC_CHUNK_SIZE);
+        readed = mFile.gcount();
     }
+    chunk.resize(start + readed);
 
-    // trim \n, \r or \r\n in the tail
-    int readed = strlen(line);
-    if(readed >=2 ){
-        if(line[readed-1] == '\n' || line[readed-1] == '\r'){
-            line[readed-1] = '\0';
-            if(line[readed-2] == '\r')
-                line[readed-2] = '\0';
-        }
+    // end of file
+    if(readed < KC_CHUNK_SIZE)
+        return !chunk.empty();
+
+    size_t lastLineEnd = chunk.rfind('\n');
+    if(lastLineEnd != string::npos) {
+        mPendingLine = chunk.substr(lastLineEnd + 1);
+        chunk.resize(lastLineEnd + 1);
     }
+    return true;
+}
 
-    return status;
+// the line starting at pos, without the \n, \r or \r\n in the tail
+static bool nextLine(const char* data, uint64& pos, uint64 end, const char*& line, uint64& len) {
+    if(pos >= end)
+        return false;
+    line = data + pos;
+    const char* lf = (const char*)memchr(line, '\n', end - pos);
+    uint64 lineEnd = lf ? lf - data : end;
+    len = lineEnd - pos;
+    pos = lineEnd + 1;
+    if(len > 0 && line[len-1] == '\r')
+        len--;
+    return true;
+}
+
+// split the chunk to parts of whole lines, part t is [bounds[t], bounds[t+1])
+static void splitLines(const string& chunk, int parts, vector<uint64>& bounds) {
+    bounds.assign(parts + 1, chunk.size());
+    bounds[0] = 0;
+    for(int t=1; t<parts; t++) {
+        uint64 target = max(bounds[t-1], (uint64)(chunk.size() * t / parts));
+        if(target == 0) {
+            bounds[t] = 0;
+            continue;
+        }
+        size_t lf = chunk.find('\n', target - 1);
+        bounds[t] = (lf == string::npos) ? chunk.size() : lf + 1;
+    }
 }
 
-bool descComp (int i,int j) { return (i>j); }
+// the genome names in [start, end) of the chunk, a name line starts with '>'
+static void collectNames(const string& chunk, uint64 start, uint64 end, vector<string>& names) {
+    const char* data = chunk.data();
+    uint64 pos = start;
+    while(pos < end) {
+        const char* gt = (const char*)memchr(data + pos, '>', end - pos);
+        if(gt == NULL)
+            break;
+        pos = gt - data;
+        if(pos == start || data[pos-1] == '\n') {
+            const char* line;
+            uint64 len;
+            if(!nextLine(data, pos, end, line, len))
+                break;
+            names.push_back(string(line + 1, len - 1));
+        } else {
+            pos++;
+        }
+    }
+}
 
 bool KCResultComp (KCResult i, KCResult j) { 
     if (i.mCoverage == j.mCoverage)
@@ -79,15 +171,62 @@ bool KCResultComp (KCResult i, KCResult j) {
         return i.mCoverage > j.mCoverage;
 }
 
+template<typename KeyType, typename Visitor>
+void KmerCollection::visitHits(Visitor& visit){
+    KCEntry<KeyType>* kcEntryArray = kcEntries<KeyType>();
+    if(kcEntryArray == NULL)
+        return;
+    for(uint64 i=0; i<mHashLength; i++) {
+        KCEntry<KeyType>& kce = kcEntryArray[i];
+        uint32 hit = mHitCounts[i];
+
+        // the shared k-mers belong to no genome
+        if(hit>0 && (kce.mID & KC_SET_BIT) == 0)
+            visit(kce.mID-1, hit);
+    }
+}
+
+template<typename Visitor>
+void KmerCollection::visitAllHits(Visitor& visit){
+    if(mSuccinct == NULL) {
+        visitHits<uint64>(visit);
+        visitHits<uint128>(visit);
+        return;
+    }
+    for(uint64 i=0; i<mSuccinct->size(); i++) {
+        uint32 hit = mHitCounts[i];
+        if(hit == 0)
+            continue;
+        uint32 id = mSuccinct->getId(i);
+        if((id & KC_SET_BIT) == 0)
+            visit(id-1, hit);
+    }
+}
+
 void KmerCollection::stat(){
-    vector<vector<int>> kmerHits(mNumber);
-    for(int i=0; i<mUniqueHashNum; i++) {
-        KCHit kch = mKCHits[i];
+    // the sum and the number of the hit k-mers of every genome
+    vector<uint64> hitKmers(mNumber, 0);
+    auto sum = [&](uint32 id, uint32 hit) {
+        mHits[id] += hit;
+        hitKmers[id]++;
+    };
+    visitAllHits(sum);
 
-        if(kch.mHit>0) {
-            mHits[kch.mID]+=kch.mHit;
-            kmerHits[kch.mID].push_back(kch.mHit);
-        }
+    // the median is the ((k-mer count + 1) / 2)-th largest hit, so it's 0 unless more k-mers are hit than that,
+    // only these genomes need a depth histogram
+    vector<int> histSlots(mNumber, -1);
+    int histNum = 0;
+    for(int id=0; id<mNumber; id++) {
+        if(mKmerCounts[id] > 0 && hitKmers[id] > (mKmerCounts[id]+1)/2)
+            histSlots[id] = histNum++;
+    }
+    vector<uint32> bins((uint64)histNum * DH_BINS, 0);
+    if(histNum > 0) {
+        auto count = [&](uint32 id, uint32 hit) {
+            if(histSlots[id] >= 0)
+                bins[(uint64)histSlots[id] * DH_BINS + DepthHistogram::bin(hit)]++;
+        };
+        visitAllHits(count);
     }
 
     for(int id=0; id<mNumber; id++){
@@ -96,22 +235,22 @@ void KmerCollection::stat(){
             mMeanHits[id]=0.0;
             mCoverage[id]=0.0;
         } else{
-            int medianPos = (mKmerCounts[id]+1)/2;
-            if(medianPos >= kmerHits[id].size())
+            if(histSlots[id] < 0)
                 mMedianHits[id] = 0;
-            else {
-                nth_element(kmerHits[id].begin(), kmerHits[id].begin()+medianPos, kmerHits[id].end(), descComp);
-                mMedianHits[id] = kmerHits[id][medianPos];
-            }
+            else
+                mMedianHits[id] = DepthHistogram::descendingAt(bins.data() + (uint64)histSlots[id] * DH_BINS, (mKmerCounts[id]+1)/2);
             mMeanHits[id] = (double)mHits[id]/(double)mKmerCounts[id];
-            mCoverage[id] = (double)kmerHits[id].size()/(double)mKmerCounts[id];
+            mCoverage[id] = (double)hitKmers[id]/(double)mKmerCounts[id];
         }
     }
 
     for(int id=0; id<mNumber; id++){
         if(mCoverage[id] > mOptions->kcCoverageThreshold && mKmerCounts[id] > 10) {
             KCResult kcr;
+            kcr.mID = id + 1;
             kcr.mName = mNames[id];
+            kcr.mEstimatedReads = 0.0;
+            kcr.mAbundance = 0.0;
             kcr.mHit = mHits[id];
             kcr.mCoverage = mCoverage[id];
             kcr.mMedianHit = mMedianHits[id];
@@ -125,20 +264,97 @@ void KmerCollection::stat(){
 
     sort(mResults.begin(),mResults.end(),KCResultComp);
 
+    if(mTaxonomy)
+        statTaxonomy();
+
+    estimateAbundance();
+
     mStatDone = true;
 }
 
-uint32 KmerCollection::add(uint64 kmer64) {
-    uint64 kmerhash = makeHash(kmer64);
-    uint32 index = mHashKCH[kmerhash];
-    if(index != 0 && index != COLLISION_FLAG) {
-        if(mKCHits[index - 1].mKey64 == kmer64) {
-            mKCHits[index - 1].mHit++;
-            return mKCHits[index - 1].mID + 1;
-        } else
-            return 0;
-    } else
-        return 0;
+void KmerCollection::initSetTaxa() {
+    uint32 setNum = mSetStarts.empty() ? 0 : mSetStarts.size() - 1;
+    mSetTaxa = vector<int>(setNum, -1);
+    for(uint32 s=0; s<setNum; s++) {
+        int lca = mGenomeTaxa[mSetGenomes[mSetStarts[s]] - 1];
+        for(uint64 i=mSetStarts[s] + 1; i<mSetStarts[s + 1] && lca >= 0; i++) {
+            int taxon = mGenomeTaxa[mSetGenomes[i] - 1];
+            lca = taxon < 0 ? -1 : mTaxonomy->lca(lca, taxon);
+        }
+        mSetTaxa[s] = lca;
+    }
+}
+
+void KmerCollection::addReadHits(vector<uint32>& ids, EquivalenceClasses& classes) {
+    vector<uint32> distinct(ids);
+    sort(distinct.begin(), distinct.end());
+    distinct.erase(unique(distinct.begin(), distinct.end()), distinct.end());
+
+    // the candidates are the genomes of the hit with the fewest genomes, a shared k-mer hits all the genomes of its set
+    uint32 fewest = 0;
+    uint64 fewestNum = 0;
+    for(int i=0; i<distinct.size(); i++) {
+        uint32 id = distinct[i];
+        uint64 num = setSize(id);
+        if(fewest == 0 || num < fewestNum) {
+            fewest = id;
+            fewestNum = num;
+        }
+    }
+    if(fewest == 0)
+        return;
+
+    vector<uint32> genomes;
+    uint64 first = (fewest & KC_SET_BIT) ? mSetStarts[fewest & ~KC_SET_BIT] : 0;
+    for(uint64 c=0; c<fewestNum; c++) {
+        uint32 candidate = (fewest & KC_SET_BIT) ? mSetGenomes[first + c] : fewest;
+        bool compatible = true;
+        for(int i=0; i<distinct.size() && compatible; i++)
+            compatible = genomeHasId(candidate, distinct[i]);
+        if(compatible)
+            genomes.push_back(candidate);
+    }
+
+    // no genome has all the hits (i.e. sequencing errors or chimeric reads), so take all the genomes hit directly
+    if(genomes.empty()) {
+        for(int i=0; i<distinct.size(); i++) {
+            if((distinct[i] & KC_SET_BIT) == 0)
+                genomes.push_back(distinct[i]);
+        }
+    }
+    if(!genomes.empty())
+        classes.add(genomes);
+}
+
+void KmerCollection::mergeClasses(EquivalenceClasses& classes, unordered_map<int, long>& taxonReads) {
+    if(classes.empty() && taxonReads.empty())
+        return;
+    std::lock_guard<std::mutex> lock(mClassesMtx);
+    mClasses.merge(classes);
+    unordered_map<int, long>::iterator iter;
+    for(iter = taxonReads.begin(); iter != taxonReads.end(); iter++)
+        mTaxonReads[iter->first] += iter->second;
+    taxonReads.clear();
+}
+
+void KmerCollection::estimateAbundance() {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int iterations = 0;
+    mEstimatedReads = AbundanceEstimator::estimate(mClasses, mNumber, mOptions->thread, iterations);
+
+    double total = 0.0;
+    for(int id=0; id<mNumber; id++)
+        total += mEstimatedReads[id];
+    for(int i=0; i<mResults.size(); i++) {
+        mResults[i].mEstimatedReads = mEstimatedReads[mResults[i].mID - 1];
+        mResults[i].mAbundance = total > 0 ? mResults[i].mEstimatedReads / total : 0.0;
+    }
+
+    if(mOptions->verbose) {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        loginfo(mFilename + ": abundance estimated over " + to_string(mClasses.size()) + " equivalence classes of " + to_string((long)total) + " reads, "
+            + to_string(iterations) + " EM iterations in " + to_string(seconds) + " seconds");
+    }
 }
 
 void KmerCollection::addGenomeRead(uint32 genomeID) {
@@ -146,10 +362,94 @@ void KmerCollection::addGenomeRead(uint32 genomeID) {
         mGenomeReads[genomeID-1]++;
 }
 
+// Kraken-style: every hit votes for its taxon, and the read goes to the hit taxon with the most votes
+// on its path from the root, or to the LCA of the tied ones
+int KmerCollection::classify(vector<uint32>& ids) {
+    // a read usually hits just a few taxa
+    vector<pair<int, int>> votes;
+    for(int i=0; i<ids.size(); i++) {
+        int taxon = taxonOf(ids[i]);
+        if(taxon < 0)
+            continue;
+        int v = 0;
+        while(v < votes.size() && votes[v].first != taxon)
+            v++;
+        if(v == votes.size())
+            votes.push_back(make_pair(taxon, 0));
+        votes[v].second++;
+    }
+
+    int best = -1;
+    int bestScore = 0;
+    for(int v=0; v<votes.size(); v++) {
+        int score = 0;
+        for(int a = votes[v].first; a >= 0; a = mTaxonomy->getParent(a)) {
+            for(int u=0; u<votes.size(); u++) {
+                if(votes[u].first == a)
+                    score += votes[u].second;
+            }
+        }
+        if(score > bestScore) {
+            best = votes[v].first;
+            bestScore = score;
+        } else if(score == bestScore && best >= 0) {
+            best = mTaxonomy->lca(best, votes[v].first);
+        }
+    }
+
+    return best;
+}
+
+void KmerCollection::statTaxonomy() {
+    mCladeReads = vector<long>(mTaxonomy->size(), 0);
+    for(int t=0; t<mTaxonomy->size(); t++) {
+        if(mTaxonReads[t] == 0)
+            continue;
+        for(int a = t; a >= 0; a = mTaxonomy->getParent(a))
+            mCladeReads[a] += mTaxonReads[t];
+    }
+}
+
+bool taxonReadsComp(pair<int, long> a, pair<int, long> b) {
+    return a.second > b.second;
+}
+
+// the taxa of this rank with classified reads, sorted by the clade reads
+vector<pair<int, long>> KmerCollection::taxaOfRank(string rank) {
+    vector<pair<int, long>> taxa;
+    for(int t=0; t<mTaxonomy->size(); t++) {
+        if(mCladeReads[t] > 0 && mTaxonomy->getRank(t) == rank)
+            taxa.push_back(make_pair(t, mCladeReads[t]));
+    }
+    sort(taxa.begin(), taxa.end(), taxonReadsComp);
+    return taxa;
+}
+
 void KmerCollection::init()
 {
     if(mOptions->verbose)
         loginfo("Initializing k-mer collection: " + mFilename + "\n");
+    mLoadingTimer.restart();
+    if(isIndexFile(mFilename) && !mOptions->taxonomyFile.empty())
+        cerr << "WARNING: the taxonomy built in the index is used, --taxonomy is ignored for " << mFilename << endl;
+    if(isIndexFile(mFilename)) {
+        mapIndex();
+        mLoadingTimer.lap("map");
+    } else if(mOptions->sharedIndexDir.empty() || !attachSharedIndex()) {
+        loadFasta();
+    }
+    if(mTaxonomy) {
+        int missing = count(mGenomeTaxa.begin(), mGenomeTaxa.end(), -1);
+        if(missing > 0)
+            cerr << "WARNING: " << missing << " of " << mNumber << " genomes in " << mFilename << " are not found in the taxonomy, their reads cannot be classified" << endl;
+        initSetTaxa();
+    }
+    if(mOptions->verbose)
+        loginfo(mFilename + " loaded with " + to_string(mOptions->thread) + " thread(s): " + mLoadingTimer.summary());
+}
+
+void KmerCollection::loadFasta()
+{
     if (ends_with(mFilename, ".fasta.gz") || ends_with(mFilename, ".fa.gz")){
         mZipFile = gzopen(mFilename.c_str(), "r");
         mZipped = true;
@@ -161,123 +461,854 @@ void KmerCollection::init()
         error_exit("Not a FASTA file: " + mFilename);
     }
 
-    //unordered_map<uint64, KCHit> hashKmerMap;
-
-    const int maxLine = 1000;
-    char line[maxLine];
     if (mZipped){
         if (mZipFile == NULL)
-            return ;
+            error_exit("Failed to open: " + mFilename);
     }
 
-    vector<vector<uint64>> allKmer64;
-    int unique = 0;
-    int total = 0;
-    bool initialized = false;
-    while(true) {
-        if(eof())
-            break;
-        getLine(line, maxLine);
-        string linestr(line);
-        if(linestr.empty() || line[0]=='#') {
-            continue;
+    if(!mOptions->taxonomyFile.empty()) {
+        Taxonomy* taxonomy = new Taxonomy();
+        taxonomy->load(mOptions->taxonomyFile);
+        setTaxonomy(taxonomy);
+        mLoadingTimer.lap("taxonomy");
+    }
+
+    uint64 kmerNum = prescan();
+    initHashTable(kmerNum);
+
+    if(KmerKey<uint64>::fits(mKeyLen))
+        load<uint64>();
+    else
+        load<uint128>();
+}
+
+// the first pass gets the key length and counts the k-mers to size the hash table
+uint64 KmerCollection::prescan() {
+    int threads = mOptions->thread;
+    string chunk;
+    vector<uint64> bounds;
+    vector<uint64> counts(threads, 0);
+    uint64 kmerNum = 0;
+    while(readChunk(chunk)) {
+        const char* line;
+        uint64 len;
+        // every collection has its own key length, given by its first k-mer
+        uint64 pos = 0;
+        while(mKeyLen == 0 && nextLine(chunk.data(), pos, chunk.size(), line, len)) {
+            if(len > 0 && line[0] != '#' && line[0] != '>')
+                mKeyLen = len;
         }
-        if(line[0]=='>') {
-            if(total > 0) {
-                //cerr << unique << "/" << total << endl;
-                mKmerCounts.push_back(unique);
-                total=0;
-                unique=0;
+
+        splitLines(chunk, threads, bounds);
+        run_in_threads(threads, [&](int t) {
+            const char* line;
+            uint64 len;
+            uint64 pos = bounds[t];
+            counts[t] = 0;
+            while(nextLine(chunk.data(), pos, bounds[t+1], line, len)) {
+                if(len > 0 && len == mKeyLen && line[0] != '#' && line[0] != '>')
+                    counts[t]++;
             }
-            mNames.push_back(linestr.substr(1, linestr.length() - 1));
-            mHits.push_back(0);
-            allKmer64.push_back(vector<uint64>());
-            mMeanHits.push_back(0.0);
-            mCoverage.push_back(0.0);
-            mMedianHits.push_back(0);
-            mGenomeReads.push_back(0);
-            mNumber++;
-            //cerr<<mNumber<<": " << linestr << endl;
-            continue;
+        });
+        for(int t=0; t<threads; t++)
+            kmerNum += counts[t];
+    }
+    rewind();
+
+    if(mKeyLen == 0)
+        error_exit("No k-mer found in: " + mFilename);
+    if(!KmerKey<uint128>::fits(mKeyLen))
+        error_exit("k-mer key length cannot be >" + to_string(KmerKey<uint128>::MAX_LEN) + ": " + mFilename);
+
+    mLoadingTimer.lap("prescan");
+    return kmerNum;
+}
+
+void KmerCollection::initHashTable(uint64 kmerNum) {
+    // an open addressing table needs at least one empty slot
+    if(kmerNum >= MAX_HASH_LENGTH * mOptions->kcLoadFactor)
+        error_exit("Too many k-mers (" + to_string(kmerNum) + ") in: " + mFilename);
+    uint64 slots = (uint64)(kmerNum / mOptions->kcLoadFactor);
+    mHashLength = MIN_HASH_LENGTH;
+    mHashShift = 64 - 10;
+    while(mHashLength < slots) {
+        mHashLength <<= 1;
+        mHashShift--;
+    }
+
+    // the table starts at a cache line
+    void* table = NULL;
+    if(posix_memalign(&table, KC_INDEX_ALIGN, entryBytes()) != 0)
+        error_exit("Failed to allocate the hash table for: " + mFilename);
+    memset(table, 0, entryBytes());
+    if(KmerKey<uint64>::fits(mKeyLen))
+        mKCEntries = (KCEntry<uint64>*)table;
+    else
+        mWideKCEntries = (KCEntry<uint128>*)table;
+    initHitCounts(mHashLength);
+}
+
+// every chunk is split to the threads to parse, and the parsed k-mers are grouped by the region of
+// their home slots. A region is a range of consecutive slots, only inserted by one thread, and the
+// k-mers probing out of their regions are inserted at last.
+template<typename KeyType>
+void KmerCollection::load()
+{
+    int threads = mOptions->thread;
+    int regionBits = 0;
+    while((1<<regionBits) < threads && (MIN_HASH_LENGTH>>regionBits) > 1)
+        regionBits++;
+    int regions = 1<<regionBits;
+    int regionShift = 64 - mHashShift - regionBits;
+
+    // k-mers parsed by thread t with home slots in region r are in parsed[t][r]
+    vector<vector<vector<KCEntry<KeyType>>>> parsed(threads, vector<vector<KCEntry<KeyType>>>(regions));
+    vector<vector<KCEntry<KeyType>>> overflows(regions);
+    // the genomes of the k-mers found more than once
+    vector<vector<pair<KeyType, uint32>>> shared(regions);
+    vector<vector<string>> names(threads);
+    vector<vector<string>> skipped(threads);
+    vector<uint32> firstIds(threads);
+    vector<uint64> bounds;
+    string chunk;
+
+    while(readChunk(chunk)) {
+        splitLines(chunk, threads, bounds);
+        mLoadingTimer.lap("read");
+
+        // add the genomes first, so that every part knows the genome ID it starts with
+        run_in_threads(threads, [&](int t) {
+            collectNames(chunk, bounds[t], bounds[t+1], names[t]);
+        });
+        for(int t=0; t<threads; t++) {
+            firstIds[t] = mNumber;
+            for(int n=0; n<names[t].size(); n++)
+                addGenome(names[t][n]);
+            names[t].clear();
         }
+        run_in_threads(threads, [&](int t) {
+            parseKmers<KeyType>(chunk, bounds[t], bounds[t+1], firstIds[t], regionShift, parsed[t], skipped[t]);
+        });
+        for(int t=0; t<threads; t++) {
+            for(int i=0; i<skipped[t].size(); i++)
+                cerr << "k-mer length must be " << mKeyLen << ", skipped " << skipped[t][i] << endl;
+            skipped[t].clear();
+        }
+        mLoadingTimer.lap("parse");
 
-        string& seq = linestr;
-        if(!initialized) {
-            initialized = true;
-            if(mOptions->kmerKeyLen == 0)
-                mOptions->kmerKeyLen = seq.length();
+        run_in_threads(threads, [&](int t) {
+            for(int r=t; r<regions; r+=threads)
+                insertRegion<KeyType>(r, regionShift, parsed, overflows[r], shared[r]);
+        });
+        mLoadingTimer.lap("insert");
+    }
 
-            if(mOptions->kmerKeyLen > 32)
-                error_exit("k-mer key length cannot be >32: " + seq);
+    // no region is owned by a thread now, the probes can go anywhere,
+    // a k-mer is never dropped silently, the loading fails if it finds no empty slot
+    for(int r=0; r<regions; r++) {
+        for(uint64 i=0; i<overflows[r].size(); i++) {
+            if(!insert<KeyType>(overflows[r][i], mHashLength, shared[r]))
+                error_exit("The k-mer collection hash table is full, please use a smaller --kc_load_factor: " + mFilename);
         }
+    }
+    mLoadingTimer.lap("merge");
+
+    initSets<KeyType>(shared);
+    mLoadingTimer.lap("sets");
 
-        if(seq.length() != mOptions->kmerKeyLen) {
-            cerr << "k-mer length must be " << mOptions->kmerKeyLen << ", skipped " << seq << endl;
+    countKmers<KeyType>();
+    mLoadingTimer.lap("count");
+
+    //makeBitAndMask();
+}
+
+template<typename KeyType>
+void KmerCollection::parseKmers(const string& chunk, uint64 start, uint64 end, uint32 id, int regionShift, vector<vector<KCEntry<KeyType>>>& parsed, vector<string>& skipped) {
+    KCEntry<KeyType> entry;
+    memset(&entry, 0, sizeof(KCEntry<KeyType>));
+    const char* line;
+    uint64 len;
+    while(nextLine(chunk.data(), start, end, line, len)) {
+        if(len == 0 || line[0]=='#')
+            continue;
+        if(line[0]=='>') {
+            id++;
+            continue;
+        }
+        if(len != mKeyLen) {
+            skipped.push_back(string(line, len));
             continue;
         }
 
         bool valid = true;
-        uint64 kmer64 = Kmer::seq2uint64(seq, 0, seq.length(), valid);
-        if(valid) {
-            total++;
-            uint64 kmerhash = makeHash(kmer64);
-            //unordered_map<uint64, KCHit>::iterator iter = hashKmerMap.find(kmerhash);
-            if(mHashKCH[kmerhash] == 0) {
-                unique++;
-                mHashKCH[kmerhash] = mNumber;
-                allKmer64[mNumber-1].push_back(kmer64);
-            } else if(mHashKCH[kmerhash] != COLLISION_FLAG) { // we use the mHits as a flag
-                if(mHashKCH[kmerhash] == mNumber)
-                    unique--;
-                else {
-                    int collID = mHashKCH[kmerhash]-1;
-                    mKmerCounts[collID]--;
-                }
-                mHashKCH[kmerhash] = COLLISION_FLAG;
+        KeyType key = KmerKey<KeyType>::encode(line, 0, len, valid);
+        if(valid && id > 0) {
+            entry.mKey = key;
+            entry.mID = id;
+            parsed[makeHash(KmerKey<KeyType>::fold(key)) >> regionShift].push_back(entry);
+        }
+    }
+}
+
+template<typename KeyType>
+void KmerCollection::insertRegion(int region, int regionShift, vector<vector<vector<KCEntry<KeyType>>>>& parsed, vector<KCEntry<KeyType>>& overflow, vector<pair<KeyType, uint32>>& shared) {
+    // where the probes leave this region, the last region ends by wrapping to slot 0
+    uint64 regionEnd = ((uint64)(region + 1) << regionShift) & (mHashLength - 1);
+    for(int t=0; t<parsed.size(); t++) {
+        vector<KCEntry<KeyType>>& entries = parsed[t][region];
+        for(uint64 i=0; i<entries.size(); i++) {
+            if(!insert<KeyType>(entries[i], regionEnd, shared))
+                overflow.push_back(entries[i]);
+        }
+        entries.clear();
+    }
+}
+
+// Robin Hood insertion, a k-mer found in another genome is marked with the placeholder KC_SET_BIT,
+// and its genomes are added to shared, to be replaced by the set of them after loading.
+// If the probe reaches stopAt, or has passed all the slots, false is returned with the entry changed to the one
+// still to be inserted, it can be the k-mer itself or a k-mer it displaced.
+template<typename KeyType>
+bool KmerCollection::insert(KCEntry<KeyType>& entry, uint64 stopAt, vector<pair<KeyType, uint32>>& shared) {
+    KCEntry<KeyType>* table = kcEntries<KeyType>();
+    uint64 mask = mHashLength - 1;
+    uint64 slot = makeHash(KmerKey<KeyType>::fold(entry.mKey));
+
+    entry.mDist = 0;
+    // the key can only be found before it displaces any slot
+    bool displaced = false;
+    while(true) {
+        KCEntry<KeyType>& kce = table[slot];
+        if(kce.mID == KC_EMPTY_ID) {
+            kce = entry;
+            return true;
+        }
+        if(!displaced && kce.mKey == entry.mKey) {
+            if(kce.mID != entry.mID) {
+                if((kce.mID & KC_SET_BIT) == 0)
+                    shared.push_back(make_pair(kce.mKey, kce.mID));
+                shared.push_back(make_pair(entry.mKey, entry.mID));
+                kce.mID = KC_SET_BIT;
             }
+            return true;
         }
+        // take the slot from a richer one, and carry it on
+        if(kce.mDist < entry.mDist) {
+            swap(kce, entry);
+            displaced = true;
+        }
+        entry.mDist++;
+        slot = (slot + 1) & mask;
+        if(slot == stopAt || entry.mDist >= mHashLength)
+            return false;
     }
-    mKmerCounts.push_back(unique);
+}
 
-    mUniqueHashNum = 0;
-    for(int i=0; i<mNumber; i++)
-        mUniqueHashNum += mKmerCounts[i];
+// the k-mers are grouped by sorting, so the sets are numbered in the order of their first k-mers whatever the threads are
+template<typename KeyType>
+void KmerCollection::initSets(vector<vector<pair<KeyType, uint32>>>& shared) {
+    vector<pair<KeyType, uint32>> genomesOfKeys;
+    for(int r=0; r<shared.size(); r++) {
+        genomesOfKeys.insert(genomesOfKeys.end(), shared[r].begin(), shared[r].end());
+        vector<pair<KeyType, uint32>>().swap(shared[r]);
+    }
+    sort(genomesOfKeys.begin(), genomesOfKeys.end());
 
-    mKCHits = new KCHit[mUniqueHashNum];
-    memset(mKCHits, 0, sizeof(KCHit)*mUniqueHashNum);
+    KCEntry<KeyType>* table = kcEntries<KeyType>();
+    uint64 mask = mHashLength - 1;
+    unordered_map<vector<uint32>, uint32, GenomeSetHash> setIds;
+    setIds.reserve(genomesOfKeys.size() / 2);
+    vector<uint32> genomes;
+    mSetStarts.assign(1, 0);
+    mSetGenomes.clear();
+    for(uint64 i=0; i<genomesOfKeys.size(); ) {
+        KeyType key = genomesOfKeys[i].first;
+        genomes.clear();
+        for(; i<genomesOfKeys.size() && genomesOfKeys[i].first == key; i++) {
+            if(genomes.empty() || genomes.back() != genomesOfKeys[i].second)
+                genomes.push_back(genomesOfKeys[i].second);
+        }
+        unordered_map<vector<uint32>, uint32, GenomeSetHash>::iterator found = setIds.find(genomes);
+        if(found == setIds.end()) {
+            if(mSetStarts.size() >= KC_SET_BIT)
+                error_exit("Too many sets of genomes sharing k-mers in: " + mFilename);
+            found = setIds.insert(make_pair(genomes, KC_SET_BIT | (uint32)(mSetStarts.size() - 1))).first;
+            mSetGenomes.insert(mSetGenomes.end(), genomes.begin(), genomes.end());
+            mSetStarts.push_back(mSetGenomes.size());
+        }
+        // the key is in the table
+        uint64 slot = makeHash(KmerKey<KeyType>::fold(key));
+        while(table[slot].mKey != key || table[slot].mID == KC_EMPTY_ID)
+            slot = (slot + 1) & mask;
+        table[slot].mID = found->second;
+    }
+}
 
-    uint32 cur = 0;
-    for(int i=0; i<mNumber; i++) {
-        for(int j=0; j<allKmer64[i].size(); j++) {
-            uint64 kmer64 = allKmer64[i][j];
-            uint64 kmerhash = makeHash(kmer64);
-            uint32 index = mHashKCH[kmerhash];
-            // means unique
-            if(index == i+1) {
-                if(cur >= mUniqueHashNum)
-                    error_exit("Uninque number incorrectly calculated in k-mer collection initialization.");
-                mHashKCH[kmerhash] = cur + 1; // 0 means no hit
-                mKCHits[cur].mID = i;
-                mKCHits[cur].mHit = 0;
-                mKCHits[cur].mKey64 = kmer64;
-                cur++;
+template<typename KeyType>
+void KmerCollection::countKmers() {
+    KCEntry<KeyType>* table = kcEntries<KeyType>();
+    int threads = mOptions->thread;
+    vector<vector<int>> counts(threads, vector<int>(mNumber, 0));
+    vector<uint64> entries(threads, 0);
+    vector<uint32> shared(threads, 0);
+    vector<uint32> maxDists(threads, 0);
+    run_in_threads(threads, [&](int t) {
+        uint64 end = mHashLength * (t + 1) / threads;
+        for(uint64 i = mHashLength * t / threads; i < end; i++) {
+            if(table[i].mID == KC_EMPTY_ID)
+                continue;
+            entries[t]++;
+            maxDists[t] = max(maxDists[t], table[i].mDist);
+            if(table[i].mID & KC_SET_BIT) {
+                shared[t]++;
+            } else {
+                counts[t][table[i].mID - 1]++;
             }
         }
+    });
+
+    mKmerCounts = vector<int>(mNumber, 0);
+    mEntryNum = 0;
+    mUniqueHashNum = 0;
+    uint32 sharedNum = 0;
+    uint32 maxDist = 0;
+    for(int t=0; t<threads; t++) {
+        for(int id=0; id<mNumber; id++)
+            mKmerCounts[id] += counts[t][id];
+        mEntryNum += entries[t];
+        sharedNum += shared[t];
+        maxDist = max(maxDist, maxDists[t]);
     }
+    mUniqueHashNum = mEntryNum - sharedNum;
 
-    //makeBitAndMask();
+    if(mOptions->verbose) {
+        loginfo(mFilename + ": " + to_string(mUniqueHashNum) + " unique k-mers, " + to_string(sharedNum) + " shared k-mers in "
+            + to_string(mSetStarts.size() - 1) + " genome sets, "
+            + to_string(mHashLength) + " hash slots, max probe distance " + to_string(maxDist));
+    }
 }
 
-bool KmerCollection::eof() {
-    if (mZipped) {
-        return gzeof(mZipFile);
+void KmerCollection::addGenome(string name) {
+    if(mNumber + 1 >= KC_SET_BIT)
+        error_exit("Too many genomes in: " + mFilename);
+    mNames.push_back(name);
+    mGenomeTaxa.push_back(mTaxonomy ? mTaxonomy->findGenome(name) : -1);
+    mHits.push_back(0);
+    mMeanHits.push_back(0.0);
+    mCoverage.push_back(0.0);
+    mMedianHits.push_back(0);
+    mGenomeReads.push_back(0);
+    mNumber++;
+}
+
+bool KmerCollection::isIndexFile(string filename) {
+    return ends_with(filename, KC_INDEX_EXT) || ends_with(filename, KC_SUCCINCT_EXT);
+}
+
+void KmerCollection::initHitCounts(uint64 num) {
+    freeHitCounts();
+    mHitCountBytes = sizeof(uint32) * num;
+    void* counts = mmap(NULL, mHitCountBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(counts == MAP_FAILED)
+        error_exit("Failed to allocate the hit counters for: " + mFilename);
+    mHitCounts = (uint32*)counts;
+}
+
+void KmerCollection::freeHitCounts() {
+    if(mHitCounts) {
+        munmap(mHitCounts, mHitCountBytes);
+        mHitCounts = NULL;
+        mHitCountBytes = 0;
+    }
+}
+
+void KmerCollection::addBatch(const uint64* keys, int n, uint32* ids) {
+    if(mSuccinct == NULL) {
+        for(int i=0; i<n; i++)
+            ids[i] = add<uint64>(keys[i]);
+        return;
+    }
+    uint64 positions[SI_BATCH_SIZE];
+    for(int start=0; start<n; start+=SI_BATCH_SIZE) {
+        int count = min(n - start, SI_BATCH_SIZE);
+        mSuccinct->findBatch(keys + start, count, ids + start, positions);
+        for(int i=0; i<count; i++) {
+            if(ids[start + i] != 0)
+                mHitCounts[positions[i]]++;
+        }
+    }
+}
+
+uint64 KmerCollection::entryBytes() {
+    if(KmerKey<uint64>::fits(mKeyLen))
+        return sizeof(KCEntry<uint64>) * mHashLength;
+    else
+        return sizeof(KCEntry<uint128>) * mHashLength;
+}
+
+string KmerCollection::indexNames() {
+    string names;
+    for(int i=0; i<mNumber; i++) {
+        names += mNames[i];
+        names.push_back('\0');
+    }
+    return names;
+}
+
+// the name and the rank of every taxon, each terminated by \0
+string KmerCollection::indexTaxonomyNames() {
+    string names;
+    for(int t=0; mTaxonomy && t<mTaxonomy->size(); t++) {
+        names += mTaxonomy->getName(t);
+        names.push_back('\0');
+        names += mTaxonomy->getRank(t);
+        names.push_back('\0');
+    }
+    return names;
+}
+
+uint64 KmerCollection::indexBytes(const string* succinct) {
+    int taxonNum = mTaxonomy ? mTaxonomy->size() : 0;
+    uint64 tableBytes = succinct ? succinct->size() : entryBytes();
+    return index_section_bytes(sizeof(KCIndexHeader)) + index_section_bytes(tableBytes)
+        + index_section_bytes(sizeof(int) * mNumber) + index_section_bytes(indexNames().size())
+        + index_section_bytes(sizeof(int) * taxonNum) + index_section_bytes(indexTaxonomyNames().size())
+        + index_section_bytes(sizeof(uint64) * mSetStarts.size()) + index_section_bytes(sizeof(uint32) * mSetGenomes.size());
+}
+
+void KmerCollection::serializeIndex(char* data, const string* succinct) {
+    string names = indexNames();
+    string taxonomyNames = indexTaxonomyNames();
+    vector<int> parents;
+    for(int t=0; mTaxonomy && t<mTaxonomy->size(); t++)
+        parents.push_back(mTaxonomy->getParent(t));
+
+    KCIndexHeader header;
+    memset(&header, 0, sizeof(KCIndexHeader));
+    memcpy(header.mMagic, succinct ? KC_SUCCINCT_MAGIC : KC_INDEX_MAGIC, sizeof(header.mMagic));
+    header.mVersion = KC_INDEX_VERSION;
+    header.mKeyLen = mKeyLen;
+    header.mHashLength = succinct ? succinct->size() : mHashLength;
+    header.mHashShift = succinct ? 0 : mHashShift;
+    header.mGenomeNum = mNumber;
+    header.mEntryNum = succinct ? ((const SuccinctHeader*)succinct->data())->mKmerNum : mEntryNum;
+    header.mNamesBytes = names.size();
+    header.mTaxonNum = parents.size();
+    header.mTaxonomyBytes = taxonomyNames.size();
+    header.mSetNum = mSetStarts.size() - 1;
+    header.mSetGenomeNum = mSetGenomes.size();
+
+    char* sections = data + index_section_bytes(sizeof(KCIndexHeader));
+    char* p = sections;
+    if(succinct)
+        p = copy_index_section(p, succinct->data(), succinct->size());
+    else if(KmerKey<uint64>::fits(mKeyLen))
+        p = copy_index_section(p, (const char*)mKCEntries, entryBytes());
+    else
+        p = copy_index_section(p, (const char*)mWideKCEntries, entryBytes());
+    char* meta = p;
+    p = copy_index_section(p, (const char*)mKmerCounts.data(), sizeof(int) * mNumber);
+    p = copy_index_section(p, names.c_str(), names.size());
+    p = copy_index_section(p, (const char*)parents.data(), sizeof(int) * parents.size());
+    p = copy_index_section(p, taxonomyNames.c_str(), taxonomyNames.size());
+    p = copy_index_section(p, (const char*)mSetStarts.data(), sizeof(uint64) * mSetStarts.size());
+    p = copy_index_section(p, (const char*)mSetGenomes.data(), sizeof(uint32) * mSetGenomes.size());
+
+    header.mMetaChecksum = index_checksum(meta, p - meta);
+    header.mDataChecksum = index_checksum(sections, p - sections);
+    header.mHeaderChecksum = index_checksum((const char*)&header, offsetof(KCIndexHeader, mHeaderChecksum));
+    copy_index_section(data, (const char*)&header, sizeof(KCIndexHeader));
+}
+
+// the file is sized by ftruncate() and written through mmap(), which also works for hugetlbfs files
+bool KmerCollection::writeIndexFile(int fd, const string* succinct) {
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+        return false;
+    uint64 bytes = indexBytes(succinct);
+    // hugetlbfs files must be sized to a multiple of the huge page size
+    uint64 blockSize = st.st_blksize > 0 ? st.st_blksize : 4096;
+    uint64 fileBytes = (bytes + blockSize - 1) / blockSize * blockSize;
+    if(ftruncate(fd, fileBytes) != 0)
+        return false;
+    void* data = mmap(NULL, fileBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(data == MAP_FAILED)
+        return false;
+    serializeIndex((char*)data, succinct);
+    bool ok = msync(data, fileBytes, MS_SYNC) == 0;
+    munmap(data, fileBytes);
+    return ok;
+}
+
+// all the k-mers of the hash table, the shared ones keep their genome sets
+string KmerCollection::buildSuccinctIndex() {
+    if(!KmerKey<uint64>::fits(mKeyLen))
+        error_exit("The succinct k-mer collection index (" + string(KC_SUCCINCT_EXT) + ") supports k <= 32 only, please use " + string(KC_INDEX_EXT) + " for: " + mFilename);
+    vector<uint64> keys;
+    vector<uint32> ids;
+    for(uint64 i=0; i<mHashLength; i++) {
+        uint32 id = mKCEntries[i].mID;
+        if(id == KC_EMPTY_ID)
+            continue;
+        keys.push_back(mKCEntries[i].mKey);
+        ids.push_back(id);
+    }
+    mLoadingTimer.restart();
+    string data = SuccinctIndex::build(keys, ids, mKeyLen, mNumber, mOptions->thread);
+    mLoadingTimer.lap("succinct");
+    if(mOptions->verbose)
+        loginfo(mFilename + ": succinct index of " + to_string(keys.size()) + " k-mers, " + to_string(data.size()) + " bytes ("
+            + to_string(keys.size() > 0 ? data.size() * 8.0 / keys.size() : 0.0) + " bits per k-mer), the hash table takes " + to_string(entryBytes()) + " bytes");
+    return data;
+}
+
+void KmerCollection::writeIndex(string filename) {
+    string succinct;
+    if(ends_with(filename, KC_SUCCINCT_EXT))
+        succinct = buildSuccinctIndex();
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        error_exit("Failed to write the k-mer collection index: " + filename);
+    bool ok = writeIndexFile(fd, succinct.empty() ? NULL : &succinct);
+    close(fd);
+    if(!ok)
+        error_exit("Failed to write the k-mer collection index: " + filename);
+}
+
+void KmerCollection::benchmark(string succinctFile) {
+    KmerCollection succinct(succinctFile, mOptions);
+    if(!succinct.isSuccinct() || mKCEntries == NULL)
+        error_exit("The benchmark needs a k-mer collection FASTA with k <= 32, and a succinct index: " + succinctFile);
+
+    // the k-mers in the collection in the table order, and as many random ones
+    const uint64 queryNum = 1000000;
+    vector<uint64> queries;
+    uint64 stride = max(1UL, mEntryNum / queryNum);
+    for(uint64 i=0, entries=0; i<mHashLength && queries.size() < queryNum; i++) {
+        if(mKCEntries[i].mID != KC_EMPTY_ID && (entries++) % stride == 0)
+            queries.push_back(mKCEntries[i].mKey);
+    }
+    uint64 present = queries.size();
+    uint64 x = 88172645463325252UL;
+    for(uint64 i=0; i<present; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        queries.push_back(KmerKey<uint64>::trim(x, mKeyLen));
+    }
+
+    vector<uint32> expected(queries.size());
+    vector<uint32> found(queries.size());
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(uint64 i=0; i<queries.size(); i++)
+        expected[i] = add<uint64>(queries[i]);
+    double hashTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    for(uint64 i=0; i<queries.size(); i++)
+        found[i] = succinct.add<uint64>(queries[i]);
+    double succinctTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if(found != expected)
+        error_exit("The succinct index returns different IDs from the hash table: " + succinctFile);
+    start = chrono::steady_clock::now();
+    succinct.addBatch(queries.data(), queries.size(), found.data());
+    double batchTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if(found != expected)
+        error_exit("The succinct index returns different IDs from the hash table: " + succinctFile);
+
+    uint64 kmers = succinct.mSuccinct->size();
+    uint64 hashBytes = entryBytes() + sizeof(uint32) * mHashLength;
+    uint64 succinctBytes = succinct.mSuccinct->getBytes() + sizeof(uint32) * kmers;
+    double nsPerQuery = 1e9 / queries.size();
+    cerr << "k-mers: " << kmers << ", queries: " << queries.size() << " (" << present << " found)" << endl;
+    cerr << "hash table: " << hashBytes << " bytes with the hit counters, " << hashBytes * 8.0 / kmers << " bits per k-mer, "
+        << hashTime * nsPerQuery << " ns per lookup" << endl;
+    cerr << "succinct index: " << succinctBytes << " bytes with the hit counters, " << succinctBytes * 8.0 / kmers << " bits per k-mer, "
+        << succinctTime * nsPerQuery << " ns per lookup, " << batchTime * nsPerQuery << " ns per batched lookup" << endl;
+    cerr << "the succinct index is " << (double)hashBytes / succinctBytes << "x smaller, "
+        << succinct.mSuccinct->getBytes() * 8.0 / kmers << " bits per k-mer without the hit counters, which only take memory when hit" << endl;
+}
+
+void KmerCollection::mapIndex() {
+    int fd = open(mFilename.c_str(), O_RDONLY);
+    if(fd < 0)
+        error_exit("Failed to open the k-mer collection index: " + mFilename);
+    string error;
+    bool ok = mapIndexFile(fd, mFilename, error);
+    close(fd);
+    if(!ok)
+        error_exit(error);
+}
+
+// the index is mapped read-only, so that concurrent jobs share it in the page cache,
+// only the hit counters are allocated per process
+bool KmerCollection::mapIndexFile(int fd, string path, string& error) {
+    error = "Not a valid fastv k-mer collection index, please rebuild it with `fastv index`: " + path;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < index_section_bytes(sizeof(KCIndexHeader)))
+        return false;
+    void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(mapped == MAP_FAILED) {
+        error = "Failed to map the k-mer collection index: " + path;
+        return false;
+    }
+    const char* data = (const char*)mapped;
+
+    const KCIndexHeader* header = (const KCIndexHeader*)data;
+    bool succinct = memcmp(header->mMagic, KC_SUCCINCT_MAGIC, sizeof(header->mMagic)) == 0;
+    bool valid = succinct || memcmp(header->mMagic, KC_INDEX_MAGIC, sizeof(header->mMagic)) == 0;
+    if(valid && header->mVersion != KC_INDEX_VERSION) {
+        error = "The index version " + to_string(header->mVersion) + " is not supported by this fastv (version " + to_string(KC_INDEX_VERSION) + "), please rebuild it with `fastv index`: " + path;
+        valid = false;
+    }
+    valid = valid && header->mHeaderChecksum == index_checksum((const char*)header, offsetof(KCIndexHeader, mHeaderChecksum));
+    valid = valid && header->mKeyLen > 0 && KmerKey<uint128>::fits(header->mKeyLen);
+    if(succinct) {
+        valid = valid && KmerKey<uint64>::fits(header->mKeyLen) && header->mHashLength % sizeof(uint64) == 0;
     } else {
-        return mFile.eof();
+        valid = valid && header->mHashLength >= MIN_HASH_LENGTH && (header->mHashLength & (header->mHashLength - 1)) == 0;
+        valid = valid && header->mEntryNum < header->mHashLength;
     }
+    valid = valid && header->mNamesBytes > 0;
+    valid = valid && (header->mTaxonNum == 0) == (header->mTaxonomyBytes == 0);
+
+    uint64 tableOffset = index_section_bytes(sizeof(KCIndexHeader));
+    uint64 countOffset = 0;
+    uint64 nameOffset = 0;
+    uint64 parentOffset = 0;
+    uint64 taxonNameOffset = 0;
+    uint64 setStartOffset = 0;
+    uint64 setGenomeOffset = 0;
+    uint64 end = 0;
+    if(valid) {
+        mKeyLen = header->mKeyLen;
+        mHashLength = header->mHashLength;
+        uint64 tableBytes = succinct ? header->mHashLength : entryBytes();
+        countOffset = tableOffset + index_section_bytes(tableBytes);
+        nameOffset = countOffset + index_section_bytes(sizeof(int) * header->mGenomeNum);
+        parentOffset = nameOffset + index_section_bytes(header->mNamesBytes);
+        taxonNameOffset = parentOffset + index_section_bytes(sizeof(int) * header->mTaxonNum);
+        setStartOffset = taxonNameOffset + index_section_bytes(header->mTaxonomyBytes);
+        setGenomeOffset = setStartOffset + index_section_bytes(sizeof(uint64) * (header->mSetNum + 1));
+        end = setGenomeOffset + index_section_bytes(sizeof(uint32) * header->mSetGenomeNum);
+        // the file can be larger than the index if it's rounded to huge pages
+        valid = end <= st.st_size && data[nameOffset + header->mNamesBytes - 1] == '\0';
+        valid = valid && (header->mTaxonNum == 0 || data[taxonNameOffset + header->mTaxonomyBytes - 1] == '\0');
+    }
+    // the table is only read by the lookups, page by page, unless it's verified
+    if(valid && (header->mMetaChecksum != index_checksum(data + countOffset, end - countOffset)
+        || (mOptions->verifyIndex && header->mDataChecksum != index_checksum(data + tableOffset, end - tableOffset)))) {
+        error = "Checksum mismatch, the k-mer collection index is corrupted: " + path;
+        valid = false;
+    }
+    if(!valid) {
+        munmap(mapped, st.st_size);
+        mKeyLen = 0;
+        mHashLength = 0;
+        return false;
+    }
+
+    mMappedData = (char*)mapped;
+    mMappedSize = st.st_size;
+    mHashShift = header->mHashShift;
+    mEntryNum = header->mEntryNum;
+    if(succinct) {
+        mSuccinct = new SuccinctIndex();
+        if(!mSuccinct->attach(data + tableOffset, header->mHashLength) || mSuccinct->size() != mEntryNum)
+            error_exit(error);
+        // the hit counters are indexed by the rank of the k-mer
+        mHashLength = mSuccinct->size();
+    } else if(KmerKey<uint64>::fits(mKeyLen))
+        mKCEntries = (KCEntry<uint64>*)(mMappedData + tableOffset);
+    else
+        mWideKCEntries = (KCEntry<uint128>*)(mMappedData + tableOffset);
+
+    // the taxonomy is needed to match the genomes
+    if(header->mTaxonNum > 0) {
+        Taxonomy* taxonomy = new Taxonomy();
+        const int* parents = (const int*)(data + parentOffset);
+        const char* taxonName = data + taxonNameOffset;
+        const char* taxonNameEnd = taxonName + header->mTaxonomyBytes;
+        for(uint32 t=0; t<header->mTaxonNum; t++) {
+            if(taxonName >= taxonNameEnd || taxonomy->addTaxon(string(taxonName)) != t)
+                error_exit(error);
+            taxonName += strlen(taxonName) + 1;
+            if(taxonName >= taxonNameEnd)
+                error_exit(error);
+            taxonomy->setRank(t, string(taxonName));
+            taxonName += strlen(taxonName) + 1;
+        }
+        for(uint32 t=0; t<header->mTaxonNum; t++) {
+            if(parents[t] >= (int)header->mTaxonNum)
+                error_exit(error);
+            if(parents[t] >= 0)
+                taxonomy->setParent(t, parents[t]);
+        }
+        taxonomy->initDepths();
+        setTaxonomy(taxonomy);
+    }
+
+    const int* counts = (const int*)(data + countOffset);
+    const char* name = data + nameOffset;
+    mUniqueHashNum = 0;
+    for(uint32 i=0; i<header->mGenomeNum; i++) {
+        if(name >= data + nameOffset + header->mNamesBytes)
+            error_exit(error);
+        addGenome(string(name));
+        mKmerCounts.push_back(counts[i]);
+        mUniqueHashNum += counts[i];
+        name += strlen(name) + 1;
+    }
+
+    const uint64* setStarts = (const uint64*)(data + setStartOffset);
+    const uint32* setGenomes = (const uint32*)(data + setGenomeOffset);
+    mSetStarts.assign(setStarts, setStarts + header->mSetNum + 1);
+    mSetGenomes.assign(setGenomes, setGenomes + header->mSetGenomeNum);
+    if(mSetStarts[0] != 0 || mSetStarts[header->mSetNum] != header->mSetGenomeNum)
+        error_exit(error);
+    for(uint32 s=0; s<header->mSetNum; s++) {
+        if(mSetStarts[s] >= mSetStarts[s + 1])
+            error_exit(error);
+    }
+    for(uint64 i=0; i<mSetGenomes.size(); i++) {
+        if(mSetGenomes[i] == 0 || mSetGenomes[i] > mNumber)
+            error_exit(error);
+    }
+
+    initHitCounts(mHashLength);
+
+    if(mOptions->verbose)
+        loginfo("Mapped k-mer collection " + string(succinct ? "succinct index: " : "index: ") + path + ", " + to_string(mNumber) + " genomes, " + to_string(mUniqueHashNum) + " k-mers");
+    return true;
+}
+
+// the name of the shared index changes if the collection file or the table options change
+string KmerCollection::sharedIndexPath() {
+    char* resolved = realpath(mFilename.c_str(), NULL);
+    string fullpath = resolved ? string(resolved) : mFilename;
+    free(resolved);
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    ::stat(mFilename.c_str(), &st);
+    stringstream ss;
+    ss << fullpath << ":" << st.st_size << ":" << st.st_mtime << ":" << mOptions->kcLoadFactor << ":" << KC_INDEX_VERSION;
+    if(!mOptions->taxonomyFile.empty()) {
+        resolved = realpath(mOptions->taxonomyFile.c_str(), NULL);
+        memset(&st, 0, sizeof(struct stat));
+        ::stat(mOptions->taxonomyFile.c_str(), &st);
+        ss << ":" << (resolved ? string(resolved) : mOptions->taxonomyFile) << ":" << st.st_size << ":" << st.st_mtime;
+        free(resolved);
+    }
+    stringstream name;
+    name << "fastv_kc_" << hex << hash<string>()(ss.str()) << KC_INDEX_EXT;
+    return joinpath(mOptions->sharedIndexDir, name.str());
+}
+
+// the first process builds the index in the shared directory while holding an exclusive lock,
+// the others wait for the lock and map it read-only
+bool KmerCollection::attachSharedIndex() {
+    string path = sharedIndexPath();
+    string error;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd >= 0) {
+        flock(fd, LOCK_EX);
+        loadFasta();
+        bool ok = writeIndexFile(fd);
+        flock(fd, LOCK_UN);
+        mLoadingTimer.lap("write");
+        if(!ok) {
+            close(fd);
+            unlink(path.c_str());
+            cerr << "WARNING: failed to write the shared k-mer collection index " << path << ", use a private copy" << endl;
+            return false;
+        }
+        // switch to the shared copy to release the private one
+        clearTables();
+        ok = mapIndexFile(fd, path, error);
+        close(fd);
+        if(!ok)
+            error_exit(error);
+        mLoadingTimer.lap("map");
+        if(mOptions->verbose)
+            loginfo("Built shared k-mer collection index: " + path);
+        return true;
+    }
+
+    fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        cerr << "WARNING: cannot open the shared k-mer collection index " << path << ", use a private copy" << endl;
+        return false;
+    }
+    // wait for the process building it, it may not have taken the lock yet if the file is still empty
+    struct stat st;
+    for(int retry=0; retry<50; retry++) {
+        flock(fd, LOCK_SH);
+        if(fstat(fd, &st) == 0 && st.st_size > 0)
+            break;
+        flock(fd, LOCK_UN);
+        usleep(100000);
+    }
+    bool ok = mapIndexFile(fd, path, error);
+    flock(fd, LOCK_UN);
+    close(fd);
+    mLoadingTimer.lap("map");
+    if(!ok) {
+        cerr << "WARNING: " << error << endl;
+        cerr << "WARNING: please remove " << path << ", use a private copy now" << endl;
+        return false;
+    }
+    return true;
+}
+
+void KmerCollection::setTaxonomy(Taxonomy* taxonomy) {
+    if(mTaxonomy)
+        delete mTaxonomy;
+    mTaxonomy = taxonomy;
+    mTaxonReads.clear();
+    mSetTaxa.clear();
+    if(mTaxonomy)
+        mTaxonReads.resize(mTaxonomy->size(), 0);
 }
 
-uint64 KmerCollection::makeHash(uint64 key) {
-    return (1713137323 * key + (key>>12)*7341234131 + (key>>24)*371371377) & (HASH_LENGTH-1);
+void KmerCollection::clearTables() {
+    if(mKCEntries) {
+        free(mKCEntries);
+        mKCEntries = NULL;
+    }
+    if(mWideKCEntries) {
+        free(mWideKCEntries);
+        mWideKCEntries = NULL;
+    }
+    freeHitCounts();
+    if(mSuccinct) {
+        delete mSuccinct;
+        mSuccinct = NULL;
+    }
+    mNames.clear();
+    mHits.clear();
+    mMeanHits.clear();
+    mCoverage.clear();
+    mMedianHits.clear();
+    mGenomeReads.clear();
+    mKmerCounts.clear();
+    mGenomeTaxa.clear();
+    mSetStarts.clear();
+    mSetGenomes.clear();
+    mSetTaxa.clear();
+    setTaxonomy(NULL);
+    mNumber = 0;
+    mEntryNum = 0;
+    mUniqueHashNum = 0;
+}
+
+void KmerCollection::rewind() {
+    if (mZipped) {
+        gzrewind(mZipFile);
+    } else {
+        mFile.clear();
+        mFile.seekg(0, ios::beg);
+    }
 }
 
 void KmerCollection::report() {
@@ -296,10 +1327,29 @@ void KmerCollection::report() {
         cerr << ",median_depth:" << kcr.mMedianHit;
         cerr << ",mean_depth:" << kcr.mMeanHit;
         cerr << ",unique_reads:" << kcr.mUniqueReads;
+        cerr << ",estimated_reads:" << kcr.mEstimatedReads;
+        cerr << ",abundance:" << kcr.mAbundance;
         cerr <<  endl;
     }
     if(highConfidenceNum == 0)
         cerr << "No high confidence k-mer coverage found." << endl;
+    if(mTaxonomy)
+        reportTaxonomy();
+    if(isPositive())
+        cerr << "Result: POSITIVE" << endl;
+    else
+        cerr << "Result: NEGATIVE" << endl;
+}
+
+// positive if any genome of this collection is covered with high confidence
+bool KmerCollection::isPositive() {
+    if(!mStatDone)
+        stat();
+    for(int i=0; i<mResults.size(); i++) {
+        if(isHighConfidence(mResults[i]))
+            return true;
+    }
+    return false;
 }
 
 void KmerCollection::reportJSON(ofstream& ofs) {
@@ -307,6 +1357,18 @@ void KmerCollection::reportJSON(ofstream& ofs) {
         stat();
 
     ofs << "\t" << "\"kmer_collection_scan_result\": {" << endl;
+    reportGenomesJSON(ofs);
+    ofs << endl << "\t}," << endl;
+
+    if(mTaxonomy) {
+        reportTaxonomyJSON(ofs, "\t");
+        ofs << "," << endl;
+    }
+}
+
+void KmerCollection::reportGenomesJSON(ofstream& ofs) {
+    if(!mStatDone)
+        stat();
 
     int first = true;
     for(int i=0; i<mResults.size(); i++) {
@@ -323,10 +1385,74 @@ void KmerCollection::reportJSON(ofstream& ofs) {
         ofs << ",\"median_depth\":" << kcr.mMedianHit;
         ofs << ",\"mean_depth\":" << kcr.mMeanHit;
         ofs << ",\"unique_reads\":" << kcr.mUniqueReads;
+        ofs << ",\"estimated_reads\":" << kcr.mEstimatedReads;
+        ofs << ",\"abundance\":" << kcr.mAbundance;
         ofs << "}";
     }
+}
 
-    ofs << endl << "\t}," << endl;
+// the ranks reported for the taxonomic classification
+static const int TAXONOMY_RANK_NUM = 2;
+static const char* TAXONOMY_RANKS[TAXONOMY_RANK_NUM] = {"genus", "family"};
+
+void KmerCollection::reportTaxonomy() {
+    long classified = 0;
+    for(int t=0; t<mTaxonomy->size(); t++)
+        classified += mTaxonReads[t];
+    cerr << "Taxonomic classification: " << classified << " reads classified" << endl;
+    for(int r=0; r<TAXONOMY_RANK_NUM; r++) {
+        vector<pair<int, long>> taxa = taxaOfRank(TAXONOMY_RANKS[r]);
+        // the top 10 of every rank
+        for(int i=0; i<taxa.size() && i<10; i++)
+            cerr << TAXONOMY_RANKS[r] << ": " << mTaxonomy->getName(taxa[i].first) << ", reads:" << taxa[i].second << endl;
+    }
+}
+
+void KmerCollection::reportTaxonomyJSON(ofstream& ofs, string indent) {
+    if(!mStatDone)
+        stat();
+
+    long classified = 0;
+    for(int t=0; t<mTaxonomy->size(); t++)
+        classified += mTaxonReads[t];
+    ofs << indent << "\"taxonomy_classification\": {" << endl;
+    ofs << indent << "\t" << "\"classified_reads\": " << classified;
+    for(int r=0; r<TAXONOMY_RANK_NUM; r++) {
+        vector<pair<int, long>> taxa = taxaOfRank(TAXONOMY_RANKS[r]);
+        ofs << "," << endl << indent << "\t\"" << TAXONOMY_RANKS[r] << "\": {";
+        for(int i=0; i<taxa.size(); i++) {
+            int t = taxa[i].first;
+            ofs << (i == 0 ? "" : ",") << endl;
+            ofs << indent << "\t\t\"" << replace(mTaxonomy->getName(t), "\"", "'") << "\":{";
+            ofs << "\"clade_reads\":" << mCladeReads[t];
+            ofs << ",\"direct_reads\":" << mTaxonReads[t];
+            ofs << "}";
+        }
+        ofs << (taxa.empty() ? "" : "\n" + indent + "\t") << "}";
+    }
+    ofs << endl << indent << "}";
+}
+
+void KmerCollection::reportTaxonomyHTML(ofstream& ofs) {
+    ofs << "<table class='summary_table' style='width:100%'>\n";
+    ofs <<  "<tr style='background:#cccccc'> <td>Rank</td><td>Taxon</td><td>Clade reads</td><td>Direct reads</td>  </tr>"  << endl;
+    int rows = 0;
+    for(int r=0; r<TAXONOMY_RANK_NUM; r++) {
+        vector<pair<int, long>> taxa = taxaOfRank(TAXONOMY_RANKS[r]);
+        for(int i=0; i<taxa.size(); i++) {
+            int t = taxa[i].first;
+            ofs << "<tr>";
+            ofs << "<td width=10%>" << TAXONOMY_RANKS[r] << "</td>";
+            ofs << "<td width=60%>" << mTaxonomy->getName(t) << "</td>";
+            ofs << "<td width=15%>" << mCladeReads[t] << "</td>";
+            ofs << "<td width=15%>" << mTaxonReads[t] << "</td>";
+            ofs << "</tr>" <<  endl;
+            rows++;
+        }
+    }
+    if(rows == 0)
+        ofs << "<tr> <td colspan=4 style='text-align:center;'>No read is classified to a genus or family. </td></tr>" << endl;
+    ofs << "</table>\n";
 }
 
 bool KmerCollection::isHighConfidence(KCResult kcr) {
@@ -336,9 +1462,9 @@ bool KmerCollection::isHighConfidence(KCResult kcr) {
         return false;
 }
 
-void KmerCollection::reportHTML(ofstream& ofs) {
+void KmerCollection::reportHTML(ofstream& ofs, string divSuffix) {
     ofs << "<table class='summary_table' style='width:100%'>\n";
-    ofs <<  "<tr style='background:#cccccc'> <td>Genome</td><td>K-mer hits</td><td>Unique reads</td><td>Coverage</td><td>Median depth</td><td>Mean depth</td><td>Remark</td>  </tr>"  << endl;
+    ofs <<  "<tr style='background:#cccccc'> <td>Genome</td><td>K-mer hits</td><td>Unique reads</td><td>Abundance</td><td>Coverage</td><td>Median depth</td><td>Mean depth</td><td>Remark</td>  </tr>"  << endl;
 
     int highConfidence = 0;
     for(int i=0; i<mResults.size(); i++) {
@@ -355,9 +1481,10 @@ void KmerCollection::reportHTML(ofstream& ofs) {
         else if(kcr.mName ==  "NC_045512.2 Wuhan seafood market pneumonia virus isolate Wuhan-Hu-1, complete genome")
             remark = "SARS-CoV-2";
         ofs << "<tr>";
-        ofs << "<td width=52%>" << kcr.mName << " (" << kcr.mKmerCount << " k-mer keys)</td>";
+        ofs << "<td width=44%>" << kcr.mName << " (" << kcr.mKmerCount << " k-mer keys)</td>";
         ofs << "<td width=8%>" << kcr.mHit << "</td>";
         ofs << "<td width=8%>" << kcr.mUniqueReads << "</td>";
+        ofs << "<td width=8%>" << kcr.mAbundance * 100 << "%</td>";
         ofs << "<td width=10%>" << kcr.mCoverage * 100 << "%</td>";
         ofs << "<td width=8%>" << kcr.mMedianHit << "</td>";
         ofs << "<td width=8%>" << kcr.mMeanHit << "</td>";
@@ -365,16 +1492,16 @@ void KmerCollection::reportHTML(ofstream& ofs) {
         ofs << "</tr>" <<  endl;
     }
     if(highConfidence == 0)
-        ofs << "<tr> <td colspan=6 style='text-align:center;'>No high confidence k-mer coverage found. </td></tr>" << endl;
+        ofs << "<tr> <td colspan=8 style='text-align:center;'>No high confidence k-mer coverage found. </td></tr>" << endl;
     ofs << "</table>\n";
 
     if(highConfidence != mResults.size())  {
-        ofs << "<div class='subsection_title' style='font-size:12px;font-weight:normal;color:#223399;' onclick=showOrHide('low_confidence_kcr')>+ Show " << mResults.size() - highConfidence;
+        ofs << "<div class='subsection_title' style='font-size:12px;font-weight:normal;color:#223399;' onclick=showOrHide('low_confidence_kcr" << divSuffix << "')>+ Show " << mResults.size() - highConfidence;
         ofs << " more with low confidence (coverage <= " << mOptions->kcCoverageHighConfidence *  100;
         ofs << "% or median depth <= " << mOptions->kcMedianHitHighConfidence;
         ofs << ") ▼ </div>\n";
-        ofs << "<table id='low_confidence_kcr' style='display:none;width:100%;' class='summary_table'>\n";
-        ofs <<  "<tr style='background:#cccccc'> <td>Genome</td><td>K-mer hits</td><td>Unique reads</td><td>Coverage</td><td>Median depth</td><td>Mean depth</td><td>Remark</td>  </tr>"  << endl;
+        ofs << "<table id='low_confidence_kcr" << divSuffix << "' style='display:none;width:100%;' class='summary_table'>\n";
+        ofs <<  "<tr style='background:#cccccc'> <td>Genome</td><td>K-mer hits</td><td>Unique reads</td><td>Abundance</td><td>Coverage</td><td>Median depth</td><td>Mean depth</td><td>Remark</td>  </tr>"  << endl;
 
         int highConfidence = 0;
         for(int i=0; i<mResults.size(); i++) {
@@ -389,9 +1516,10 @@ void KmerCollection::reportHTML(ofstream& ofs) {
             else if(kcr.mName ==  "NC_045512.2 Wuhan seafood market pneumonia virus isolate Wuhan-Hu-1, complete genome")
                 remark = "SARS-CoV-2";
             ofs << "<tr>";
-            ofs << "<td width=52%>" << kcr.mName << " (" << kcr.mKmerCount << " k-mer keys)</td>";
+            ofs << "<td width=44%>" << kcr.mName << " (" << kcr.mKmerCount << " k-mer keys)</td>";
             ofs << "<td width=8%>" << kcr.mHit << "</td>";
             ofs << "<td width=8%>" << kcr.mUniqueReads << "</td>";
+            ofs << "<td width=8%>" << kcr.mAbundance * 100 << "%</td>";
             ofs << "<td width=10%>" << kcr.mCoverage * 100 << "%</td>";
             ofs << "<td width=8%>" << kcr.mMedianHit << "</td>";
             ofs << "<td width=8%>" << kcr.mMeanHit << "</td>";
@@ -400,6 +1528,11 @@ void KmerCollection::reportHTML(ofstream& ofs) {
         }
         ofs << "</table>\n";
     }
+
+    if(mTaxonomy) {
+        ofs << "<div class='subsection_title'>Taxonomic classification</div>\n";
+        reportTaxonomyHTML(ofs);
+    }
 }
 
 void KmerCollection::makeBitAndMask() {
@@ -431,3 +1564,66 @@ void KmerCollection::unpackIdCount(uint32 data, uint32& id, uint32& count) {
     count = data >> mIdBits;
     id = data & mIdMask;
 }
+
+// two genomes share k-mers without a taxonomy, the reads hitting them get the equivalence class of both
+bool KmerCollection::test() {
+    char fasta[] = "/tmp/fastv_kc_test_XXXXXX.fa";
+    int fd = mkstemps(fasta, 3);
+    if(fd < 0)
+        return false;
+    string kmers = ">g1\nACGTACGTAAC\nCCCCAGGGTTA\nGGGTTTAAACC\n"
+        ">g2\nCCCCAGGGTTA\nTTTACAGATCA\nGGGTTTAAACC\n"
+        ">g3\nGGGTTTAAACC\nATATGCGCATG\n";
+    bool written = write(fd, kmers.data(), kmers.size()) == kmers.size();
+    close(fd);
+
+    Options opt;
+    opt.thread = 2;
+    KmerCollection* kc = written ? new KmerCollection(fasta, &opt) : NULL;
+    char index[] = "/tmp/fastv_kc_test_XXXXXX.kci";
+    fd = mkstemps(index, 4);
+    if(kc && fd >= 0) {
+        close(fd);
+        kc->writeIndex(index);
+    }
+    unlink(fasta);
+    if(kc == NULL || fd < 0)
+        return false;
+
+    // the index keeps the genome sets
+    KmerCollection* mapped = new KmerCollection(index, &opt);
+    unlink(index);
+    bool passed = true;
+    KmerCollection* collections[2] = {kc, mapped};
+    for(int c=0; c<2; c++) {
+        KmerCollection* k = collections[c];
+        bool valid = true;
+        uint32 unique = k->add<uint64>(KmerKey<uint64>::encode("ACGTACGTAAC", 0, 11, valid));
+        uint32 pair = k->add<uint64>(KmerKey<uint64>::encode("CCCCAGGGTTA", 0, 11, valid));
+        uint32 all = k->add<uint64>(KmerKey<uint64>::encode("GGGTTTAAACC", 0, 11, valid));
+        passed &= unique == 1 && (pair & KC_SET_BIT) && (all & KC_SET_BIT) && pair != all;
+        passed &= k->setSize(pair) == 2 && k->setSize(all) == 3;
+        passed &= k->genomeHasId(2, pair) && !k->genomeHasId(3, pair) && k->genomeHasId(3, all);
+        if(!passed)
+            break;
+
+        EquivalenceClasses classes;
+        uint32 hits1[] = {pair, all, pair};
+        uint32 hits2[] = {all};
+        uint32 hits3[] = {unique, pair};
+        vector<uint32> ids(hits1, hits1 + 3);
+        k->addReadHits(ids, classes);
+        ids.assign(hits2, hits2 + 1);
+        k->addReadHits(ids, classes);
+        k->addReadHits(ids, classes);
+        ids.assign(hits3, hits3 + 2);
+        k->addReadHits(ids, classes);
+        uint32 set12[] = {1, 2};
+        uint32 set123[] = {1, 2, 3};
+        passed &= classes.size() == 3 && classes.mCounts[vector<uint32>(set12, set12 + 2)] == 1
+            && classes.mCounts[vector<uint32>(set123, set123 + 3)] == 2 && classes.mCounts[vector<uint32>(1, 1)] == 1;
+    }
+    delete kc;
+    delete mapped;
+    return passed;
+}
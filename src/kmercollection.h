@@ -3,24 +3,54 @@
 
 // includes
 #include "common.h"
+#include "util.h"
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <algorithm>
 #include "fastareader.h"
 #include "options.h"
 #include "zlib/zlib.h"
-#include "common.h"
+#include "kmerkey.h"
+#include "phasetimer.h"
+#include "taxonomy.h"
+#include "abundance.h"
+#include "succinctindex.h"
+#include "depthhistogram.h"
 #include <iostream>
 #include <fstream>
 #include <mutex>
 
 #define  MTX_COUNT 100
-#define COLLISION_FLAG 0xFFFFFFFF
+
+// the genome ID of an empty slot
+#define KC_EMPTY_ID 0
+// a k-mer shared by genomes gets the ID of the set of these genomes, which is the set index with this bit set,
+// the genomes of every set are kept in a side table, and the taxonomy classifies a set by their LCA
+#define KC_SET_BIT 0x80000000
+
+// the hash table is sized from the k-mer number and the load factor
+const long MAX_HASH_LENGTH = (1L<<32);
+const long MIN_HASH_LENGTH = (1L<<10);
+
+// the FASTA is read in chunks of whole lines, every chunk is parsed and inserted by all the threads
+const long KC_CHUNK_SIZE = (1L<<24);
+
+// the binary index written by `fastv index`
+#define KC_INDEX_MAGIC "FASTVKCI"
+#define KC_INDEX_VERSION 5
+#define KC_INDEX_EXT ".kci"
+// the same sections, but the hash table is replaced by a SuccinctIndex
+#define KC_SUCCINCT_MAGIC "FASTVKCS"
+#define KC_SUCCINCT_EXT ".kcs"
+// every section of the index starts at a cache line
+#define KC_INDEX_ALIGN INDEX_SECTION_ALIGN
 
 using namespace std;
 
 class KCResult {
 public:
+    uint32 mID;
     string mName;
     uint64  mHit;
     int mMedianHit;
@@ -28,13 +58,50 @@ public:
     double mCoverage;
     int mKmerCount;
     int mUniqueReads;
+    // by the EM over the equivalence classes of the reads
+    double mEstimatedReads;
+    double mAbundance;
 };
 
-class KCHit {
+// a slot of the Robin Hood hash table, its hits are counted in KmerCollection::mHitCounts
+// 16 bytes for k <= 32, so that a cache line holds 4 slots
+template<typename KeyType>
+class KCEntry {
 public:
-    uint64 mKey64;
+    KeyType mKey;
+    // 1-based genome ID, KC_EMPTY_ID, or a genome set with KC_SET_BIT
     uint32 mID;
-    uint32 mHit;
+    // how far this slot is from the home slot of mKey
+    uint32 mDist;
+};
+
+// the index file is this header, then the hash table, the k-mer counts, the names,
+// the taxon parents, the taxon names/ranks, the start of every genome set and their genomes,
+// each section is padded to KC_INDEX_ALIGN bytes
+class KCIndexHeader {
+public:
+    char mMagic[8];
+    uint32 mVersion;
+    uint32 mKeyLen;
+    // hash slots, or the bytes of the succinct index
+    uint64 mHashLength;
+    uint32 mHashShift;
+    uint32 mGenomeNum;
+    uint64 mEntryNum;
+    uint64 mNamesBytes;
+    // 0 if built without a taxonomy
+    uint32 mTaxonNum;
+    // crc32 of the small sections after the table, checked at every load
+    uint32 mMetaChecksum;
+    uint64 mTaxonomyBytes;
+    // the genomes of all the genome sets
+    uint64 mSetGenomeNum;
+    uint32 mSetNum;
+    // crc32 of all the sections after the header, which reads the whole file, only checked with --verify_index
+    uint32 mDataChecksum;
+    // crc32 of the header fields above
+    uint32 mHeaderChecksum;
+    uint32 mReserved;
 };
 
 class KmerCollection
@@ -45,18 +112,96 @@ public:
     void init();
     void report();
     void reportJSON(ofstream& ofs);
-    void reportHTML(ofstream& ofs);
-    uint32 add(uint64 kmer64);
+    void reportGenomesJSON(ofstream& ofs);
+    void reportHTML(ofstream& ofs, string divSuffix = "");
+    bool isPositive();
+    string getFilename() {return mFilename;}
+    int getKeyLen() {return mKeyLen;}
+    uint64 getHashLength() {return mHashLength;}
+    bool isMapped() {return mMappedData != NULL;}
+    bool isSuccinct() {return mSuccinct != NULL;}
+    bool hasTaxonomy() {return mTaxonomy != NULL;}
+    vector<pair<string, double>>& getLoadingPhases() {return mLoadingTimer.phases();}
+    // writes the succinct index if filename ends with KC_SUCCINCT_EXT
+    void writeIndex(string filename);
+    // compares the lookups of the hash table to the written succinct index
+    void benchmark(string succinctFile);
+    static bool isIndexFile(string filename);
+    // returns the genome ID, the genome set with KC_SET_BIT, or 0 if not found
+    template<typename KeyType>
+    inline uint32 add(KeyType key);
+    // add() of many keys, faster for the succinct index
+    void addBatch(const uint64* keys, int n, uint32* ids);
     void addGenomeRead(uint32 genomeID);
+    // the taxon of the hits of a read returned by add(), or -1 if none
+    int classify(vector<uint32>& ids);
+    // adds the genomes compatible with all the hits of a read to classes, which are merged later by mergeClasses()
+    void addReadHits(vector<uint32>& ids, EquivalenceClasses& classes);
+    // merges the classes and the classified reads of every taxon of a pack of reads, and clears them
+    void mergeClasses(EquivalenceClasses& classes, unordered_map<int, long>& taxonReads);
+    uint32 getGenomeNum() {return mNames.size();}
+    string& getGenomeName(uint32 genomeID) {return mNames[genomeID-1];}
+    Taxonomy* getTaxonomy() {return mTaxonomy;}
+    void reportTaxonomyJSON(ofstream& ofs, string indent);
+
+    static bool test();
 
     uint32 packIdCount(uint32 id, uint32 count);
     void unpackIdCount(uint32 data,uint32& id, uint32& count);
     void stat();
 
 private:
-    bool getLine(char* line, int maxLine);
-    uint64 makeHash(uint64 key);
-    bool eof();
+    bool readChunk(string& chunk);
+    inline uint64 makeHash(uint64 key);
+    void rewind();
+    void loadFasta();
+    uint64 prescan();
+    void mapIndex();
+    bool mapIndexFile(int fd, string path, string& error);
+    string indexNames();
+    uint64 indexBytes(const string* succinct);
+    void serializeIndex(char* data, const string* succinct);
+    bool writeIndexFile(int fd, const string* succinct = NULL);
+    string buildSuccinctIndex();
+    void initHitCounts(uint64 num);
+    void freeHitCounts();
+    string sharedIndexPath();
+    bool attachSharedIndex();
+    void clearTables();
+    void setTaxonomy(Taxonomy* taxonomy);
+    string indexTaxonomyNames();
+    inline int taxonOf(uint32 id);
+    // shared has the genomes of every k-mer found more than once, the set of them replaces the placeholder KC_SET_BIT
+    template<typename KeyType>
+    void initSets(vector<vector<pair<KeyType, uint32>>>& shared);
+    inline uint64 setSize(uint32 id);
+    inline bool genomeHasId(uint32 genomeID, uint32 id);
+    void initSetTaxa();
+    void estimateAbundance();
+    void statTaxonomy();
+    vector<pair<int, long>> taxaOfRank(string rank);
+    void reportTaxonomy();
+    void reportTaxonomyHTML(ofstream& ofs);
+    void addGenome(string name);
+    uint64 entryBytes();
+    void initHashTable(uint64 kmerNum);
+    template<typename KeyType>
+    void load();
+    template<typename KeyType>
+    void parseKmers(const string& chunk, uint64 start, uint64 end, uint32 id, int regionShift, vector<vector<KCEntry<KeyType>>>& parsed, vector<string>& skipped);
+    template<typename KeyType>
+    void insertRegion(int region, int regionShift, vector<vector<vector<KCEntry<KeyType>>>>& parsed, vector<KCEntry<KeyType>>& overflow, vector<pair<KeyType, uint32>>& shared);
+    template<typename KeyType>
+    bool insert(KCEntry<KeyType>& entry, uint64 stopAt, vector<pair<KeyType, uint32>>& shared);
+    template<typename KeyType>
+    void countKmers();
+    // calls visit(genome index, hits) for every hit k-mer of a genome
+    template<typename KeyType, typename Visitor>
+    void visitHits(Visitor& visit);
+    template<typename Visitor>
+    void visitAllHits(Visitor& visit);
+    template<typename KeyType>
+    inline KCEntry<KeyType>*& kcEntries();
     void makeBitAndMask();
     bool isHighConfidence(KCResult kcr);
 private:
@@ -70,19 +215,119 @@ private:
     vector<int> mGenomeReads;
     vector<KCResult> mResults;
     int mNumber;
+    // k-mers unique to one genome
     uint32 mUniqueHashNum;
-    uint32* mHashKCH;
-    KCHit* mKCHits;
+    // occupied slots, including the shared k-mers
+    uint64 mEntryNum;
+    uint64 mHashLength;
+    // the home slot is taken from the top bits of the multiplied key
+    int mHashShift;
+    // the Robin Hood hash table, k <= 32 uses mKCEntries, k > 32 uses mWideKCEntries
+    KCEntry<uint64>* mKCEntries;
+    KCEntry<uint128>* mWideKCEntries;
+    // hits of every slot, or every k-mer of the succinct index
+    // anonymously mapped, so that the pages never hit take no memory
+    uint32* mHitCounts;
+    uint64 mHitCountBytes;
+    // NULL unless loaded from a succinct index, which replaces the hash table
+    SuccinctIndex* mSuccinct;
+    // the hash table is in this memory if loaded from an index file
+    char* mMappedData;
+    uint64 mMappedSize;
     string mFilename;
     gzFile mZipFile;
     ifstream mFile;
     bool mZipped;
+    // the incomplete last line of the chunk read
+    string mPendingLine;
+    PhaseTimer mLoadingTimer;
+    // NULL if no taxonomy is given
+    Taxonomy* mTaxonomy;
+    // the taxon of every genome, -1 if not in the taxonomy
+    vector<int> mGenomeTaxa;
+    // reads classified to every taxon, and to it or its descendants
+    vector<long> mTaxonReads;
+    vector<long> mCladeReads;
+    // the genomes of set s are mSetGenomes[mSetStarts[s], mSetStarts[s+1]), sorted
+    vector<uint64> mSetStarts;
+    vector<uint32> mSetGenomes;
+    // the LCA taxon of every set, -1 if any of its genomes is not in the taxonomy
+    vector<int> mSetTaxa;
+    // of all the reads, merged from the per-pack classes of the worker threads, and the taxon reads with them
+    EquivalenceClasses mClasses;
+    std::mutex mClassesMtx;
+    vector<double> mEstimatedReads;
     int mIdBits;
     uint32 mIdMask;
     uint32 mCountMax;
     bool mStatDone;
     uint32 mUniqueNumber;
+    int mKeyLen;
 };
 
+template<>
+inline KCEntry<uint64>*& KmerCollection::kcEntries<uint64>() {
+    return mKCEntries;
+}
+
+template<>
+inline KCEntry<uint128>*& KmerCollection::kcEntries<uint128>() {
+    return mWideKCEntries;
+}
+
+inline int KmerCollection::taxonOf(uint32 id) {
+    if(mTaxonomy == NULL)
+        return -1;
+    if(id & KC_SET_BIT)
+        return mSetTaxa[id & ~KC_SET_BIT];
+    return mGenomeTaxa[id - 1];
+}
+
+inline uint64 KmerCollection::setSize(uint32 id) {
+    if((id & KC_SET_BIT) == 0)
+        return 1;
+    uint32 s = id & ~KC_SET_BIT;
+    return mSetStarts[s + 1] - mSetStarts[s];
+}
+
+inline uint64 KmerCollection::makeHash(uint64 key) {
+    return (key * 0x9E3779B97F4A7C15UL) >> mHashShift;
+}
+
+template<typename KeyType>
+inline uint32 KmerCollection::add(KeyType key) {
+    // k <= 32 only
+    if(mSuccinct) {
+        uint64 pos = 0;
+        uint32 id = mSuccinct->find(KmerKey<KeyType>::fold(key), pos);
+        if(id != 0)
+            mHitCounts[pos]++;
+        return id;
+    }
+    KCEntry<KeyType>* table = kcEntries<KeyType>();
+    uint64 mask = mHashLength - 1;
+    uint64 slot = makeHash(KmerKey<KeyType>::fold(key));
+    // the slots are ordered by the distance to their home, so the key cannot be
+    // behind a slot that is closer to its home than the probe
+    for(uint32 dist = 0; ; dist++) {
+        KCEntry<KeyType>& kce = table[slot];
+        if(kce.mID == KC_EMPTY_ID || kce.mDist < dist)
+            return 0;
+        if(kce.mKey == key) {
+            // the shared k-mers are counted, but only used to classify the reads
+            mHitCounts[slot]++;
+            return kce.mID;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+// whether the k-mers with this ID are in the genome
+inline bool KmerCollection::genomeHasId(uint32 genomeID, uint32 id) {
+    if((id & KC_SET_BIT) == 0)
+        return genomeID == id;
+    uint32 s = id & ~KC_SET_BIT;
+    return binary_search(mSetGenomes.begin() + mSetStarts[s], mSetGenomes.begin() + mSetStarts[s + 1], genomeID);
+}
 
 #endif
\ No newline at end of file
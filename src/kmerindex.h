@@ -0,0 +1,214 @@
+#ifndef KMER_INDEX_H
+#define KMER_INDEX_H
+
+// includes
+#include "common.h"
+#include "kmerkey.h"
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+using namespace std;
+
+// every array of a serialized KmerIndex starts at a cache line
+#define KMER_INDEX_ALIGN 64
+
+// a serialized KmerIndex is this header, then the keys, the offsets, the positions and the buckets,
+// each padded to KMER_INDEX_ALIGN bytes
+class KmerIndexHeader {
+public:
+    uint32 mBucketBits;
+    // sizeof(KeyType), so that a table of the other key type is rejected
+    uint32 mKeyBytes;
+    uint64 mKeyNum;
+    uint64 mPositionNum;
+    uint64 mReserved;
+};
+
+// a static map of k-mer keys to their genome positions in CSR layout:
+// the unique keys, the offsets of their positions, and all the positions in one array.
+// the keys are ordered by their hash buckets, so a lookup reads the bucket offsets,
+// then scans the about one key of the bucket, without any pointer chasing.
+// the arrays are built in memory, or attached to a mapped index file
+template<typename KeyType>
+class KmerIndex
+{
+public:
+    KmerIndex() {
+        mBucketBits = 0;
+        mKeyNum = 0;
+        mPositionNum = 0;
+        mKeys = NULL;
+        mOffsets = NULL;
+        mPositions = NULL;
+        mBuckets = NULL;
+    }
+
+    // entries are (key, position), the positions of a key keep their order in entries
+    void build(vector<pair<KeyType, uint32>>& entries) {
+        uint64 bucketNum = 1;
+        mBucketBits = 0;
+        while(bucketNum < entries.size() / 2) {
+            bucketNum <<= 1;
+            mBucketBits++;
+        }
+        int bucketBits = mBucketBits;
+        stable_sort(entries.begin(), entries.end(), [bucketBits](const pair<KeyType, uint32>& a, const pair<KeyType, uint32>& b) {
+            uint64 ba = bucketOf(a.first, bucketBits);
+            uint64 bb = bucketOf(b.first, bucketBits);
+            if(ba != bb)
+                return ba < bb;
+            return a.first < b.first;
+        });
+
+        mKeyStore.clear();
+        mOffsetStore.clear();
+        mPositionStore.clear();
+        mPositionStore.reserve(entries.size());
+        mBucketStore = vector<uint32>(bucketNum + 1, 0);
+        for(uint64 i=0; i<entries.size(); i++) {
+            if(i == 0 || entries[i].first != entries[i-1].first) {
+                mBucketStore[bucketOf(entries[i].first, mBucketBits) + 1]++;
+                mKeyStore.push_back(entries[i].first);
+                mOffsetStore.push_back(mPositionStore.size());
+            }
+            mPositionStore.push_back(entries[i].second);
+        }
+        mOffsetStore.push_back(mPositionStore.size());
+        for(uint64 b=0; b<bucketNum; b++)
+            mBucketStore[b+1] += mBucketStore[b];
+
+        mKeyNum = mKeyStore.size();
+        mPositionNum = mPositionStore.size();
+        mKeys = mKeyStore.data();
+        mOffsets = mOffsetStore.data();
+        mPositions = mPositionStore.data();
+        mBuckets = mBucketStore.data();
+
+        // free the memory of entries
+        vector<pair<KeyType, uint32>>().swap(entries);
+    }
+
+    // sets the positions of key to [begin, end), returns false if not found
+    inline bool find(KeyType key, const uint32*& begin, const uint32*& end) {
+        if(mKeyNum == 0)
+            return false;
+        uint64 bucket = bucketOf(key, mBucketBits);
+        for(uint32 i = mBuckets[bucket]; i < mBuckets[bucket + 1]; i++) {
+            if(mKeys[i] == key) {
+                begin = mPositions + mOffsets[i];
+                end = mPositions + mOffsets[i + 1];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline bool has(KeyType key) {
+        const uint32* begin;
+        const uint32* end;
+        return find(key, begin, end);
+    }
+
+    uint64 size() {return mKeyNum;}
+    const KeyType* keys() {return mKeys;}
+    uint64 bytes() {
+        if(mKeys == NULL)
+            return 0;
+        return mKeyNum * sizeof(KeyType) + (mKeyNum + 1 + bucketNum() + 1 + mPositionNum) * sizeof(uint32);
+    }
+
+    uint64 serializedBytes() {
+        return align(sizeof(KmerIndexHeader)) + align(mKeyNum * sizeof(KeyType)) + align((mKeyNum + 1) * sizeof(uint32))
+            + align(mPositionNum * sizeof(uint32)) + align((bucketNum() + 1) * sizeof(uint32));
+    }
+
+    // writes serializedBytes() bytes to dst, and returns the end
+    char* serialize(char* dst) {
+        KmerIndexHeader header;
+        memset(&header, 0, sizeof(KmerIndexHeader));
+        header.mBucketBits = mBucketBits;
+        header.mKeyBytes = sizeof(KeyType);
+        header.mKeyNum = mKeyNum;
+        header.mPositionNum = mPositionNum;
+        dst = copySection(dst, (const char*)&header, sizeof(KmerIndexHeader));
+        dst = copySection(dst, (const char*)mKeys, mKeyNum * sizeof(KeyType));
+        dst = copySection(dst, (const char*)mOffsets, (mKeyNum + 1) * sizeof(uint32));
+        dst = copySection(dst, (const char*)mPositions, mPositionNum * sizeof(uint32));
+        dst = copySection(dst, (const char*)mBuckets, (bucketNum() + 1) * sizeof(uint32));
+        return dst;
+    }
+
+    // points the arrays to a serialized index of bytes, which must live as long as this,
+    // returns false if it's not a valid index of this key type
+    bool attach(const char* data, uint64 bytes) {
+        if(bytes < align(sizeof(KmerIndexHeader)))
+            return false;
+        const KmerIndexHeader* header = (const KmerIndexHeader*)data;
+        if(header->mKeyBytes != sizeof(KeyType) || header->mBucketBits > 32 || header->mPositionNum >= 0xFFFFFFFFUL)
+            return false;
+        if(header->mKeyNum > header->mPositionNum)
+            return false;
+        mBucketBits = header->mBucketBits;
+        mKeyNum = header->mKeyNum;
+        mPositionNum = header->mPositionNum;
+        if(serializedBytes() > bytes) {
+            mKeyNum = 0;
+            return false;
+        }
+        const char* p = data + align(sizeof(KmerIndexHeader));
+        mKeys = (const KeyType*)p;
+        p += align(mKeyNum * sizeof(KeyType));
+        mOffsets = (const uint32*)p;
+        p += align((mKeyNum + 1) * sizeof(uint32));
+        mPositions = (const uint32*)p;
+        p += align(mPositionNum * sizeof(uint32));
+        mBuckets = (const uint32*)p;
+        if(mOffsets[mKeyNum] != mPositionNum || mBuckets[bucketNum()] != mKeyNum) {
+            mKeyNum = 0;
+            return false;
+        }
+        mKeyStore.clear();
+        mOffsetStore.clear();
+        mPositionStore.clear();
+        mBucketStore.clear();
+        return true;
+    }
+
+private:
+    static inline uint64 bucketOf(KeyType key, int bucketBits) {
+        if(bucketBits == 0)
+            return 0;
+        return (KmerKey<KeyType>::fold(key) * 0xC2B2AE3D27D4EB4FUL) >> (64 - bucketBits);
+    }
+    uint64 bucketNum() {return 1UL << mBucketBits;}
+    static uint64 align(uint64 bytes) {
+        return (bytes + KMER_INDEX_ALIGN - 1) / KMER_INDEX_ALIGN * KMER_INDEX_ALIGN;
+    }
+    // an index never built has no arrays, which are written as zeros
+    static char* copySection(char* dst, const char* data, uint64 bytes) {
+        if(data)
+            memcpy(dst, data, bytes);
+        else
+            memset(dst, 0, bytes);
+        memset(dst + bytes, 0, align(bytes) - bytes);
+        return dst + align(bytes);
+    }
+
+private:
+    int mBucketBits;
+    uint64 mKeyNum;
+    uint64 mPositionNum;
+    const KeyType* mKeys;
+    const uint32* mOffsets;
+    const uint32* mPositions;
+    // the keys of bucket b are mKeys[mBuckets[b]] ... mKeys[mBuckets[b+1]-1]
+    const uint32* mBuckets;
+    // the arrays built in memory, empty if attached
+    vector<KeyType> mKeyStore;
+    vector<uint32> mOffsetStore;
+    vector<uint32> mPositionStore;
+    vector<uint32> mBucketStore;
+};
+
+#endif
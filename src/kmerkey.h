@@ -0,0 +1,91 @@
+#ifndef KMER_KEY_H
+#define KMER_KEY_H
+
+// includes
+#include "common.h"
+#include <string>
+#include <stddef.h>
+
+using namespace std;
+
+// a k-mer key packs 2 bits per base (A=0, T=1, C=2, G=3)
+// uint64 keys support k <= 32, uint128 keys support k <= 64
+template<typename KeyType>
+class KmerKey
+{
+public:
+    static const int MAX_LEN = sizeof(KeyType) * 4;
+    static const int BITS = sizeof(KeyType) * 8;
+
+    // the key type to be used for a given k
+    inline static bool fits(int keylen) {
+        return keylen <= MAX_LEN;
+    }
+
+    // remove the bases rolled out of the k-mer window
+    inline static KeyType trim(KeyType key, int keylen) {
+        int blankBits = BITS - 2*keylen;
+        return (key << blankBits) >> blankBits;
+    }
+
+    // fold the key to 64 bits for hashing
+    inline static uint64 fold(KeyType key);
+
+    static KeyType encode(const char* seq, uint32 pos, uint32 len, bool& valid) {
+        KeyType key = 0;
+        for(uint32 i=0; i<len; i++) {
+            key = (key << 2);
+            switch(seq[pos +i]) {
+                case 'A':
+                    key += 0;
+                    break;
+                case 'T':
+                    key += 1;
+                    break;
+                case 'C':
+                    key += 2;
+                    break;
+                case 'G':
+                    key += 3;
+                    break;
+                case 'N':
+                default:
+                    valid = false;
+                    return 0;
+            }
+        }
+        valid = true;
+        return key;
+    }
+
+    static string decode(KeyType key, int keylen) {
+        string seq(keylen, 'N');
+        for(int i=keylen-1; i>=0; i--) {
+            seq[i] = ATCG_BASES[(int)(key & 0x03)];
+            key >>= 2;
+        }
+        return seq;
+    }
+};
+
+template<>
+inline uint64 KmerKey<uint64>::fold(uint64 key) {
+    return key;
+}
+
+template<>
+inline uint64 KmerKey<uint128>::fold(uint128 key) {
+    return (uint64)key ^ ((uint64)(key >> 64) * 0x9E3779B97F4A7C15UL);
+}
+
+// hasher for unordered containers, std::hash has no uint128 specialization in C++11
+template<typename KeyType>
+class KmerKeyHash
+{
+public:
+    inline size_t operator()(const KeyType& key) const {
+        return KmerKey<KeyType>::fold(key);
+    }
+};
+
+#endif
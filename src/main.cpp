@@ -8,11 +8,89 @@
 #include "options.h"
 #include "processor.h"
 #include "evaluator.h"
+#include "kmercollection.h"
+#include "genomes.h"
 
 // TODO: code refactoring to remove these global variables
 string command;
 mutex logmtx;
 
+// fastv index -g: convert a Genomes FASTA to a binary index, which can be passed to -g directly
+int buildGenomesIndex(cmdline::parser& cmd) {
+    Options opt;
+    string input = cmd.get<string>("genomes");
+    string output = cmd.get<string>("out");
+    opt.genomeFile = input;
+    opt.kmerKeyLen = cmd.get<int>("key_len");
+    opt.spacedSeeds = cmd.get<string>("spaced_seeds");
+    opt.thread = min(max(cmd.get<int>("thread"), 1), 16);
+    opt.verbose = cmd.exist("verbose");
+
+    check_file_valid(input);
+    if(Genomes::isIndexFile(input))
+        error_exit("The input is already an index: " + input);
+    if(!Genomes::isIndexFile(output))
+        error_exit("The genomes index file name must end with " + string(GENOMES_INDEX_EXT) + ": " + output);
+    if(opt.kmerKeyLen < 10 || !KmerKey<uint128>::fits(opt.kmerKeyLen))
+        error_exit("The key length (--key_len) should be 10 ~ 64, and the same as the k of the KMER or k-mer collection file used with the index");
+    if(!opt.spacedSeeds.empty())
+        opt.parseSpacedSeeds();
+
+    Genomes genomes(input, &opt);
+    genomes.writeIndex(output);
+    cerr << "genomes index written to: " << output << endl;
+    return 0;
+}
+
+// fastv index: convert a k-mer collection FASTA to a binary index, which can be passed to -c directly,
+// or a Genomes FASTA with -g
+int buildIndex(int argc, char* argv[]) {
+    cmdline::parser cmd;
+    cmd.add<string>("kmer_collection", 'c', "the k-mer collection file in fasta format", false, "");
+    cmd.add<string>("genomes", 'g', "the Genomes file in fasta format, to write a genomes index (" + string(GENOMES_INDEX_EXT) + ") instead", false, "");
+    cmd.add<string>("out", 'o', "the index file to write, must end with " + string(KC_INDEX_EXT) + ", or " + string(KC_SUCCINCT_EXT) + " for the succinct index (k <= 32), which takes several times less memory but is slower to look up, or " + string(GENOMES_INDEX_EXT) + " for -g", true, "");
+    cmd.add<int>("key_len", 0, "the k of the genomes index, must be the same as the k of the KMER (-k) or k-mer collection (-c) file used with it, or 25 if none", false, 25);
+    cmd.add<string>("spaced_seeds", 0, "the spaced seed patterns of the genomes index, must be the same as --spaced_seeds of fastv", false, "");
+    cmd.add<double>("kc_load_factor", 0, "The k-mer collection hash table is sized to (k-mer number / kc_load_factor) slots, rounded up to a power of 2. Lower value uses more memory but makes shorter probes. Default is 0.7.", false, 0.7);
+    cmd.add<string>("taxonomy", 0, "the taxonomy file to keep the LCA of the genomes sharing a k-mer, see --taxonomy of fastv", false, "");
+    cmd.add<int>("thread", 'w', "worker thread number to build the index, default is 4", false, 4);
+    cmd.add("benchmark", 0, "compare the memory and the lookup time of the succinct index to the hash table, -o must end with " + string(KC_SUCCINCT_EXT));
+    cmd.add("verbose", 'V', "output verbose log information (i.e. when every 1M reads are processed).");
+    cmd.parse_check(argc, argv);
+
+    if(cmd.get<string>("kmer_collection").empty() == cmd.get<string>("genomes").empty())
+        error_exit("Specify either a k-mer collection file (-c) or a Genomes file (-g) to index");
+    if(!cmd.get<string>("genomes").empty())
+        return buildGenomesIndex(cmd);
+
+    Options opt;
+    string input = cmd.get<string>("kmer_collection");
+    string output = cmd.get<string>("out");
+    opt.kcLoadFactor = cmd.get<double>("kc_load_factor");
+    opt.taxonomyFile = cmd.get<string>("taxonomy");
+    opt.thread = min(max(cmd.get<int>("thread"), 1), 16);
+    opt.verbose = cmd.exist("verbose");
+
+    check_file_valid(input);
+    if(KmerCollection::isIndexFile(input))
+        error_exit("The input is already an index: " + input);
+    if(!KmerCollection::isIndexFile(output))
+        error_exit("The index file name must end with " + string(KC_INDEX_EXT) + " or " + string(KC_SUCCINCT_EXT) + ": " + output);
+    if(cmd.exist("benchmark") && !ends_with(output, KC_SUCCINCT_EXT))
+        error_exit("--benchmark needs a succinct index, whose name ends with " + string(KC_SUCCINCT_EXT) + ": " + output);
+    if(opt.kcLoadFactor < 0.01 || opt.kcLoadFactor > 0.95)
+        error_exit("K-mer collection hash table load factor (--kc_load_factor) should be 0.01 ~ 0.95, suggest 0.7");
+    if(!opt.taxonomyFile.empty())
+        check_file_valid(opt.taxonomyFile);
+
+    KmerCollection kc(input, &opt);
+    kc.writeIndex(output);
+    cerr << "k-mer collection index written to: " << output << endl;
+    if(cmd.exist("benchmark"))
+        kc.benchmark(output);
+    return 0;
+}
+
 int main(int argc, char* argv[]){
     // display version info if no argument is given
     if(argc == 1) {
@@ -25,6 +103,9 @@ int main(int argc, char* argv[]){
         tester.run();
         return 0;
     }
+    if (argc >= 2 && strcmp(argv[1], "index")==0){
+        return buildIndex(argc - 1, argv + 1);
+    }
     if (argc == 2 && (strcmp(argv[1], "-v")==0 || strcmp(argv[1], "--version")==0)){
         cerr << "fastv " << FASTV_VER << endl;
         return 0;
@@ -34,9 +115,9 @@ int main(int argc, char* argv[]){
     cmd.add<string>("in2", 'I', "read2 input file name", false, "");
     cmd.add<string>("out1", 'o', "file name to store read1 with on-target sequences", false, "");
     cmd.add<string>("out2", 'O', "file name to store read2 with on-target sequences", false, "");
-    cmd.add<string>("kmer_collection", 'c', "the unique k-mer collection file in fasta format, see an example: http://opengene.org/kmer_collection.fasta", false, "");
-    cmd.add<string>("kmer", 'k', "the unique k-mer file of the detection target in fasta format. data/SARS-CoV-2.kmer.fa will be used if none of k-mer/Genomes/k-mer_Collection file is specified", false, "");
-    cmd.add<string>("genomes", 'g', "the genomes file of the detection target in fasta format. data/SARS-CoV-2.genomes.fa will be used if none of k-mer/Genomes/k-mer_Collection file is specified", false, "");
+    cmd.add<string>("kmer_collection", 'c', "the unique k-mer collection file in fasta format, see an example: http://opengene.org/kmer_collection.fasta. Use comma to separate multiple files, which will be scanned in one pass", false, "");
+    cmd.add<string>("kmer", 'k', "the unique k-mer file of the detection target in fasta format. data/SARS-CoV-2.kmer.fa will be used if none of k-mer/Genomes/k-mer_Collection file is specified. Use comma to separate multiple files, which will be scanned in one pass", false, "");
+    cmd.add<string>("genomes", 'g', "the genomes file of the detection target in fasta format, or its index (" + string(GENOMES_INDEX_EXT) + ") written by `fastv index -g`. data/SARS-CoV-2.genomes.fa will be used if none of k-mer/Genomes/k-mer_Collection file is specified", false, "");
     cmd.add<float>("positive_threshold", 'p', "the data is considered as POSITIVE, when its mean coverage of unique kmer >= positive_threshold (0.001 ~ 100). 0.1 by default.", false, 0.1);
     cmd.add<float>("depth_threshold", 'd', "For coverage calculation. A region is considered covered when its mean depth >= depth_threshold (0.001 ~ 1000). 1.0 by default.", false, 1.0);
     cmd.add<int>("ed_threshold", 'E', "If the edit distance of a sequence and a genome region is <=ed_threshold, then consider it a match (0 ~ 50). 8 by default.", false, 8);
@@ -46,6 +127,18 @@ int main(int argc, char* argv[]){
     cmd.add<double>("kc_coverage_threshold", 0, "For each genome in the k-mer collection FASTA, report it when its coverage > kc_coverage_threshold. Default is 0.01.", false, 0.01);
     cmd.add<double>("kc_high_confidence_coverage_threshold", 0, "For each genome in the k-mer collection FASTA, report it as high confidence when its coverage > kc_high_confidence_coverage_threshold. Default is 0.9.", false, 0.9);
     cmd.add<int>("kc_high_confidence_median_hit_threshold", 0, "For each genome in the k-mer collection FASTA, report it as high confidence when its median hits > kc_high_confidence_median_hit_threshold. Default is 5.", false, 5);
+    cmd.add<double>("kc_load_factor", 0, "The k-mer collection hash table is sized to (k-mer number / kc_load_factor) slots, rounded up to a power of 2. Lower value uses more memory but makes shorter probes. Default is 0.7.", false, 0.7);
+    cmd.add<string>("shared_index_dir", 0, "directory to keep the k-mer collection and genomes indexes shared by concurrent fastv processes, i.e. /dev/shm or a hugetlbfs mount. The first process builds the index there, the others map it read-only. Disabled by default.", false, "");
+    cmd.add("verify_index", 0, "check the checksum of all the data of the mapped indexes (.kci/.kcs/.gni) when loading them, which reads the whole files. Only the headers and the small sections are checked by default.");
+    cmd.add<string>("taxonomy", 0, "a tab separated parent map (name, parent name, rank) of the k-mer collection genomes and their taxa. The k-mers shared by genomes are classified to their lowest common ancestor, and the reads are classified to genus and family. Disabled by default.", false, "");
+    cmd.add<string>("classification_out", 0, "file name to store the k-mer collection hits of every read (pair) hitting any k-mer collection: read name, genome ID, genome name, hits and taxon. Disabled by default.", false, "");
+    cmd.add<string>("depth_bedgraph", 0, "file name to store the exact per-base depth of the genomes in bedGraph format, the runs of the same depth are merged and the uncovered bases are omitted. Disabled by default.", false, "");
+    cmd.add<string>("consensus_out", 0, "file name to store the consensus sequences (FASTA) of the genomes with coverage rate >= consensus_coverage, made from the pileup of the aligned reads. Disabled by default.", false, "");
+    cmd.add<string>("variant_out", 0, "file name to store the differences of the consensus sequences to their genomes in a tab separated table. Disabled by default.", false, "");
+    cmd.add<double>("consensus_coverage", 0, "the min coverage rate of a genome to output its consensus and variants (0.0 ~ 1.0). 0.9 by default.", false, 0.9);
+    cmd.add<int>("consensus_depth", 0, "the min depth of a base to call it in the consensus, or it's N (1 ~ 100000). 10 by default.", false, 10);
+    cmd.add<string>("classification_format", 0, "format of --classification_out, tsv or binary. Default is tsv.", false, "tsv");
+    cmd.add<string>("spaced_seeds", 0, "comma separated spaced seed patterns (i.e. 1101101101101101101) to find genome mapping seeds for divergent strains, 1 means the base is compared. Use auto for built-in patterns. Disabled by default.", false, "");
 
     // reporting
     cmd.add<string>("json", 'j', "the json format report file name", false, "fastv.json");
@@ -154,16 +247,16 @@ int main(int argc, char* argv[]){
 
     string fastvProgPath = string(argv[0]);
     string fastvDir = dirname(fastvProgPath);
-    opt.kmerFile = cmd.get<string>("kmer");
-    opt.kmerCollectionFile = cmd.get<string>("kmer_collection");
+    split(cmd.get<string>("kmer"), opt.kmerFiles, ",");
+    split(cmd.get<string>("kmer_collection"), opt.kmerCollectionFiles, ",");
     opt.genomeFile = cmd.get<string>("genomes");
-    if(opt.kmerFile.empty() && opt.genomeFile.empty() && opt.kmerCollectionFile.empty()) {
+    if(opt.kmerFiles.empty() && opt.genomeFile.empty() && opt.kmerCollectionFiles.empty()) {
         cerr << endl << "SARS-CoV-2 Detection Mode..." << endl;
         cerr << "Since none of k-mer file (-k), Genomes file (-g) and k-mer_Collection file (-c) is specified, fastv will try to load SARS-CoV-2 k-mer/Genomes files from " << joinpath(fastvDir, "data") << endl;
         string kmerFile = joinpath(fastvDir, "data/SARS-CoV-2.kmer.fa");
         if(file_exists(kmerFile)) {
             cerr << "Found k-mer file: " << kmerFile << endl;
-            opt.kmerFile = kmerFile;
+            opt.kmerFiles.push_back(kmerFile);
         } else {
             cerr << "Didn't find k-mer file: " << kmerFile << endl;
         }
@@ -192,6 +285,18 @@ int main(int argc, char* argv[]){
     opt.kcCoverageThreshold = cmd.get<double>("kc_coverage_threshold");
     opt.kcCoverageHighConfidence = cmd.get<double>("kc_high_confidence_coverage_threshold");
     opt.kcMedianHitHighConfidence = cmd.get<int>("kc_high_confidence_median_hit_threshold");
+    opt.kcLoadFactor = cmd.get<double>("kc_load_factor");
+    opt.sharedIndexDir = cmd.get<string>("shared_index_dir");
+    opt.verifyIndex = cmd.exist("verify_index");
+    opt.taxonomyFile = cmd.get<string>("taxonomy");
+    opt.classificationFile = cmd.get<string>("classification_out");
+    opt.depthBedGraphFile = cmd.get<string>("depth_bedgraph");
+    opt.consensusFile = cmd.get<string>("consensus_out");
+    opt.variantFile = cmd.get<string>("variant_out");
+    opt.consensusCoverage = cmd.get<double>("consensus_coverage");
+    opt.consensusDepth = cmd.get<int>("consensus_depth");
+    opt.classificationFormat = cmd.get<string>("classification_format");
+    opt.spacedSeeds = cmd.get<string>("spaced_seeds");
 
     opt.compression = cmd.get<int>("compression");
     opt.readsToProcess = cmd.get<int>("reads_to_process");
@@ -36,6 +36,18 @@ Options::Options(){
     kcCoverageThreshold = 0.01;
     kcCoverageHighConfidence = 0.9;
     kcMedianHitHighConfidence  = 10;
+    kcLoadFactor = 0.7;
+    verifyIndex = false;
+    sharedIndexDir = "";
+    taxonomyFile = "";
+    classificationFile = "";
+    classificationFormat = "tsv";
+    depthBedGraphFile = "";
+    consensusFile = "";
+    variantFile = "";
+    consensusCoverage = 0.9;
+    consensusDepth = 10;
+    spacedSeeds = "";
 }
 
 void Options::init() {
@@ -86,6 +98,33 @@ void Options::loadFastaAdapters() {
     }
 }
 
+void Options::parseSpacedSeeds() {
+    string seeds = spacedSeeds;
+    if(seeds == "auto")
+        seeds = DEFAULT_SPACED_SEEDS;
+    spacedSeedPatterns.clear();
+    split(seeds, spacedSeedPatterns, ",");
+    if(spacedSeedPatterns.size() > 8)
+        error_exit("no more than 8 spaced seeds (--spaced_seeds) can be specified");
+    for(int i=0; i<spacedSeedPatterns.size(); i++) {
+        string pattern = ::trim(spacedSeedPatterns[i]);
+        spacedSeedPatterns[i] = pattern;
+        if(pattern.length() > 32)
+            error_exit("spaced seed (--spaced_seeds) should be no longer than 32: " + pattern);
+        if(pattern[0] != '1' || pattern[pattern.length() - 1] != '1')
+            error_exit("spaced seed (--spaced_seeds) should start and end with 1: " + pattern);
+        int weight = 0;
+        for(int p=0; p<pattern.length(); p++) {
+            if(pattern[p] == '1')
+                weight++;
+            else if(pattern[p] != '0')
+                error_exit("spaced seed (--spaced_seeds) can only have 0 and 1, but the given is: " + pattern);
+        }
+        if(weight < 12)
+            error_exit("spaced seed (--spaced_seeds) should have at least 12 bases marked as 1, suggest 16 ~ 24: " + pattern);
+    }
+}
+
 bool Options::validate() {
     if(in1.empty()) {
         if(!in2.empty())
@@ -106,15 +145,21 @@ bool Options::validate() {
         check_file_valid(genomeFile);
     }
 
-    if(!kmerFile.empty()) {
-        check_file_valid(kmerFile);
+    if(kmerFiles.size() > MAX_KMER_DATABASES)
+        error_exit("no more than " + to_string(MAX_KMER_DATABASES) + " k-mer files (-k) can be specified");
+
+    for(int i=0; i<kmerFiles.size(); i++) {
+        check_file_valid(kmerFiles[i]);
     }
 
-    if(!kmerCollectionFile.empty()) {
-        check_file_valid(kmerCollectionFile);
+    if(kmerCollectionFiles.size() > MAX_KMER_DATABASES)
+        error_exit("no more than " + to_string(MAX_KMER_DATABASES) + " k-mer collection files (-c) can be specified");
+
+    for(int i=0; i<kmerCollectionFiles.size(); i++) {
+        check_file_valid(kmerCollectionFiles[i]);
     }
 
-    if(genomeFile.empty() && kmerFile.empty() && kmerCollectionFile.empty()) {
+    if(genomeFile.empty() && kmerFiles.empty() && kmerCollectionFiles.empty()) {
         error_exit("You should at least specify one of KMER file (-k), one Genomes file (-g), or one KMER collection file (-a)"); 
     }
 
@@ -197,6 +242,40 @@ bool Options::validate() {
     if(kcMedianHitHighConfidence < 0 || kcMedianHitHighConfidence > 10000)
         error_exit("K-mer collection high confidence median hits threshold (--kc_high_confidence_median_hit_threshold) should be 0 ~ 10000, suggest 5");
 
+    if(kcLoadFactor < 0.01 || kcLoadFactor > 0.95)
+        error_exit("K-mer collection hash table load factor (--kc_load_factor) should be 0.01 ~ 0.95, suggest 0.7");
+
+    if(!sharedIndexDir.empty() && !is_directory(sharedIndexDir))
+        error_exit("The shared index directory (--shared_index_dir) is not a directory: " + sharedIndexDir);
+
+    if(!taxonomyFile.empty())
+        check_file_valid(taxonomyFile);
+
+    if(classificationFormat != "tsv" && classificationFormat != "binary")
+        error_exit("The per-read classification format (--classification_format) should be tsv or binary");
+
+    if(!depthBedGraphFile.empty() && genomeFile.empty()) {
+        cerr << "WARNING: --depth_bedgraph is ignored since no Genomes file (-g) is specified" << endl;
+        depthBedGraphFile = "";
+    }
+
+    if(needPileup() && genomeFile.empty()) {
+        cerr << "WARNING: --consensus_out and --variant_out are ignored since no Genomes file (-g) is specified" << endl;
+        consensusFile = "";
+        variantFile = "";
+    }
+
+    if(consensusCoverage < 0.0 || consensusCoverage > 1.0)
+        error_exit("The min coverage rate of a genome to make its consensus (--consensus_coverage) should be 0.0 ~ 1.0, suggest 0.9");
+
+    if(consensusDepth < 1 || consensusDepth > 100000)
+        error_exit("The min depth of a consensus base (--consensus_depth) should be 1 ~ 100000, suggest 10");
+
+    if(!classificationFile.empty() && kmerCollectionFiles.empty()) {
+        cerr << "WARNING: --classification_out is ignored since no k-mer collection file (-c) is specified" << endl;
+        classificationFile = "";
+    }
+
     if(segmentLength < 50 || segmentLength > 5000)
         error_exit("segment length for splitted long reads (--read_segment_len) should be 50 ~ 5000, suggest 100");
 
@@ -206,6 +285,12 @@ bool Options::validate() {
     if(edThreshold < 0 || edThreshold > 50)
         error_exit("edit distance threshold (-E) should be 0 ~ 50, suggest 8");
 
+    if(!spacedSeeds.empty()) {
+        parseSpacedSeeds();
+        if(genomeFile.empty())
+            cerr << "WARNING: spaced seeds (--spaced_seeds) are only used for genome mapping, but no Genomes file (-g) is specified" << endl;
+    }
+
     if(trim.front1 < 0 || trim.front1 > 30)
         error_exit("trim_front1 (--trim_front1) should be 0 ~ 30, suggest 0 ~ 4");
 
@@ -17,6 +17,13 @@ using namespace std;
 #define UMI_LOC_PER_INDEX 5
 #define UMI_LOC_PER_READ 6
 
+// how many k-mer files (-k) or k-mer collection files (-c) can be scanned together
+#define MAX_KMER_DATABASES 16
+
+// the spaced seeds used by --spaced_seeds=auto
+// the first one skips the 3rd base of every codon, where most synonymous mutations happen
+#define DEFAULT_SPACED_SEEDS "11011011011011011011011011011,1110100111010011101001110100111"
+
 class DuplicationOptions {
 public:
     DuplicationOptions() {
@@ -221,6 +228,9 @@ public:
     void init();
     bool isPaired();
     bool validate();
+    // splits spacedSeeds to spacedSeedPatterns, and checks every pattern
+    void parseSpacedSeeds();
+    bool needPileup() {return !consensusFile.empty() || !variantFile.empty();}
     bool adapterCuttingEnabled();
     bool polyXTrimmingEnabled();
     string getAdapter1();
@@ -239,10 +249,10 @@ public:
     string out2;
     // genome FASTA file
     string genomeFile;
-    // kmer FASTA file
-    string kmerFile;
-    // kmer FASTA file
-    string kmerCollectionFile;
+    // kmer FASTA files
+    vector<string> kmerFiles;
+    // kmer collection FASTA files
+    vector<string> kmerCollectionFiles;
     // json file
     string jsonFile;
     // html file
@@ -297,7 +307,8 @@ public:
     int overlapDiffPercentLimit;
     // output debug information
     bool verbose;
-    // the length of KMER, default is 25
+    // the seed length used to map reads to genomes, taken from the first KMER or k-mer collection file, default is 25
+    // every KMER and k-mer collection file keeps its own length
     int kmerKeyLen;
     // the threshold of positive result
     double positiveThreshold;
@@ -317,6 +328,29 @@ public:
     double kcCoverageHighConfidence;
     // median hit for high-confidence KCR
     double kcMedianHitHighConfidence;
+    // the max k-mers / slots of the k-mer collection hash table
+    double kcLoadFactor;
+    // the directory (i.e. /dev/shm or a hugetlbfs mount) to keep the k-mer collection indexes shared by processes
+    string sharedIndexDir;
+    // check all the data of the mapped indexes when loading them, not only their headers and small sections
+    bool verifyIndex;
+    // the parent map to classify the reads by the LCA of the genomes sharing a k-mer
+    string taxonomyFile;
+    // the per-read k-mer collection hits, for downstream assembly and QC
+    string classificationFile;
+    // the exact per-base depth of the genomes in bedGraph, which is only tracked if it's specified
+    string depthBedGraphFile;
+    // the consensus sequences and their differences to the genomes, the pileup is only tracked if any of them is specified
+    string consensusFile;
+    string variantFile;
+    // the min coverage rate of a genome to make its consensus, and the min depth of a base to call it, or it's N
+    double consensusCoverage;
+    int consensusDepth;
+    // tsv or binary
+    string classificationFormat;
+    // spaced seed patterns for genome mapping, comma separated, or auto
+    string spacedSeeds;
+    vector<string> spacedSeedPatterns;
 
 };
 
@@ -28,6 +28,7 @@ PairEndProcessor::PairEndProcessor(Options* opt){
     memset(mInsertSizeHist, 0, sizeof(long)*isizeBufLen);
     mLeftWriter =  NULL;
     mRightWriter = NULL;
+    mClassificationWriter = NULL;
 
     mDuplicate = NULL;
     if(mOptions->duplicate.enabled) {
@@ -50,6 +51,13 @@ PairEndProcessor::~PairEndProcessor() {
 }
 
 void PairEndProcessor::initOutput() {
+    if(!mOptions->classificationFile.empty()) {
+        mClassificationWriter = new WriterThread(mOptions, mOptions->classificationFile);
+        string header = mVirusDetector->classificationHeader();
+        char* data = new char[header.size()];
+        memcpy(data, header.c_str(), header.size());
+        mClassificationWriter->input(data, header.size());
+    }
     if(mOptions->out1.empty())
         return;
     
@@ -67,6 +75,10 @@ void PairEndProcessor::closeOutput() {
         delete mRightWriter;
         mRightWriter = NULL;
     }
+    if(mClassificationWriter) {
+        delete mClassificationWriter;
+        mClassificationWriter = NULL;
+    }
 }
 
 void PairEndProcessor::initConfig(ThreadConfig* config) {
@@ -100,6 +112,9 @@ bool PairEndProcessor::process(){
         leftWriterThread = new std::thread(std::bind(&PairEndProcessor::writeTask, this, mLeftWriter));
     if(mRightWriter)
         rightWriterThread = new std::thread(std::bind(&PairEndProcessor::writeTask, this, mRightWriter));
+    std::thread* classificationWriterThread = NULL;
+    if(mClassificationWriter)
+        classificationWriterThread = new std::thread(std::bind(&PairEndProcessor::writeTask, this, mClassificationWriter));
 
     producer.join();
     for(int t=0; t<mOptions->thread; t++){
@@ -110,6 +125,8 @@ bool PairEndProcessor::process(){
         leftWriterThread->join();
     if(rightWriterThread)
         rightWriterThread->join();
+    if(classificationWriterThread)
+        classificationWriterThread->join();
 
     if(mOptions->verbose)
         loginfo("start to generate reports\n");
@@ -192,6 +209,8 @@ bool PairEndProcessor::process(){
         delete leftWriterThread;
     if(rightWriterThread)
         delete rightWriterThread;
+    if(classificationWriterThread)
+        delete classificationWriterThread;
 
     closeOutput();
 
@@ -214,6 +233,9 @@ bool PairEndProcessor::processPairEnd(ReadPairPack* pack, ThreadConfig* config){
     string outstr1;
     string outstr2;
     string singleOutput;
+    string classification;
+    ReadHits hits(config->getThreadId());
+    int kcNum = mVirusDetector->getKmerCollections().size();
     int readPassed = 0;
     int mergedCount = 0;
     for(int p=0;p<pack->count;p++){
@@ -303,8 +325,12 @@ bool PairEndProcessor::processPairEnd(ReadPairPack* pack, ThreadConfig* config){
         if( r1 != NULL &&  result1 == PASS_FILTER && r2 != NULL && result2 == PASS_FILTER ) {
 
             bool found = false;
-            found |= mVirusDetector->detect(r1);
-            found |= mVirusDetector->detect(r2);
+            hits.reset(kcNum);
+            found |= mVirusDetector->detect(r1, &hits);
+            found |= mVirusDetector->detect(r2, &hits);
+            mVirusDetector->addReadHits(hits);
+            if(mClassificationWriter)
+                mVirusDetector->appendClassification(r1->mName, hits, classification);
             
             if(found) {
                 if(mOptions->outputToSTDOUT) {
@@ -331,6 +357,8 @@ bool PairEndProcessor::processPairEnd(ReadPairPack* pack, ThreadConfig* config){
             delete r2;
     }
 
+    mVirusDetector->flushReadHits(hits);
+
     // normal output by left/right writer thread
     if(mRightWriter && mLeftWriter && (!outstr1.empty() || !outstr2.empty())) {
         // write PE
@@ -347,6 +375,11 @@ bool PairEndProcessor::processPairEnd(ReadPairPack* pack, ThreadConfig* config){
         memcpy(ldata, singleOutput.c_str(), singleOutput.size());
         mLeftWriter->input(ldata, singleOutput.size());
     }
+    if(mClassificationWriter && !classification.empty()) {
+        char* cdata = new char[classification.size()];
+        memcpy(cdata, classification.c_str(), classification.size());
+        mClassificationWriter->input(cdata, classification.size());
+    }
 
     mOutputMtx.unlock();
 
@@ -500,8 +533,8 @@ void PairEndProcessor::producerTask()
             readNum += count;
             // if the writer threads are far behind this producer, sleep and wait
             // check this only when necessary
-            if(readNum % (PACK_SIZE * PACK_IN_MEM_LIMIT) == 0 && mLeftWriter) {
-                while( (mLeftWriter && mLeftWriter->bufferLength() > PACK_IN_MEM_LIMIT) || (mRightWriter && mRightWriter->bufferLength() > PACK_IN_MEM_LIMIT) ){
+            if(readNum % (PACK_SIZE * PACK_IN_MEM_LIMIT) == 0 && (mLeftWriter || mClassificationWriter)) {
+                while( (mLeftWriter && mLeftWriter->bufferLength() > PACK_IN_MEM_LIMIT) || (mRightWriter && mRightWriter->bufferLength() > PACK_IN_MEM_LIMIT) || (mClassificationWriter && mClassificationWriter->bufferLength() > PACK_IN_MEM_LIMIT) ){
                     slept++;
                     usleep(1000);
                 }
@@ -576,6 +609,8 @@ void PairEndProcessor::consumerTask(ThreadConfig* config)
             mLeftWriter->setInputCompleted();
         if(mRightWriter)
             mRightWriter->setInputCompleted();
+        if(mClassificationWriter)
+            mClassificationWriter->setInputCompleted();
     }
     
     if(mOptions->verbose) {
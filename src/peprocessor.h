@@ -78,6 +78,8 @@ private:
     long* mInsertSizeHist;
     WriterThread* mLeftWriter;
     WriterThread* mRightWriter;
+    // the per-read classification output, fed by the per-pack buffers of the worker threads
+    WriterThread* mClassificationWriter;
     Duplicate* mDuplicate;
     VirusDetector* mVirusDetector;
 };
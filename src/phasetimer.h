@@ -0,0 +1,58 @@
+#ifndef PHASE_TIMER_H
+#define PHASE_TIMER_H
+
+// includes
+#include <string>
+#include <vector>
+#include <chrono>
+
+using namespace std;
+
+// the wall time spent in each phase of a procedure, a phase entered again accumulates
+class PhaseTimer
+{
+public:
+    PhaseTimer() {
+        mStart = chrono::steady_clock::now();
+    }
+
+    // start timing from now, without closing a phase
+    void restart() {
+        mStart = chrono::steady_clock::now();
+    }
+
+    // close the current phase and start the next one
+    void lap(string phase) {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        double sec = chrono::duration<double>(now - mStart).count();
+        mStart = now;
+        for(int i=0; i<mPhases.size(); i++) {
+            if(mPhases[i].first == phase) {
+                mPhases[i].second += sec;
+                return;
+            }
+        }
+        mPhases.push_back(make_pair(phase, sec));
+    }
+
+    vector<pair<string, double>>& phases() {
+        return mPhases;
+    }
+
+    // like "parse 0.12s, insert 0.05s"
+    string summary() {
+        string s;
+        for(int i=0; i<mPhases.size(); i++) {
+            if(i > 0)
+                s += ", ";
+            s += mPhases[i].first + " " + to_string(mPhases[i].second) + "s";
+        }
+        return s;
+    }
+
+private:
+    chrono::steady_clock::time_point mStart;
+    vector<pair<string, double>> mPhases;
+};
+
+#endif
@@ -20,6 +20,7 @@ SingleEndProcessor::SingleEndProcessor(Options* opt){
     mZipFile = NULL;
     mUmiProcessor = new UmiProcessor(opt);
     mLeftWriter =  NULL;
+    mClassificationWriter = NULL;
 
     mDuplicate = NULL;
     if(mOptions->duplicate.enabled) {
@@ -42,6 +43,13 @@ SingleEndProcessor::~SingleEndProcessor() {
 }
 
 void SingleEndProcessor::initOutput() {
+    if(!mOptions->classificationFile.empty()) {
+        mClassificationWriter = new WriterThread(mOptions, mOptions->classificationFile);
+        string header = mVirusDetector->classificationHeader();
+        char* data = new char[header.size()];
+        memcpy(data, header.c_str(), header.size());
+        mClassificationWriter->input(data, header.size());
+    }
     if(mOptions->out1.empty())
         return;
     mLeftWriter = new WriterThread(mOptions, mOptions->out1);
@@ -52,6 +60,10 @@ void SingleEndProcessor::closeOutput() {
         delete mLeftWriter;
         mLeftWriter = NULL;
     }
+    if(mClassificationWriter) {
+        delete mClassificationWriter;
+        mClassificationWriter = NULL;
+    }
 }
 
 void SingleEndProcessor::initConfig(ThreadConfig* config) {
@@ -81,6 +93,9 @@ bool SingleEndProcessor::process(){
     std::thread* leftWriterThread = NULL;
     if(mLeftWriter)
         leftWriterThread = new std::thread(std::bind(&SingleEndProcessor::writeTask, this, mLeftWriter));
+    std::thread* classificationWriterThread = NULL;
+    if(mClassificationWriter)
+        classificationWriterThread = new std::thread(std::bind(&SingleEndProcessor::writeTask, this, mClassificationWriter));
 
     producer.join();
     for(int t=0; t<mOptions->thread; t++){
@@ -89,6 +104,8 @@ bool SingleEndProcessor::process(){
 
     if(leftWriterThread)
         leftWriterThread->join();
+    if(classificationWriterThread)
+        classificationWriterThread->join();
 
     if(mOptions->verbose)
         loginfo("start to generate reports\n");
@@ -160,6 +177,8 @@ bool SingleEndProcessor::process(){
 
     if(leftWriterThread)
         delete leftWriterThread;
+    if(classificationWriterThread)
+        delete classificationWriterThread;
 
     closeOutput();
 
@@ -168,6 +187,9 @@ bool SingleEndProcessor::process(){
 
 bool SingleEndProcessor::processSingleEnd(ReadPack* pack, ThreadConfig* config){
     string outstr;
+    string classification;
+    ReadHits hits(config->getThreadId());
+    int kcNum = mVirusDetector->getKmerCollections().size();
     string failedOut;
     int readPassed = 0;
     for(int p=0;p<pack->count;p++){
@@ -221,7 +243,11 @@ bool SingleEndProcessor::processSingleEnd(ReadPack* pack, ThreadConfig* config){
 
         if( r1 != NULL &&  result == PASS_FILTER) {
 
-            bool found = mVirusDetector->detect(r1);
+            hits.reset(kcNum);
+            bool found = mVirusDetector->detect(r1, &hits);
+            mVirusDetector->addReadHits(hits);
+            if(mClassificationWriter)
+                mVirusDetector->appendClassification(r1->mName, hits, classification);
 
             if(found)
                 outstr += r1->toString();
@@ -236,6 +262,8 @@ bool SingleEndProcessor::processSingleEnd(ReadPack* pack, ThreadConfig* config){
         if(r1 != or1 && r1 != NULL)
             delete r1;
     }
+    mVirusDetector->flushReadHits(hits);
+
     // if splitting output, then no lock is need since different threads write different files
     mOutputMtx.lock();
     if(mOptions->outputToSTDOUT) {
@@ -247,6 +275,11 @@ bool SingleEndProcessor::processSingleEnd(ReadPack* pack, ThreadConfig* config){
         memcpy(ldata, outstr.c_str(), outstr.size());
         mLeftWriter->input(ldata, outstr.size());
     }
+    if(mClassificationWriter && !classification.empty()) {
+        char* cdata = new char[classification.size()];
+        memcpy(cdata, classification.c_str(), classification.size());
+        mClassificationWriter->input(cdata, classification.size());
+    }
     mOutputMtx.unlock();
 
     config->markProcessed(pack->count);
@@ -380,8 +413,8 @@ void SingleEndProcessor::producerTask()
             readNum += count;
             // if the writer threads are far behind this producer, sleep and wait
             // check this only when necessary
-            if(readNum % (PACK_SIZE * PACK_IN_MEM_LIMIT) == 0 && mLeftWriter) {
-                while(mLeftWriter->bufferLength() > PACK_IN_MEM_LIMIT) {
+            if(readNum % (PACK_SIZE * PACK_IN_MEM_LIMIT) == 0 && (mLeftWriter || mClassificationWriter)) {
+                while( (mLeftWriter && mLeftWriter->bufferLength() > PACK_IN_MEM_LIMIT) || (mClassificationWriter && mClassificationWriter->bufferLength() > PACK_IN_MEM_LIMIT) ) {
                     slept++;
                     usleep(1000);
                 }
@@ -454,6 +487,8 @@ void SingleEndProcessor::consumerTask(ThreadConfig* config)
     if(mFinishedThreads == mOptions->thread) {
         if(mLeftWriter)
             mLeftWriter->setInputCompleted();
+        if(mClassificationWriter)
+            mClassificationWriter->setInputCompleted();
     }
 
     if(mOptions->verbose) {
@@ -69,6 +69,8 @@ private:
     ofstream* mOutStream;
     UmiProcessor* mUmiProcessor;
     WriterThread* mLeftWriter;
+    // the per-read classification output, fed by the per-pack buffers of the worker threads
+    WriterThread* mClassificationWriter;
     Duplicate* mDuplicate;
     VirusDetector* mVirusDetector;
 };
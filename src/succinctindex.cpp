@@ -0,0 +1,357 @@
+#include "succinctindex.h"
+#include "kmercollection.h"
+#include "util.h"
+#include <string.h>
+#include <algorithm>
+
+SuccinctIndex::SuccinctIndex() {
+    mHeader = NULL;
+    mHigh = NULL;
+    mLow = NULL;
+    mIds = NULL;
+    mSamples = NULL;
+    mBytes = 0;
+}
+
+static inline uint64 wordsOf(uint64 bits) {
+    return (bits + 63) / 64;
+}
+
+static inline int bitsOf(uint128 value) {
+    int bits = 0;
+    while(value > 0) {
+        bits++;
+        value >>= 1;
+    }
+    return bits;
+}
+
+static inline void writeBits(vector<uint64>& words, uint64 index, uint64 width, uint64 value) {
+    if(width == 0)
+        return;
+    uint64 bit = index * width;
+    uint64 word = bit >> 6;
+    uint64 offset = bit & 63;
+    words[word] |= value << offset;
+    if(offset + width > 64)
+        words[word + 1] |= value >> (64 - offset);
+}
+
+inline uint64 SuccinctIndex::readBits(const uint64* words, uint64 index, uint64 width) {
+    if(width == 0)
+        return 0;
+    uint64 bit = index * width;
+    uint64 word = bit >> 6;
+    uint64 offset = bit & 63;
+    uint64 value = words[word] >> offset;
+    if(offset + width > 64)
+        value |= words[word + 1] << (64 - offset);
+    return value & ((1UL << width) - 1);
+}
+
+int SuccinctIndex::minimizerLen(int keyLen) {
+    return min(16, (keyLen + 1) / 2);
+}
+
+// (minimizer * (k - m + 1) + position) * 4^(k-m) + the other bases, which can be decoded back to the key
+uint128 SuccinctIndex::encode(uint64 key, int keyLen, int minimizerLen) {
+    int positions = keyLen - minimizerLen + 1;
+    uint64 mmask = (1UL << (2 * minimizerLen)) - 1;
+    // a random order of the m-mers (m <= 16) without ties between different ones, and the leftmost of the same ones
+    uint64 bestOrder = ~0UL;
+    for(int p=0; p<positions; p++) {
+        uint32 mmer = (key >> (2 * (positions - 1 - p))) & mmask;
+        uint64 order = ((uint64)(uint32)(mmer * 0x9E3779B9U) << 8) | p;
+        bestOrder = min(bestOrder, order);
+    }
+    int bestPos = bestOrder & 0xFF;
+    int rightBases = positions - 1 - bestPos;
+    uint64 best = (key >> (2 * rightBases)) & mmask;
+    uint64 left = bestPos == 0 ? 0 : key >> (2 * (keyLen - bestPos));
+    uint64 right = rightBases == 0 ? 0 : key & ((1UL << (2 * rightBases)) - 1);
+    uint64 rest = (left << (2 * rightBases)) | right;
+    return (((uint128)best * positions + bestPos) << (2 * (keyLen - minimizerLen))) | rest;
+}
+
+string SuccinctIndex::build(vector<uint64>& keys, vector<uint32>& ids, int keyLen, uint32 genomeNum, int threads) {
+    if(keyLen > 32)
+        error_exit("The succinct k-mer collection index supports k <= 32 only");
+    int mlen = minimizerLen(keyLen);
+    uint64 n = keys.size();
+
+    // the IDs are packed as 1 ~ genomeNum for genomes, and genomeNum + 1 + set for the genome sets
+    uint32 maxId = 0;
+    vector<pair<uint128, uint32>> values(n);
+    run_in_threads(threads, [&](int t) {
+        uint64 end = n * (t + 1) / threads;
+        for(uint64 i = n * t / threads; i < end; i++) {
+            uint32 id = ids[i];
+            if(id & KC_SET_BIT)
+                id = genomeNum + 1 + (id & ~KC_SET_BIT);
+            values[i] = make_pair(encode(keys[i], keyLen, mlen), id);
+        }
+    });
+    for(uint64 i=0; i<n; i++)
+        maxId = max(maxId, values[i].second);
+
+    // sorted by every thread, then merged
+    vector<uint64> bounds;
+    for(int t=0; t<=threads; t++)
+        bounds.push_back(n * t / threads);
+    run_in_threads(threads, [&](int t) {
+        sort(values.begin() + bounds[t], values.begin() + bounds[t+1]);
+    });
+    for(int width=1; width<threads; width *= 2) {
+        for(int t=0; t + width < threads; t += 2 * width) {
+            int last = min(t + 2 * width, threads);
+            inplace_merge(values.begin() + bounds[t], values.begin() + bounds[t + width], values.begin() + bounds[last]);
+        }
+    }
+
+    uint128 universe = ((uint128)1 << (2 * keyLen)) * (keyLen - mlen + 1);
+    // Elias-Fano: the low bits are stored as they are, and the high bits in unary
+    int lowBits = n == 0 ? 0 : max(0, bitsOf(universe / n) - 1);
+    lowBits = min(lowBits, 56);
+    uint64 maxHigh = (uint64)(universe >> lowBits);
+
+    SuccinctHeader header;
+    memset(&header, 0, sizeof(SuccinctHeader));
+    header.mVersion = SI_VERSION;
+    header.mKeyLen = keyLen;
+    header.mMinimizerLen = mlen;
+    header.mKmerNum = n;
+    header.mGenomeNum = genomeNum;
+    header.mLowBits = lowBits;
+    header.mIdBits = bitsOf(maxId);
+    header.mHighBitNum = n + maxHigh + 1;
+
+    vector<uint64> high(wordsOf(header.mHighBitNum), 0);
+    vector<uint64> low(wordsOf(n * header.mLowBits) + 1, 0);
+    vector<uint64> packedIds(wordsOf(n * header.mIdBits) + 1, 0);
+    uint64 lowMask = lowBits == 0 ? 0 : (1UL << lowBits) - 1;
+    for(uint64 i=0; i<n; i++) {
+        uint128 value = values[i].first;
+        if(i > 0 && value == values[i-1].first)
+            error_exit("Duplicated k-mers cannot be added to the succinct k-mer collection index");
+        uint64 h = (uint64)(value >> lowBits) + i;
+        high[h >> 6] |= 1UL << (h & 63);
+        writeBits(low, i, lowBits, (uint64)value & lowMask);
+        writeBits(packedIds, i, header.mIdBits, values[i].second);
+    }
+
+    vector<uint64> samples;
+    uint64 zeros = 0;
+    for(uint64 b=0; b<header.mHighBitNum; b++) {
+        if(high[b >> 6] & (1UL << (b & 63)))
+            continue;
+        if(zeros % SI_SELECT_SAMPLE == 0)
+            samples.push_back(b);
+        zeros++;
+    }
+    header.mSampleNum = samples.size();
+
+    string data;
+    data.append((const char*)&header, sizeof(SuccinctHeader));
+    data.append((const char*)high.data(), high.size() * sizeof(uint64));
+    data.append((const char*)low.data(), low.size() * sizeof(uint64));
+    data.append((const char*)packedIds.data(), packedIds.size() * sizeof(uint64));
+    data.append((const char*)samples.data(), samples.size() * sizeof(uint64));
+    return data;
+}
+
+bool SuccinctIndex::attach(const char* data, uint64 bytes) {
+    if(bytes < sizeof(SuccinctHeader))
+        return false;
+    const SuccinctHeader* header = (const SuccinctHeader*)data;
+    if(header->mVersion != SI_VERSION || header->mKeyLen == 0 || header->mKeyLen > 32)
+        return false;
+    if(header->mMinimizerLen != minimizerLen(header->mKeyLen) || header->mLowBits > 56 || header->mIdBits > 32)
+        return false;
+    uint64 highWords = wordsOf(header->mHighBitNum);
+    uint64 lowWords = wordsOf(header->mKmerNum * header->mLowBits) + 1;
+    uint64 idWords = wordsOf(header->mKmerNum * header->mIdBits) + 1;
+    uint64 expected = sizeof(SuccinctHeader) + (highWords + lowWords + idWords + header->mSampleNum) * sizeof(uint64);
+    if(expected != bytes || header->mKmerNum >= header->mHighBitNum)
+        return false;
+    uint64 zeros = header->mHighBitNum - header->mKmerNum;
+    if(header->mSampleNum != (zeros + SI_SELECT_SAMPLE - 1) / SI_SELECT_SAMPLE)
+        return false;
+
+    mHeader = header;
+    mHigh = (const uint64*)(data + sizeof(SuccinctHeader));
+    mLow = mHigh + highWords;
+    mIds = mLow + lowWords;
+    mSamples = mIds + idWords;
+    mBytes = bytes;
+    return true;
+}
+
+// the set bits of every byte, accumulated from the lowest byte, so that the highest byte is the popcount
+// broadword, since __builtin_popcountll() is a library call without -mpopcnt
+static inline uint64 bytePrefixCounts(uint64 word) {
+    uint64 s = word - ((word >> 1) & 0x5555555555555555UL);
+    s = (s & 0x3333333333333333UL) + ((s >> 2) & 0x3333333333333333UL);
+    return ((s + (s >> 4)) & 0x0F0F0F0F0F0F0F0FUL) * 0x0101010101010101UL;
+}
+
+static inline uint64 popcount64(uint64 word) {
+    return bytePrefixCounts(word) >> 56;
+}
+
+// the position of the r-th (0-based) set bit of word
+static inline uint64 selectInWord(uint64 word, uint64 r) {
+    uint64 counts = bytePrefixCounts(word);
+    uint64 shift = 0;
+    while(((counts >> shift) & 0xFF) <= r)
+        shift += 8;
+    if(shift > 0)
+        r -= (counts >> (shift - 8)) & 0xFF;
+    word >>= shift;
+    for(uint64 i=0; i<r; i++)
+        word &= word - 1;
+    return shift + __builtin_ctzll(word);
+}
+
+// the position of the zero with this rank in the high bits
+uint64 SuccinctIndex::selectZero(uint64 rank) {
+    uint64 pos = mSamples[rank / SI_SELECT_SAMPLE];
+    uint64 remaining = rank % SI_SELECT_SAMPLE;
+    uint64 word = pos >> 6;
+    // the zeros of the first word before pos are not counted
+    uint64 zeros = ~mHigh[word] & (~0UL << (pos & 63));
+    while(true) {
+        uint64 count = popcount64(zeros);
+        if(remaining < count)
+            break;
+        remaining -= count;
+        word++;
+        zeros = ~mHigh[word];
+    }
+    return (word << 6) + selectInWord(zeros, remaining);
+}
+
+// the ranks [begin, end) of the values sharing the high bits of value
+void SuccinctIndex::locate(uint128 value, uint64& begin, uint64& end, uint64& low) {
+    uint64 h = (uint64)(value >> mHeader->mLowBits);
+    low = mHeader->mLowBits == 0 ? 0 : (uint64)value & ((1UL << mHeader->mLowBits) - 1);
+    if(h >= mHeader->mHighBitNum - mHeader->mKmerNum) {
+        begin = end = 0;
+        return;
+    }
+    // the ones between the (h-1)-th and the h-th zero
+    uint64 endZero = selectZero(h);
+    end = endZero - h;
+    if(h == 0) {
+        begin = 0;
+    } else {
+        uint64 startZero = endZero;
+        // usually in the same word
+        do {
+            startZero--;
+        } while(mHigh[startZero >> 6] & (1UL << (startZero & 63)));
+        begin = startZero + 1 - h;
+    }
+}
+
+uint32 SuccinctIndex::match(uint64 begin, uint64 end, uint64 low, uint64& pos) {
+    for(uint64 i=begin; i<end; i++) {
+        uint64 l = readBits(mLow, i, mHeader->mLowBits);
+        if(l < low)
+            continue;
+        if(l > low)
+            break;
+        pos = i;
+        return getId(i);
+    }
+    return 0;
+}
+
+uint32 SuccinctIndex::getId(uint64 pos) {
+    uint32 id = readBits(mIds, pos, mHeader->mIdBits);
+    if(id > mHeader->mGenomeNum)
+        id = (id - mHeader->mGenomeNum - 1) | KC_SET_BIT;
+    return id;
+}
+
+uint32 SuccinctIndex::find(uint64 key, uint64& pos) {
+    uint64 begin, end, low;
+    locate(encode(key, mHeader->mKeyLen, mHeader->mMinimizerLen), begin, end, low);
+    return match(begin, end, low, pos);
+}
+
+void SuccinctIndex::findBatch(const uint64* keys, int n, uint32* ids, uint64* positions) {
+    uint64 begins[SI_BATCH_SIZE];
+    uint64 ends[SI_BATCH_SIZE];
+    uint64 lows[SI_BATCH_SIZE];
+    for(int start=0; start<n; start+=SI_BATCH_SIZE) {
+        int count = min(n - start, SI_BATCH_SIZE);
+        // the select0 samples of all the keys are fetched together, then the high bits, then the low bits
+        uint128 values[SI_BATCH_SIZE];
+        for(int i=0; i<count; i++) {
+            values[i] = encode(keys[start + i], mHeader->mKeyLen, mHeader->mMinimizerLen);
+            uint64 h = (uint64)(values[i] >> mHeader->mLowBits);
+            __builtin_prefetch(mSamples + min(h, mHeader->mHighBitNum - mHeader->mKmerNum - 1) / SI_SELECT_SAMPLE);
+        }
+        for(int i=0; i<count; i++) {
+            locate(values[i], begins[i], ends[i], lows[i]);
+            if(begins[i] < ends[i]) {
+                __builtin_prefetch(mLow + begins[i] * mHeader->mLowBits / 64);
+                __builtin_prefetch(mIds + begins[i] * mHeader->mIdBits / 64);
+            }
+        }
+        for(int i=0; i<count; i++)
+            ids[start + i] = match(begins[i], ends[i], lows[i], positions[start + i]);
+    }
+}
+
+bool SuccinctIndex::test() {
+    // every key of k = 21 and k = 32 is found with its ID, and the others are not
+    for(int keyLen = 21; keyLen <= 32; keyLen += 11) {
+        vector<uint64> keys;
+        uint64 x = 88172645463325252UL;
+        uint64 mask = keyLen == 32 ? ~0UL : (1UL << (2 * keyLen)) - 1;
+        for(int i=0; i<20000; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            keys.push_back(x & mask);
+        }
+        // the k-mers of a sequence share minimizers
+        for(int i=0; i<1000; i++)
+            keys.push_back(((keys[0] << (2 * (i % 30 + 1))) | (i % 4)) & mask);
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+        vector<uint32> ids;
+        for(int i=0; i<keys.size(); i++) {
+            // a few LCA taxa
+            ids.push_back(i % 10 == 0 ? (KC_SET_BIT | (i % 7)) : 1 + i % 100);
+        }
+
+        for(int threads=1; threads<=3; threads+=2) {
+            string data = build(keys, ids, keyLen, 100, threads);
+            // attach() needs 8-byte aligned data
+            vector<uint64> aligned(data.size() / 8);
+            memcpy(aligned.data(), data.data(), data.size());
+            SuccinctIndex index;
+            if(!index.attach((const char*)aligned.data(), data.size()) || index.size() != keys.size())
+                return false;
+
+            vector<uint32> found(keys.size());
+            vector<uint64> positions(keys.size());
+            index.findBatch(keys.data(), keys.size(), found.data(), positions.data());
+            vector<bool> used(keys.size(), false);
+            for(int i=0; i<keys.size(); i++) {
+                uint64 pos = 0;
+                if(index.find(keys[i], pos) != ids[i] || found[i] != ids[i] || positions[i] != pos)
+                    return false;
+                if(pos >= keys.size() || used[pos] || index.getId(pos) != ids[i])
+                    return false;
+                used[pos] = true;
+                uint64 other = (keys[i] ^ 0x5) & mask;
+                if(!binary_search(keys.begin(), keys.end(), other) && index.find(other, pos) != 0)
+                    return false;
+            }
+        }
+    }
+    return true;
+}
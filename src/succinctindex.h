@@ -0,0 +1,74 @@
+#ifndef SUCCINCT_INDEX_H
+#define SUCCINCT_INDEX_H
+
+// includes
+#include <string>
+#include <vector>
+#include "common.h"
+
+using namespace std;
+
+// the k-mers sharing a minimizer are looked up in a batch of this size
+#define SI_BATCH_SIZE 64
+// a select0 sample is kept for every SI_SELECT_SAMPLE zeros of the high bits
+#define SI_SELECT_SAMPLE 64
+#define SI_VERSION 1
+
+// the fields of a serialized succinct index, followed by the high bits, the low bits,
+// the IDs and the select0 samples, all in 64-bit words
+class SuccinctHeader {
+public:
+    uint64 mVersion;
+    uint64 mKeyLen;
+    uint64 mMinimizerLen;
+    uint64 mKmerNum;
+    uint64 mGenomeNum;
+    uint64 mLowBits;
+    uint64 mIdBits;
+    uint64 mHighBitNum;
+    uint64 mSampleNum;
+};
+
+// a static map of k-mers (k <= 32) to IDs in about log2(U/n) + 2 + log2(IDs) bits per k-mer.
+// a k-mer is split to its minimizer, the minimizer position and the other bases, which make a number
+// sorted by the minimizer first, so that the k-mers of a read sharing a minimizer are stored together.
+// these numbers are stored with Elias-Fano coding, and the IDs are packed in the same order.
+class SuccinctIndex
+{
+public:
+    SuccinctIndex();
+
+    // keys and ids are in the same order, keys must be unique
+    // ids are genome IDs (1 ~ genomeNum) or genome sets with KC_SET_BIT
+    static string build(vector<uint64>& keys, vector<uint32>& ids, int keyLen, uint32 genomeNum, int threads);
+    // data must be 8-byte aligned and kept until this index is destroyed
+    bool attach(const char* data, uint64 bytes);
+
+    // the ID of the key, or 0 if not found, pos is set to its rank if found
+    uint32 find(uint64 key, uint64& pos);
+    // looks up n keys together to overlap their memory accesses
+    void findBatch(const uint64* keys, int n, uint32* ids, uint64* positions);
+    uint64 size() {return mHeader ? mHeader->mKmerNum : 0;}
+    uint32 getId(uint64 pos);
+    uint64 getBytes() {return mBytes;}
+
+    static bool test();
+
+private:
+    static uint128 encode(uint64 key, int keyLen, int minimizerLen);
+    static int minimizerLen(int keyLen);
+    uint64 selectZero(uint64 rank);
+    inline uint64 readBits(const uint64* words, uint64 index, uint64 width);
+    void locate(uint128 value, uint64& begin, uint64& end, uint64& low);
+    uint32 match(uint64 begin, uint64 end, uint64 low, uint64& pos);
+
+private:
+    const SuccinctHeader* mHeader;
+    const uint64* mHigh;
+    const uint64* mLow;
+    const uint64* mIds;
+    const uint64* mSamples;
+    uint64 mBytes;
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "taxonomy.h"
+#include "util.h"
+#include <fstream>
+
+Taxonomy::Taxonomy() {
+}
+
+void Taxonomy::load(string filename) {
+    ifstream file(filename.c_str());
+    if(!file.is_open())
+        error_exit("Failed to open the taxonomy file: " + filename);
+
+    string line;
+    int lineNo = 0;
+    while(getline(file, line)) {
+        lineNo++;
+        if(!line.empty() && line[line.length()-1] == '\r')
+            line.resize(line.length() - 1);
+        if(line.empty() || line[0] == '#')
+            continue;
+        vector<string> fields;
+        split(line, fields, "\t");
+        if(fields.size() < 2)
+            error_exit("The taxonomy file should have at least 2 tab separated columns (name, parent), line " + to_string(lineNo) + ": " + filename);
+        string name = ::trim(fields[0]);
+        string parentName = ::trim(fields[1]);
+        if(name.empty())
+            error_exit("Empty taxon name at line " + to_string(lineNo) + ": " + filename);
+        int taxon = addTaxon(name);
+        if(fields.size() >= 3)
+            setRank(taxon, ::trim(fields[2]));
+        if(!parentName.empty() && parentName != "-" && parentName != name)
+            setParent(taxon, addTaxon(parentName));
+    }
+
+    if(mNames.empty())
+        error_exit("No taxon found in: " + filename);
+    initDepths();
+}
+
+int Taxonomy::addTaxon(string name) {
+    unordered_map<string, int>::iterator iter = mIndex.find(name);
+    if(iter != mIndex.end())
+        return iter->second;
+    int taxon = mNames.size();
+    mNames.push_back(name);
+    mRanks.push_back("");
+    mParents.push_back(-1);
+    mIndex[name] = taxon;
+    return taxon;
+}
+
+void Taxonomy::setParent(int taxon, int parent) {
+    if(mParents[taxon] >= 0 && mParents[taxon] != parent)
+        error_exit("The taxon " + mNames[taxon] + " has two parents: " + mNames[mParents[taxon]] + " and " + mNames[parent]);
+    mParents[taxon] = parent;
+}
+
+void Taxonomy::setRank(int taxon, string rank) {
+    str2lower(rank);
+    mRanks[taxon] = rank;
+}
+
+void Taxonomy::initDepths() {
+    mDepths.assign(mNames.size(), -1);
+    vector<int> path;
+    for(int t=0; t<mNames.size(); t++) {
+        // walk up to a taxon with known depth, then set the depths on the way back
+        path.clear();
+        int cur = t;
+        while(cur >= 0 && mDepths[cur] < 0) {
+            if(path.size() > mNames.size())
+                error_exit("The taxonomy has a cycle at: " + mNames[t]);
+            path.push_back(cur);
+            cur = mParents[cur];
+        }
+        int depth = cur >= 0 ? mDepths[cur] : -1;
+        for(int i=path.size()-1; i>=0; i--)
+            mDepths[path[i]] = ++depth;
+    }
+}
+
+int Taxonomy::find(const string& name) {
+    unordered_map<string, int>::iterator iter = mIndex.find(name);
+    if(iter == mIndex.end())
+        return -1;
+    return iter->second;
+}
+
+int Taxonomy::findGenome(const string& genomeName) {
+    int taxon = find(genomeName);
+    if(taxon >= 0)
+        return taxon;
+    size_t space = genomeName.find_first_of(" \t");
+    if(space == string::npos)
+        return -1;
+    return find(genomeName.substr(0, space));
+}
+
+// -1 if they are in different trees
+int Taxonomy::lca(int a, int b) {
+    while(a >= 0 && b >= 0 && a != b) {
+        if(mDepths[a] >= mDepths[b])
+            a = mParents[a];
+        else
+            b = mParents[b];
+    }
+    if(a < 0 || b < 0)
+        return -1;
+    return a;
+}
+
+int Taxonomy::ancestorOfRank(int taxon, const string& rank) {
+    while(taxon >= 0 && mRanks[taxon] != rank)
+        taxon = mParents[taxon];
+    return taxon;
+}
+
+bool Taxonomy::test() {
+    Taxonomy tax;
+    // listed before its parents, which are added on the fly
+    int g1 = tax.addTaxon("NC_045512.2");
+    int g2 = tax.addTaxon("MN908947.3");
+    int g3 = tax.addTaxon("NC_004718.3");
+    int g4 = tax.addTaxon("NC_001422.1");
+    int species = tax.addTaxon("SARS-CoV-2");
+    int sars = tax.addTaxon("SARS-CoV");
+    int genus = tax.addTaxon("Betacoronavirus");
+    int family = tax.addTaxon("Coronaviridae");
+    int phix = tax.addTaxon("phiX174");
+    tax.setParent(g1, species);
+    tax.setParent(g2, species);
+    tax.setParent(g3, sars);
+    tax.setParent(species, genus);
+    tax.setParent(sars, genus);
+    tax.setParent(genus, family);
+    tax.setParent(g4, phix);
+    tax.setRank(genus, "Genus");
+    tax.setRank(family, "family");
+    tax.initDepths();
+
+    if(tax.addTaxon("SARS-CoV-2") != species)
+        return false;
+    if(tax.lca(g1, g2) != species || tax.lca(g2, g1) != species)
+        return false;
+    if(tax.lca(g1, g3) != genus || tax.lca(species, g3) != genus)
+        return false;
+    if(tax.lca(g1, g1) != g1 || tax.lca(g1, family) != family)
+        return false;
+    // different trees
+    if(tax.lca(g1, g4) != -1)
+        return false;
+    if(tax.ancestorOfRank(g3, "genus") != genus || tax.ancestorOfRank(g3, "family") != family)
+        return false;
+    if(tax.ancestorOfRank(g4, "genus") != -1)
+        return false;
+    if(tax.findGenome("NC_045512.2 Wuhan seafood market pneumonia virus") != g1 || tax.findGenome("NC_000000.1") != -1)
+        return false;
+
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef TAXONOMY_H
+#define TAXONOMY_H
+
+// includes
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "common.h"
+
+using namespace std;
+
+// a tree of taxa given by a parent map, used to find the lowest common ancestor (LCA)
+// of the genomes sharing a k-mer, and to classify the reads hitting several genomes
+class Taxonomy
+{
+public:
+    Taxonomy();
+
+    // tab separated lines of: name, parent name, and an optional rank (i.e. genus, family)
+    // a taxon is a root if its parent is empty, - or itself
+    void load(string filename);
+
+    // returns the existing one if the name is already added
+    int addTaxon(string name);
+    void setParent(int taxon, int parent);
+    void setRank(int taxon, string rank);
+    // must be called after all taxa are added and before lca()
+    void initDepths();
+
+    // -1 if not found
+    int find(const string& name);
+    // a genome is found by its full name, or the first word of its name
+    int findGenome(const string& genomeName);
+    int lca(int a, int b);
+    // the ancestor (or itself) with the given rank, -1 if none
+    int ancestorOfRank(int taxon, const string& rank);
+
+    int size() {return mNames.size();}
+    string& getName(int taxon) {return mNames[taxon];}
+    string& getRank(int taxon) {return mRanks[taxon];}
+    int getParent(int taxon) {return mParents[taxon];}
+
+    static bool test();
+
+private:
+    vector<string> mNames;
+    vector<string> mRanks;
+    // -1 for a root
+    vector<int> mParents;
+    vector<int> mDepths;
+    unordered_map<string, int> mIndex;
+};
+
+#endif
@@ -9,6 +9,15 @@
 #include "polyx.h"
 #include "nucleotidetree.h"
 #include "evaluator.h"
+#include "kmer.h"
+#include "taxonomy.h"
+#include "abundance.h"
+#include "succinctindex.h"
+#include "depthhistogram.h"
+#include "bloomfilter.h"
+#include "editdistance.h"
+#include "kmercollection.h"
+#include "genomes.h"
 #include <time.h>
 
 UnitTest::UnitTest(){
@@ -26,6 +35,15 @@ void UnitTest::run(){
     passed &= report(PolyX::test(), "PolyX::test");
     passed &= report(NucleotideTree::test(), "NucleotideTree::test");
     passed &= report(Evaluator::test(), "Evaluator::test");
+    passed &= report(Kmer::test(), "Kmer::test");
+    passed &= report(Taxonomy::test(), "Taxonomy::test");
+    passed &= report(AbundanceEstimator::test(), "AbundanceEstimator::test");
+    passed &= report(SuccinctIndex::test(), "SuccinctIndex::test");
+    passed &= report(DepthHistogram::test(), "DepthHistogram::test");
+    passed &= report(BloomFilter::test(), "BloomFilter::test");
+    passed &= report(editdistance_test(), "editdistance_test");
+    passed &= report(KmerCollection::test(), "KmerCollection::test");
+    passed &= report(Genomes::test(), "Genomes::test");
     printf("\n==========================\n");
     printf("%s\n\n", passed?"ALL PASSED":"FAILED");
 }
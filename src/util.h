@@ -9,6 +9,14 @@
 #include <algorithm>
 #include <time.h>
 #include <mutex>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <thread>
+#include <functional>
+#include <string.h>
+#include "common.h"
+#include "zlib/zlib.h"
 
 using namespace std;
 
@@ -271,4 +279,70 @@ inline void loginfo(const string s){
     logmtx.unlock();
 }
 
+// current resident set size in MB, 0 if it cannot be read
+inline double current_rss_mb() {
+    long pages = 0;
+    long resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if(fp == NULL)
+        return 0.0;
+    if(fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return (double)resident * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+// peak resident set size in MB
+inline double peak_rss_mb() {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0.0;
+#ifdef __APPLE__
+    return (double)usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return (double)usage.ru_maxrss / 1024.0;
+#endif
+}
+
+// run task(0) ... task(threads-1) each in its own thread, and wait for all of them
+inline void run_in_threads(int threads, function<void(int)> task) {
+    if(threads <= 1) {
+        task(0);
+        return;
+    }
+    vector<thread> workers;
+    for(int t=0; t<threads; t++)
+        workers.push_back(thread(task, t));
+    for(int t=0; t<threads; t++)
+        workers[t].join();
+}
+
+// every section of a binary index (.kci, .kcs and .gni) is padded to this many bytes,
+// so that the mapped arrays start at cache lines
+#define INDEX_SECTION_ALIGN 64
+
+inline uint64 index_section_bytes(uint64 bytes) {
+    return (bytes + INDEX_SECTION_ALIGN - 1) / INDEX_SECTION_ALIGN * INDEX_SECTION_ALIGN;
+}
+
+// crc32 of the bytes, continuing from crc to checksum more than one range
+inline uint32 index_checksum(const char* data, uint64 bytes, uint32 crc = 0) {
+    // crc32() takes 32-bit lengths
+    const uint64 chunk = 1UL<<30;
+    while(bytes > 0) {
+        uint64 len = min(bytes, chunk);
+        crc = crc32(crc, (const Bytef*)data, len);
+        data += len;
+        bytes -= len;
+    }
+    return crc;
+}
+
+// copy a section to an index, pad it to INDEX_SECTION_ALIGN, and return the end
+inline char* copy_index_section(char* dst, const char* data, uint64 bytes) {
+    memcpy(dst, data, bytes);
+    memset(dst + bytes, 0, index_section_bytes(bytes) - bytes);
+    return dst + index_section_bytes(bytes);
+}
+
 #endif /* UTIL_H */
@@ -1,34 +1,80 @@
 #include "virusdetector.h"
+#include "util.h"
+#include <algorithm>
 
 VirusDetector::VirusDetector(Options* opt){
     mOptions = opt;
+    mRSSBeforeLoading = current_rss_mb();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
 
-    mKmer = NULL;
-    if(!mOptions->kmerFile.empty())
-        mKmer = new Kmer(mOptions->kmerFile, opt);
+    for(int i=0; i<mOptions->kmerFiles.size(); i++)
+        mKmers.push_back(new Kmer(mOptions->kmerFiles[i], opt));
 
-    mKmerCollection = NULL;
-    if(!mOptions->kmerCollectionFile.empty())
-        mKmerCollection = new KmerCollection(mOptions->kmerCollectionFile, opt);
+    for(int i=0; i<mOptions->kmerCollectionFiles.size(); i++)
+        mKmerCollections.push_back(new KmerCollection(mOptions->kmerCollectionFiles[i], opt));
 
-    // no KMER file, the kmerKeyLen is not intialized
-    if(mOptions->kmerKeyLen == 0)
-        mOptions->kmerKeyLen = 25;
+    // the genomes are seeded with the k of the first KMER or k-mer collection file, or 25 if none
+    if(mOptions->kmerKeyLen == 0) {
+        if(mKmers.size() > 0)
+            mOptions->kmerKeyLen = mKmers[0]->getKeyLen();
+        else if(mKmerCollections.size() > 0)
+            mOptions->kmerKeyLen = mKmerCollections[0]->getKeyLen();
+        else
+            mOptions->kmerKeyLen = 25;
+    }
     mGenomes = NULL;
     if(!mOptions->genomeFile.empty())
         mGenomes = new Genomes(mOptions->genomeFile, opt);
     mHits = 0;
+
+    initLanes();
+
+    mLoadingTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    mRSSAfterLoading = current_rss_mb();
+    if(mOptions->verbose)
+        loginfo("Loaded in " + to_string(mLoadingTime) + " seconds, RSS " + to_string(mRSSBeforeLoading) + " MB -> " + to_string(mRSSAfterLoading) + " MB");
 }
 
-VirusDetector::~VirusDetector(){
-    if(mKmer) {
-        delete mKmer;
-        mKmer = NULL;
+void VirusDetector::initLanes() {
+    for(int i=0; i<mKmers.size(); i++)
+        getLane(mKmers[i]->getKeyLen()).mKmers.push_back(mKmers[i]);
+    for(int i=0; i<mKmerCollections.size(); i++)
+        getLane(mKmerCollections[i]->getKeyLen()).mKmerCollectionIds.push_back(i);
+    if(mGenomes)
+        getLane(mOptions->kmerKeyLen).mGenomes = true;
+
+    mMinKeyLen = mLanes.empty() ? mOptions->kmerKeyLen : mLanes[0].mKeyLen;
+    mHasWideLane = !mLanes.empty() && !KmerKey<uint64>::fits(mLanes.back().mKeyLen);
+
+    if(mOptions->verbose) {
+        for(int l=0; l<mLanes.size(); l++) {
+            loginfo("k=" + to_string(mLanes[l].mKeyLen) + ": " + to_string(mLanes[l].mKmers.size()) + " KMER file(s), "
+                + to_string(mLanes[l].mKmerCollectionIds.size()) + " k-mer collection file(s)"
+                + (mLanes[l].mGenomes ? ", genomes" : ""));
+        }
     }
-    if(mKmerCollection) {
-        delete mKmerCollection;
-        mKmerCollection = NULL;
+}
+
+ScanLane& VirusDetector::getLane(int keylen) {
+    int l = 0;
+    while(l < mLanes.size() && mLanes[l].mKeyLen < keylen)
+        l++;
+    if(l == mLanes.size() || mLanes[l].mKeyLen != keylen) {
+        ScanLane lane;
+        lane.mKeyLen = keylen;
+        lane.mGenomes = false;
+        mLanes.insert(mLanes.begin() + l, lane);
     }
+    return mLanes[l];
+}
+
+VirusDetector::~VirusDetector(){
+    for(int i=0; i<mKmers.size(); i++)
+        delete mKmers[i];
+    mKmers.clear();
+    for(int i=0; i<mKmerCollections.size(); i++)
+        delete mKmerCollections[i];
+    mKmerCollections.clear();
     if(mGenomes) {
         delete mGenomes;
         mGenomes = NULL;
@@ -36,132 +82,286 @@ VirusDetector::~VirusDetector(){
 }
 
 void VirusDetector::report() {
-    if(mKmer) {
-        cerr << "Coverage for target unique KMER file:"<<endl;
-        mKmer->report();
+    for(int i=0; i<mKmers.size(); i++) {
+        cerr << "Coverage for target unique KMER file " << mKmers[i]->getFilename() << ":"<<endl;
+        mKmers[i]->report();
     }
-    if(mKmerCollection) {
-        cerr << endl << "Detection result for provided KMER collection:"<<endl;
-        mKmerCollection->report();
+    for(int i=0; i<mKmerCollections.size(); i++) {
+        cerr << endl << "Detection result for KMER collection " << mKmerCollections[i]->getFilename() << ":"<<endl;
+        mKmerCollections[i]->report();
     }
     if(mGenomes) {
         //mGenomes->report();
+        if(!mOptions->depthBedGraphFile.empty())
+            mGenomes->writeBedGraph(mOptions->depthBedGraphFile);
+        if(mOptions->needPileup())
+            mGenomes->writeConsensus(mOptions->consensusFile, mOptions->variantFile);
     }
 }
 
-bool VirusDetector::detect(Read* r) {
-    if(r->length() >= mOptions->longReadThreshold) {
-        // long reads, split it
-        vector<Read*> reads = r->split(mOptions->segmentLength);
-        bool detected = false;
-        for(int i=0; i<reads.size(); i++) {
-            // recursive
-            detected |= detect(reads[i]);
-            delete reads[i];
-            reads[i] = NULL;
-        }
-        return detected;
-    }
+bool VirusDetector::detect(Read* r, ReadHits* hits) {
     string& seq = r->mSeq.mStr;
     Sequence rSequence = ~(r->mSeq);
     string& rseq = rSequence.mStr;
 
-    return scan(seq) | scan(rseq);
+    return scan(seq, hits) | scan(rseq, hits);
 }
 
-bool VirusDetector::scan(string& seq) {
-    int hitCount = 0;
+bool VirusDetector::scan(string& seq, ReadHits* hits) {
+    uint32 len = seq.length();
+    if(len < mMinKeyLen)
+        return false;
 
-    int keylen = mOptions->kmerKeyLen;
-    int blankBits = 64 - 2*keylen;
+    // long reads are scanned in place with a sliding window of segmentLength,
+    // instead of being split to many short reads
+    uint32 windowLen = len;
+    if(len >= mOptions->longReadThreshold)
+        windowLen = mOptions->segmentLength;
 
-    bool onlyHitOneGenome = true;
-    uint32 lastGenomeID = 0;
+    const char* data = seq.c_str();
+    int hitCount = 0;
+    bool wellMapped = false;
 
-    if(seq.length() < keylen)
-        return false;
+    int kcNum = mKmerCollections.size();
+    bool needCounting = mKmers.size() > 0 || kcNum > 0;
 
-    bool valid = true;
-    bool needAlignment = false;
-
-    uint32 start = 0;
-    uint64 key = Kmer::seq2uint64(seq, start, keylen-1, valid);
-    while(valid == false) {
-        start++;
-        key = Kmer::seq2uint64(seq, start, keylen-1, valid);
-        // reach the tail
-        if(start >= seq.length() - keylen)
-            return false;
-    }
-    for(uint32 pos = start; pos < seq.length() - keylen; pos++) {
-        key = (key << 2);
-        switch(seq[pos + keylen-1]) {
+    // a k-mer belongs to the window it ends in, so that all lanes move to the next window together
+    ScanWindow window;
+    window.mThread = hits ? hits->mThread : 0;
+    window.reset(0, kcNum, hits != NULL);
+
+    // the last 32 bases, not trimmed, also used by the spaced seeds
+    uint64 key = 0;
+    // the last 64 bases, only rolled if any k > 32
+    uint128 wideKey = 0;
+    // how many continuous valid bases have been rolled into the keys
+    int validBases = 0;
+    for(uint32 i = 0; i < len; i++) {
+        uint64 base = 0;
+        switch(data[i]) {
             case 'A':
-                key += 0;
+                base = 0;
                 break;
             case 'T':
-                key += 1;
+                base = 1;
                 break;
             case 'C':
-                key += 2;
+                base = 2;
                 break;
             case 'G':
-                key += 3;
+                base = 3;
                 break;
             case 'N':
             default:
-                // we have to skip the segments covering this N
-                if(pos >= seq.length() - keylen)
-                    continue;
-                pos++;
-                key = Kmer::seq2uint64(seq, pos, keylen-1, valid);
-                bool outterBreak = false;
-                while(valid == false) {
-                    pos++;
-                    key = Kmer::seq2uint64(seq, pos, keylen-1, valid);
-                    // reach the tail
-                    if(pos >= seq.length() - keylen) {
-                        outterBreak = true;
-                        break;
-                    }
-                }
-                if(outterBreak)
-                    break;
-
+                // we have to skip the k-mers covering this N
+                validBases = 0;
                 continue;
         }
-        key = (key << blankBits) >> blankBits;
+        key = (key << 2) + base;
+        if(mHasWideLane)
+            wideKey = (wideKey << 2) + base;
+        validBases++;
+        if(validBases < mMinKeyLen)
+            continue;
 
-        // add to genome stats
-        if(!needAlignment && mGenomes && mGenomes->hasKey(key)) {
-            needAlignment = true;
-            if(!mKmer)
+        // move to the window this k-mer ends in
+        if(i >= window.mStart + windowLen) {
+            wellMapped |= finishWindow(data, len, windowLen, window, hits);
+            window.reset((i / windowLen) * windowLen, kcNum, hits != NULL);
+        }
+
+        for(int l=0; l<mLanes.size(); l++) {
+            ScanLane& lane = mLanes[l];
+            // the lanes are sorted by k
+            if(validBases < lane.mKeyLen)
                 break;
+            if(KmerKey<uint64>::fits(lane.mKeyLen))
+                scanLane<uint64>(lane, KmerKey<uint64>::trim(key, lane.mKeyLen), window, hitCount);
+            else
+                scanLane<uint128>(lane, KmerKey<uint128>::trim(wideKey, lane.mKeyLen), window, hitCount);
         }
 
-        // add to Kmer stas
-        if(mKmer) {
-            bool hit = mKmer->add(key);
-            if(hit)
-                hitCount++;
+        if(!window.mNeedAlignment && mGenomes && mGenomes->hasSpacedSeedHit(key, validBases, window.mThread))
+            window.mNeedAlignment = true;
+
+        // nothing else to count in this window, jump to the next one
+        if(window.mNeedAlignment && !needCounting) {
+            i = window.mStart + windowLen - 1;
+            validBases = 0;
         }
+    }
 
-        if(mKmerCollection) {
-            uint32 gid = mKmerCollection->add(key);
-            if(gid > 0) {
-                if(lastGenomeID!=0 && gid!=lastGenomeID)
-                    onlyHitOneGenome = false;
-                lastGenomeID = gid;
-            }
+    wellMapped |= finishWindow(data, len, windowLen, window, hits);
+
+    return hitCount>0 || wellMapped;
+}
+
+template<typename KeyType>
+inline void VirusDetector::scanLane(ScanLane& lane, KeyType key, ScanWindow& window, int& hitCount) {
+    // add to genome stats
+    if(lane.mGenomes && !window.mNeedAlignment && mGenomes->hasKey<KeyType>(key, window.mThread))
+        window.mNeedAlignment = true;
+
+    // add to Kmer stas
+    for(int k=0; k<lane.mKmers.size(); k++) {
+        bool hit = lane.mKmers[k]->add<KeyType>(key);
+        if(hit)
+            hitCount++;
+    }
+
+    for(int k=0; k<lane.mKmerCollectionIds.size(); k++) {
+        int c = lane.mKmerCollectionIds[k];
+        // the k-mers sharing minimizers are looked up together
+        if(mKmerCollections[c]->isSuccinct()) {
+            window.mBatchKeys[c].push_back(KmerKey<KeyType>::fold(key));
+            continue;
         }
+        addHit(window, c, mKmerCollections[c]->add<KeyType>(key));
     }
+}
 
-    if(mKmerCollection && onlyHitOneGenome && lastGenomeID>0)
-        mKmerCollection->addGenomeRead(lastGenomeID);
+inline void VirusDetector::addHit(ScanWindow& window, int c, uint32 gid) {
+    if(gid > 0 && window.mKeepHitIds)
+        window.mHitIds[c].push_back(gid);
+    // the shared k-mers only classify the reads
+    if(gid > 0 && (gid & KC_SET_BIT) == 0) {
+        if(window.mLastGenomeID[c]!=0 && gid!=window.mLastGenomeID[c])
+            window.mOnlyHitOneGenome[c] = false;
+        window.mLastGenomeID[c] = gid;
+    }
+}
 
-    bool wellMapped = false;
-    if(needAlignment && mGenomes)
-        wellMapped = mGenomes->align(seq);
+bool VirusDetector::finishWindow(const char* data, uint32 len, uint32 windowLen, ScanWindow& window, ReadHits* hits) {
+    for(int c=0; c<mKmerCollections.size(); c++) {
+        vector<uint64>& keys = window.mBatchKeys[c];
+        if(!keys.empty()) {
+            window.mBatchIds.resize(keys.size());
+            mKmerCollections[c]->addBatch(keys.data(), keys.size(), window.mBatchIds.data());
+            for(int i=0; i<keys.size(); i++)
+                addHit(window, c, window.mBatchIds[i]);
+        }
+        if(window.mOnlyHitOneGenome[c] && window.mLastGenomeID[c]>0)
+            mKmerCollections[c]->addGenomeRead(window.mLastGenomeID[c]);
+        if(window.mHitIds[c].empty())
+            continue;
+        if(hits)
+            hits->mHitIds[c].insert(hits->mHitIds[c].end(), window.mHitIds[c].begin(), window.mHitIds[c].end());
+    }
 
-    return hitCount>0 || wellMapped;
-}
\ No newline at end of file
+    // only the windows with seed hits are sent to alignment
+    if(!window.mNeedAlignment || !mGenomes)
+        return false;
+
+    uint32 alignLen = min(windowLen, len - window.mStart);
+    return mGenomes->align(data + window.mStart, alignLen, window.mThread);
+}
+
+// a read (pair) is classified once, by the hits of all its windows on both strands
+void VirusDetector::addReadHits(ReadHits& hits) {
+    for(int c=0; c<mKmerCollections.size(); c++) {
+        if(hits.mHitIds[c].empty())
+            continue;
+        KmerCollection* kc = mKmerCollections[c];
+        kc->addReadHits(hits.mHitIds[c], hits.mClasses[c]);
+        if(kc->hasTaxonomy()) {
+            hits.mTaxa[c] = kc->classify(hits.mHitIds[c]);
+            if(hits.mTaxa[c] >= 0)
+                hits.mTaxonReads[c][hits.mTaxa[c]]++;
+        }
+    }
+}
+
+void VirusDetector::flushReadHits(ReadHits& hits) {
+    for(int c=0; c<mKmerCollections.size(); c++)
+        mKmerCollections[c]->mergeClasses(hits.mClasses[c], hits.mTaxonReads[c]);
+}
+
+// the binary records are little-endian, see README for the layout
+template<typename T>
+static inline void appendBinary(string& out, T value) {
+    out.append((const char*)&value, sizeof(T));
+}
+
+string VirusDetector::classificationHeader() {
+    string header;
+    if(mOptions->classificationFormat == "tsv") {
+        header = "#read\tcollection\tgenome_id\tgenome\tgenome_hits\ttotal_hits\ttaxon\n";
+        return header;
+    }
+
+    header.append("FVRC", 4);
+    appendBinary<uint32>(header, 1);
+    appendBinary<uint8>(header, mKmerCollections.size());
+    for(int c=0; c<mKmerCollections.size(); c++) {
+        KmerCollection* kc = mKmerCollections[c];
+        appendBinary<uint32>(header, kc->getGenomeNum());
+        for(uint32 id=1; id<=kc->getGenomeNum(); id++)
+            header.append(kc->getGenomeName(id).c_str(), kc->getGenomeName(id).length() + 1);
+        Taxonomy* taxonomy = kc->getTaxonomy();
+        int taxonNum = taxonomy ? taxonomy->size() : 0;
+        appendBinary<uint32>(header, taxonNum);
+        for(int t=0; t<taxonNum; t++)
+            header.append(taxonomy->getName(t).c_str(), taxonomy->getName(t).length() + 1);
+    }
+    return header;
+}
+
+void VirusDetector::appendClassification(const string& readName, ReadHits& hits, string& out) {
+    // the read name without @ and the comment
+    size_t nameStart = (!readName.empty() && readName[0] == '@') ? 1 : 0;
+    size_t nameEnd = readName.find_first_of(" \t", nameStart);
+    if(nameEnd == string::npos)
+        nameEnd = readName.length();
+    bool binary = mOptions->classificationFormat == "binary";
+
+    for(int c=0; c<mKmerCollections.size(); c++) {
+        vector<uint32>& ids = hits.mHitIds[c];
+        if(ids.empty())
+            continue;
+        KmerCollection* kc = mKmerCollections[c];
+
+        // the genome with the most hits, or 0 if tied
+        vector<uint32> genomeIds;
+        for(int i=0; i<ids.size(); i++) {
+            if((ids[i] & KC_SET_BIT) == 0)
+                genomeIds.push_back(ids[i]);
+        }
+        sort(genomeIds.begin(), genomeIds.end());
+        uint32 genome = 0;
+        uint32 genomeHits = 0;
+        for(int i=0; i<genomeIds.size(); ) {
+            int j = i;
+            while(j < genomeIds.size() && genomeIds[j] == genomeIds[i])
+                j++;
+            uint32 count = j - i;
+            if(count > genomeHits) {
+                genome = genomeIds[i];
+                genomeHits = count;
+            } else if(count == genomeHits) {
+                genome = 0;
+            }
+            i = j;
+        }
+        int taxon = hits.mTaxa[c];
+
+        if(binary) {
+            uint16 nameLen = min(nameEnd - nameStart, (size_t)0xFFFF);
+            appendBinary<uint16>(out, nameLen);
+            out.append(readName, nameStart, nameLen);
+            appendBinary<uint8>(out, c);
+            appendBinary<uint32>(out, genome);
+            appendBinary<uint32>(out, genomeHits);
+            appendBinary<uint32>(out, ids.size());
+            appendBinary<int32>(out, taxon);
+        } else {
+            out.append(readName, nameStart, nameEnd - nameStart);
+            out += "\t" + to_string(c);
+            out += "\t" + to_string(genome);
+            out += "\t" + (genome > 0 ? kc->getGenomeName(genome) : string("-"));
+            out += "\t" + to_string(genomeHits);
+            out += "\t" + to_string(ids.size());
+            out += "\t" + (taxon >= 0 ? kc->getTaxonomy()->getName(taxon) : string("-"));
+            out += "\n";
+        }
+    }
+}
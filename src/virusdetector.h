@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string>
 #include <vector>
+#include <chrono>
 #include "options.h"
 #include "read.h"
 #include "kmer.h"
@@ -13,25 +14,123 @@
 
 using namespace std;
 
+// the databases sharing the same k-mer length are looked up with the same key
+class ScanLane {
+public:
+    int mKeyLen;
+    vector<Kmer*> mKmers;
+    // indexes of VirusDetector::mKmerCollections
+    vector<int> mKmerCollectionIds;
+    bool mGenomes;
+};
+
+// the states of the window being scanned
+class ScanWindow {
+public:
+    inline void reset(uint32 start, int kcNum, bool keepHitIds) {
+        mStart = start;
+        mKeepHitIds = keepHitIds;
+        mNeedAlignment = false;
+        for(int c=0; c<kcNum; c++) {
+            mOnlyHitOneGenome[c] = true;
+            mLastGenomeID[c] = 0;
+            mHitIds[c].clear();
+            mBatchKeys[c].clear();
+        }
+    }
+
+public:
+    uint32 mStart;
+    // the worker thread scanning this window
+    int mThread;
+    bool mNeedAlignment;
+    // keep the hits of all the k-mer collections for the per-read classification output
+    bool mKeepHitIds;
+    // one per k-mer collection
+    bool mOnlyHitOneGenome[MAX_KMER_DATABASES];
+    uint32 mLastGenomeID[MAX_KMER_DATABASES];
+    // all the hits, only kept if mKeepHitIds
+    vector<uint32> mHitIds[MAX_KMER_DATABASES];
+    // the keys to look up together when the window is finished, only for the succinct k-mer collection indexes
+    vector<uint64> mBatchKeys[MAX_KMER_DATABASES];
+    vector<uint32> mBatchIds;
+};
+
+// the k-mer collection hits of a read or a read pair, for the abundance estimation and the per-read classification output
+// a worker thread keeps one for a pack of reads
+class ReadHits {
+public:
+    ReadHits(int thread = 0) {
+        mThread = thread;
+    }
+
+    inline void reset(int kcNum) {
+        for(int c=0; c<kcNum; c++) {
+            mHitIds[c].clear();
+            mTaxa[c] = -1;
+        }
+    }
+
+public:
+    // one per k-mer collection, all the hits of both strands
+    vector<uint32> mHitIds[MAX_KMER_DATABASES];
+    // the taxon of the read by every k-mer collection with a taxonomy, -1 if not classified
+    int mTaxa[MAX_KMER_DATABASES];
+    // the equivalence classes and the classified reads of every taxon of the reads of this pack, one per k-mer collection
+    EquivalenceClasses mClasses[MAX_KMER_DATABASES];
+    unordered_map<int, long> mTaxonReads[MAX_KMER_DATABASES];
+    // the index of the worker thread, which has its own GenomeWorker
+    int mThread;
+};
+
 class VirusDetector{
 public:
     VirusDetector(Options* opt);
     ~VirusDetector();
-    bool detect(Read* r);
-    bool scan(string& seq);
+    // the k-mer collection hits are appended to hits if it's not NULL
+    // the worker threads must pass their own hits, since the GenomeWorker is chosen by hits->mThread
+    bool detect(Read* r, ReadHits* hits = NULL);
+    bool scan(string& seq, ReadHits* hits = NULL);
     void report();
+    // adds the hits of a read (pair) to the equivalence classes of the pack
+    void addReadHits(ReadHits& hits);
+    // merges the equivalence classes of the pack to the k-mer collections
+    void flushReadHits(ReadHits& hits);
+    // the header of the per-read classification output, the binary one has the genome and taxon names
+    string classificationHeader();
+    // one record per k-mer collection hit by the read (pair)
+    void appendClassification(const string& readName, ReadHits& hits, string& out);
 
-    Kmer* getKmer() {return mKmer;}
+    vector<Kmer*>& getKmers() {return mKmers;}
     Genomes* getGenomes() {return mGenomes;}
-    KmerCollection* getKmerCollection() {return mKmerCollection;}
+    vector<KmerCollection*>& getKmerCollections() {return mKmerCollections;}
+    double getLoadingTime() {return mLoadingTime;}
+    double getRSSBeforeLoading() {return mRSSBeforeLoading;}
+    double getRSSAfterLoading() {return mRSSAfterLoading;}
 
+private:
+    void initLanes();
+    ScanLane& getLane(int keylen);
+    template<typename KeyType>
+    inline void scanLane(ScanLane& lane, KeyType key, ScanWindow& window, int& hitCount);
+    inline void addHit(ScanWindow& window, int c, uint32 gid);
+    bool finishWindow(const char* data, uint32 len, uint32 windowLen, ScanWindow& window, ReadHits* hits);
 
 private:
     Options* mOptions;
     Genomes* mGenomes;
-    Kmer* mKmer;
-    KmerCollection* mKmerCollection;
+    vector<Kmer*> mKmers;
+    vector<KmerCollection*> mKmerCollections;
+    // one lane per distinct k, sorted by k
+    vector<ScanLane> mLanes;
+    int mMinKeyLen;
+    // whether any k > 32, which needs the 128-bit rolling key
+    bool mHasWideLane;
     uint64 mHits;
+    // the cost of loading the k-mer files, k-mer collections and genomes
+    double mLoadingTime;
+    double mRSSBeforeLoading;
+    double mRSSAfterLoading;
 };
 
 